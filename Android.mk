@@ -45,15 +45,27 @@ LOCAL_C_INCLUDES := \
 	$(LOCAL_PATH)/include
 
 LOCAL_SRC_FILES := \
+	src/common_async.c \
 	src/common_bridge.c \
 	src/common_capability.c \
+	src/common_config.c \
 	src/common_device_name.c \
+	src/common_diff.c \
+	src/common_foreach.c \
+	src/common_image.c \
+	src/common_index.c \
 	src/common_init.c \
 	src/common_interface.c \
 	src/common_io.c \
 	src/common_iterator.c \
 	src/common_map.c \
+	src/common_match.c \
+	src/common_sampler.c \
+	src/common_transaction.c \
 	src/common_vgaarb.c \
+	src/common_watch.c \
+	src/common_workqueue.c \
+	src/linux_broker.c \
 	src/linux_devmem.c \
 	src/linux_sysfs.c
 
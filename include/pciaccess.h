@@ -58,6 +58,7 @@
 #define PCIACCESS_H
 
 #include <inttypes.h>
+#include <stddef.h>
 
 #if __GNUC__ >= 3
 #define __deprecated __attribute__((deprecated))
@@ -69,8 +70,58 @@ typedef uint64_t pciaddr_t;
 
 struct pci_device;
 struct pci_device_iterator;
+struct pci_context;
+struct pci_device_index;
+struct pci_match_table;
 struct pci_id_match;
 struct pci_slot_match;
+struct pci_device_cfg_op;
+struct pci_cfg_request;
+struct pci_cfg_txn;
+struct pci_cfg_lock_stats;
+struct pci_config_change;
+struct pci_watch;
+struct pci_sampler;
+struct pci_sample_reg;
+struct pci_sample;
+struct pci_sample_ring;
+
+/**
+ * Completion callback of an asynchronous config space access.
+ *
+ * \param req    Request that completed.  It is released when the callback
+ *               returns.
+ * \param err    Result of the access: zero or an \c errno value.
+ * \param bytes  Number of bytes transferred.
+ * \param user   Value passed when the request was submitted.
+ *
+ * \sa pci_device_cfg_read_async, pci_system_cfg_async_dispatch
+ */
+typedef void (*pci_cfg_callback)(struct pci_cfg_request *req, int err,
+    pciaddr_t bytes, void *user);
+
+/**
+ * Callback of a register watch.
+ *
+ * \param dev        Device the register belongs to.
+ * \param offset     Offset of the register.
+ * \param old_value  Previous value of the watched bits.
+ * \param new_value  Current value of the watched bits.
+ * \param user       Value passed to \c pci_device_watch.
+ */
+typedef void (*pci_watch_callback)(struct pci_device *dev, pciaddr_t offset,
+    uint32_t old_value, uint32_t new_value, void *user);
+
+/**
+ * Function called for each device by \c pci_system_foreach.
+ *
+ * \param dev   Device to work on.
+ * \param data  Value passed to \c pci_system_foreach.
+ *
+ * \return
+ * Zero to continue, or any other value to stop the walk.
+ */
+typedef int (*pci_device_foreach_func)(struct pci_device *dev, void *data);
 
 #ifdef __cplusplus
 extern "C" {
@@ -102,6 +153,12 @@ int __deprecated pci_device_unmap_memory_range(struct pci_device *dev,
 
 int pci_device_probe(struct pci_device *dev);
 
+int pci_system_probe_all(unsigned flags, struct pci_device **devs,
+    unsigned num_devs, int *errors);
+
+int pci_context_probe_all(struct pci_context *ctx, unsigned flags,
+    struct pci_device **devs, unsigned num_devs, int *errors);
+
 const struct pci_agp_info *pci_device_get_agp_info(struct pci_device *dev);
 
 const struct pci_bridge_info *pci_device_get_bridge_info(
@@ -115,10 +172,44 @@ int pci_device_get_bridge_buses(struct pci_device *dev, int *primary_bus,
 
 int pci_system_init(void);
 
+int pci_system_init_flags(unsigned flags);
+
+int pci_system_init_filtered(const struct pci_id_match *matches,
+    unsigned num_matches);
+
+int pci_system_init_filtered_slots(const struct pci_slot_match *matches,
+    unsigned num_matches);
+
 void pci_system_init_dev_mem(int fd);
 
 void pci_system_cleanup(void);
 
+int pci_system_write_image(const char *path);
+
+int pci_system_set_cfg_readahead(unsigned window_usec);
+
+struct pci_context *pci_context_create(unsigned flags);
+
+struct pci_context *pci_context_create_filtered(unsigned flags,
+    const struct pci_id_match *ids, unsigned num_ids,
+    const struct pci_slot_match *slots, unsigned num_slots);
+
+void pci_context_destroy(struct pci_context *ctx);
+
+struct pci_context *pci_context_default(void);
+
+int pci_context_set_cfg_readahead(struct pci_context *ctx,
+    unsigned window_usec);
+
+struct pci_device_iterator *pci_context_slot_match_iterator_create(
+    struct pci_context *ctx, const struct pci_slot_match *match);
+
+struct pci_device_iterator *pci_context_id_match_iterator_create(
+    struct pci_context *ctx, const struct pci_id_match *match);
+
+struct pci_device *pci_context_find_by_slot(struct pci_context *ctx,
+    uint32_t domain, uint32_t bus, uint32_t dev, uint32_t func);
+
 struct pci_device_iterator *pci_slot_match_iterator_create(
     const struct pci_slot_match *match);
 
@@ -129,9 +220,36 @@ void pci_iterator_destroy(struct pci_device_iterator *iter);
 
 struct pci_device *pci_device_next(struct pci_device_iterator *iter);
 
+struct pci_device_iterator *pci_device_iterator_split(
+    struct pci_device_iterator *iter);
+
+int pci_system_foreach(const struct pci_id_match *match,
+    pci_device_foreach_func func, void *data, unsigned num_threads,
+    unsigned flags);
+
+int pci_context_foreach(struct pci_context *ctx,
+    const struct pci_id_match *match, pci_device_foreach_func func,
+    void *data, unsigned num_threads, unsigned flags);
+
+const struct pci_device_index *pci_system_get_device_index(void);
+
+const struct pci_device_index *pci_context_get_device_index(
+    struct pci_context *ctx);
+
 struct pci_device *pci_device_find_by_slot(uint32_t domain, uint32_t bus,
     uint32_t dev, uint32_t func);
 
+struct pci_match_table *pci_match_table_compile(
+    const struct pci_id_match *matches, unsigned num_matches);
+
+void pci_match_table_destroy(struct pci_match_table *table);
+
+const struct pci_id_match *pci_match_table_lookup(
+    const struct pci_match_table *table, const struct pci_device *dev);
+
+unsigned pci_match_table_annotate(const struct pci_match_table *table,
+    const struct pci_device_index *idx, const struct pci_id_match **results);
+
 struct pci_device *pci_device_get_parent_bridge(struct pci_device *dev);
 
 void pci_get_strings(const struct pci_id_match *m,
@@ -146,6 +264,8 @@ void pci_device_enable(struct pci_device *dev);
 
 int pci_device_cfg_read    (struct pci_device *dev, void *data,
     pciaddr_t offset, pciaddr_t size, pciaddr_t *bytes_read);
+int pci_device_cfg_read_flags(struct pci_device *dev, void *data,
+    pciaddr_t offset, pciaddr_t size, pciaddr_t *bytes_read, unsigned flags);
 int pci_device_cfg_read_u8 (struct pci_device *dev, uint8_t  *data,
     pciaddr_t offset);
 int pci_device_cfg_read_u16(struct pci_device *dev, uint16_t *data,
@@ -163,6 +283,65 @@ int pci_device_cfg_write_u32(struct pci_device *dev, uint32_t data,
     pciaddr_t offset);
 int pci_device_cfg_write_bits(struct pci_device *dev, uint32_t mask,
     uint32_t data, pciaddr_t offset);
+int pci_device_cfg_write_bits_flags(struct pci_device *dev, uint32_t mask,
+    uint32_t data, pciaddr_t offset, unsigned flags);
+int pci_device_get_cfg_lock_stats(struct pci_device *dev,
+    struct pci_cfg_lock_stats *stats);
+
+int pci_device_cfg_readv(struct pci_device *dev,
+    const struct pci_device_cfg_op *ops, unsigned num_ops);
+int pci_device_cfg_readv_flags(struct pci_device *dev,
+    const struct pci_device_cfg_op *ops, unsigned num_ops, unsigned flags);
+int pci_device_cfg_writev(struct pci_device *dev,
+    const struct pci_device_cfg_op *ops, unsigned num_ops);
+
+int pci_system_cfg_read_many(struct pci_device **devs, unsigned num_devs,
+    pciaddr_t offset, unsigned width, void *out);
+
+struct pci_cfg_request *pci_device_cfg_read_async(struct pci_device *dev,
+    void *data, pciaddr_t offset, pciaddr_t size,
+    pci_cfg_callback callback, void *user);
+struct pci_cfg_request *pci_device_cfg_write_async(struct pci_device *dev,
+    const void *data, pciaddr_t offset, pciaddr_t size,
+    pci_cfg_callback callback, void *user);
+int pci_cfg_request_wait(struct pci_cfg_request *req, pciaddr_t *bytes);
+int pci_system_cfg_async_fd(void);
+int pci_system_cfg_async_dispatch(void);
+
+struct pci_cfg_txn *pci_device_cfg_begin(struct pci_device *dev);
+int pci_cfg_txn_write_bits(struct pci_cfg_txn *txn, uint32_t mask,
+    uint32_t data, pciaddr_t offset, unsigned width);
+int pci_cfg_txn_barrier(struct pci_cfg_txn *txn);
+int pci_device_cfg_commit(struct pci_cfg_txn *txn);
+void pci_device_cfg_abort(struct pci_cfg_txn *txn);
+
+int pci_device_read_config_snapshot(struct pci_device *dev, void *buffer,
+    pciaddr_t size, pciaddr_t *bytes_read);
+const uint8_t *pci_device_cfg_view(struct pci_device *dev, pciaddr_t *len);
+uint64_t pci_device_cfg_generation(struct pci_device *dev);
+
+int pci_system_config_diff(struct pci_config_change **changes,
+    unsigned *num_changes);
+
+struct pci_watch *pci_device_watch(struct pci_device *dev, pciaddr_t offset,
+    unsigned width, uint32_t mask, unsigned period_ms,
+    pci_watch_callback callback, void *user);
+int pci_device_unwatch(struct pci_watch *watch);
+
+struct pci_sampler *pci_sampler_start(const struct pci_sample_reg *regs,
+    unsigned num_regs, unsigned period_usec, unsigned num_entries, int cpu);
+const struct pci_sample_ring *pci_sampler_ring(struct pci_sampler *sampler);
+int pci_sampler_fd(struct pci_sampler *sampler);
+void pci_sampler_stop(struct pci_sampler *sampler);
+size_t pci_sample_ring_size(unsigned num_entries);
+unsigned pci_sample_ring_read(const struct pci_sample_ring *ring,
+    uint64_t *pos, struct pci_sample *samples, unsigned max);
+
+int pci_device_find_capability(struct pci_device *dev, unsigned cap_id);
+int pci_device_find_ext_capability(struct pci_device *dev, unsigned cap_id,
+    unsigned instance);
+int pci_device_find_dvsec(struct pci_device *dev, uint32_t vendor_id,
+    uint32_t dvsec_id, unsigned instance);
 
 #ifdef __cplusplus
 }
@@ -177,6 +356,199 @@ int pci_device_cfg_write_bits(struct pci_device *dev, uint32_t mask,
 #define PCI_DEV_MAP_FLAG_CACHABLE       (1U<<2)
 /*@}*/
 
+/**
+ * \name Flags passed to \c pci_system_init_flags
+ */
+/*@{*/
+/** Read each device's identity on first use instead of during init. */
+#define PCI_SYSTEM_INIT_LAZY            (1U<<0)
+/**
+ * Read device identities from the kernel's text description of each device
+ * rather than from config space, where the platform has one.  The revision
+ * ID is then only valid once the device has been probed.
+ */
+#define PCI_SYSTEM_INIT_UEVENT          (1U<<1)
+/**
+ * Enumerate the devices directly even if \c pciaccessd publishes an image
+ * of the device table.
+ */
+#define PCI_SYSTEM_INIT_NO_IMAGE        (1U<<2)
+/*@}*/
+
+/**
+ * \name Flags passed to \c pci_system_probe_all
+ */
+/*@{*/
+/** Probe devices again even if they have already been probed. */
+#define PCI_PROBE_ALL_FORCE             (1U<<0)
+/*@}*/
+
+/**
+ * \name Flags passed to \c pci_system_foreach
+ */
+/*@{*/
+/**
+ * Hand all devices below the same root port to one thread at a time, so
+ * that a single link is not accessed by several threads at once.
+ */
+#define PCI_FOREACH_GROUP_ROOT_PORT     (1U<<0)
+/*@}*/
+
+/**
+ * \name Flags passed to \c pci_device_cfg_read_flags
+ * and \c pci_device_cfg_write_bits_flags
+ */
+/*@{*/
+/** Read from the device even if the register shadow has the data. */
+#define PCI_DEV_CFG_FLAG_UNCACHED       (1U<<0)
+/**
+ * Make a read-modify-write atomic with respect to other atomic
+ * read-modify-writes of the same register, in any process.
+ */
+#define PCI_DEV_CFG_FLAG_ATOMIC         (1U<<1)
+/*@}*/
+
+/**
+ * Register sampled by a \c pci_sampler.
+ */
+struct pci_sample_reg {
+    struct pci_device *dev;
+    pciaddr_t offset;
+    unsigned width;     /**< 1, 2, or 4 bytes. */
+};
+
+/**
+ * One sample of a register.
+ */
+struct pci_sample {
+    /** \c CLOCK_MONOTONIC time of the read, in nanoseconds. */
+    uint64_t timestamp;
+
+    /** Register value in host byte order, or all ones on error. */
+    uint32_t value;
+
+    /** Index of the register in the sampler's register list. */
+    uint16_t reg;
+
+    /** \c PCI_SAMPLE_FLAG_ERROR or zero. */
+    uint16_t flags;
+};
+
+#define PCI_SAMPLE_FLAG_ERROR   (1U<<0)
+
+/**
+ * Header of a sample ring.  \c num_entries samples follow it in memory.
+ *
+ * \sa pci_sample_ring_read
+ */
+struct pci_sample_ring {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_entries;   /**< Ring size in samples, a power of two. */
+    uint32_t num_regs;      /**< Number of registers sampled. */
+
+    /** Number of samples written so far.  Updated atomically. */
+    uint64_t head;
+
+    uint64_t reserved[5];
+};
+
+/**
+ * Config space changes of one device.
+ *
+ * \sa pci_system_config_diff
+ */
+struct pci_config_change {
+    struct pci_device *dev;
+
+    /** Number of entries in \c offsets. */
+    unsigned num_offsets;
+
+    /** Offsets of the changed 32-bit registers, in ascending order. */
+    const uint16_t *offsets;
+};
+
+/**
+ * Statistics of atomic config space read-modify-writes.
+ *
+ * \sa pci_device_get_cfg_lock_stats
+ */
+struct pci_cfg_lock_stats {
+    /** Number of atomic read-modify-writes. */
+    uint64_t acquisitions;
+
+    /** Number of those that had to wait for another thread or process. */
+    uint64_t contended;
+
+    /** Total time spent waiting, in nanoseconds. */
+    uint64_t wait_ns;
+};
+
+
+/**
+ * \name Standard capability IDs
+ *
+ * Capability IDs accepted by \c pci_device_find_capability.
+ */
+/*@{*/
+#define PCI_CAP_ID_PM       0x01  /**< Power Management */
+#define PCI_CAP_ID_AGP      0x02  /**< Accelerated Graphics Port */
+#define PCI_CAP_ID_VPD      0x03  /**< Vital Product Data */
+#define PCI_CAP_ID_SLOTID   0x04  /**< Slot Identification */
+#define PCI_CAP_ID_MSI      0x05  /**< Message Signalled Interrupts */
+#define PCI_CAP_ID_CHSWP    0x06  /**< CompactPCI HotSwap */
+#define PCI_CAP_ID_PCIX     0x07  /**< PCI-X */
+#define PCI_CAP_ID_HT       0x08  /**< HyperTransport */
+#define PCI_CAP_ID_VNDR     0x09  /**< Vendor-Specific */
+#define PCI_CAP_ID_DBG      0x0a  /**< Debug port */
+#define PCI_CAP_ID_CCRC     0x0b  /**< CompactPCI Central Resource Control */
+#define PCI_CAP_ID_SHPC     0x0c  /**< PCI Standard Hot-Plug Controller */
+#define PCI_CAP_ID_SSVID    0x0d  /**< Bridge subsystem vendor/device ID */
+#define PCI_CAP_ID_AGP3     0x0e  /**< AGP Target PCI-PCI bridge */
+#define PCI_CAP_ID_SECDEV   0x0f  /**< Secure Device */
+#define PCI_CAP_ID_EXP      0x10  /**< PCI Express */
+#define PCI_CAP_ID_MSIX     0x11  /**< MSI-X */
+#define PCI_CAP_ID_SATA     0x12  /**< SATA Data/Index Configuration */
+#define PCI_CAP_ID_AF       0x13  /**< PCI Advanced Features */
+#define PCI_CAP_ID_EA       0x14  /**< Enhanced Allocation */
+#define PCI_CAP_ID_FPB      0x15  /**< Flattening Portal Bridge */
+/*@}*/
+
+/**
+ * \name Extended capability IDs
+ *
+ * Capability IDs accepted by \c pci_device_find_ext_capability.
+ */
+/*@{*/
+#define PCI_EXT_CAP_ID_AER      0x0001  /**< Advanced Error Reporting */
+#define PCI_EXT_CAP_ID_VC       0x0002  /**< Virtual Channel */
+#define PCI_EXT_CAP_ID_DSN      0x0003  /**< Device Serial Number */
+#define PCI_EXT_CAP_ID_PWR      0x0004  /**< Power Budgeting */
+#define PCI_EXT_CAP_ID_RCLD     0x0005  /**< Root Complex Link Declaration */
+#define PCI_EXT_CAP_ID_VNDR     0x000b  /**< Vendor-Specific */
+#define PCI_EXT_CAP_ID_ACS      0x000d  /**< Access Control Services */
+#define PCI_EXT_CAP_ID_ARI      0x000e  /**< Alternate Routing-ID */
+#define PCI_EXT_CAP_ID_ATS      0x000f  /**< Address Translation Services */
+#define PCI_EXT_CAP_ID_SRIOV    0x0010  /**< Single Root I/O Virtualization */
+#define PCI_EXT_CAP_ID_MCAST    0x0012  /**< Multicast */
+#define PCI_EXT_CAP_ID_PRI      0x0013  /**< Page Request Interface */
+#define PCI_EXT_CAP_ID_REBAR    0x0015  /**< Resizable BAR */
+#define PCI_EXT_CAP_ID_DPA      0x0016  /**< Dynamic Power Allocation */
+#define PCI_EXT_CAP_ID_TPH      0x0017  /**< TPH Requester */
+#define PCI_EXT_CAP_ID_LTR      0x0018  /**< Latency Tolerance Reporting */
+#define PCI_EXT_CAP_ID_SECPCI   0x0019  /**< Secondary PCI Express */
+#define PCI_EXT_CAP_ID_PMUX     0x001a  /**< Protocol Multiplexing */
+#define PCI_EXT_CAP_ID_PASID    0x001b  /**< Process Address Space ID */
+#define PCI_EXT_CAP_ID_DPC      0x001d  /**< Downstream Port Containment */
+#define PCI_EXT_CAP_ID_L1SS     0x001e  /**< L1 PM Substates */
+#define PCI_EXT_CAP_ID_PTM      0x001f  /**< Precision Time Measurement */
+#define PCI_EXT_CAP_ID_DVSEC    0x0023  /**< Designated Vendor-Specific */
+#define PCI_EXT_CAP_ID_DLF      0x0025  /**< Data Link Feature */
+#define PCI_EXT_CAP_ID_PL_16GT  0x0026  /**< Physical Layer 16.0 GT/s */
+#define PCI_EXT_CAP_ID_PL_32GT  0x002a  /**< Physical Layer 32.0 GT/s */
+#define PCI_EXT_CAP_ID_DOE      0x002e  /**< Data Object Exchange */
+/*@}*/
+
 
 #define PCI_MATCH_ANY  (~0)
 
@@ -219,6 +591,27 @@ struct pci_id_match {
 };
 
 
+/**
+ * Identities of the devices of a system, one array per field.
+ *
+ * Entry \c i of every array describes \c devices[i].  Devices are in the
+ * order iterators return them.
+ *
+ * \sa pci_system_get_device_index, pci_context_get_device_index
+ */
+struct pci_device_index {
+    unsigned    num_devices;
+
+    struct pci_device * const * devices;
+
+    const uint16_t * vendor_id;
+    const uint16_t * device_id;
+    const uint16_t * subvendor_id;
+    const uint16_t * subdevice_id;
+    const uint32_t * device_class;
+};
+
+
 /**
  */
 struct pci_slot_match {
@@ -239,6 +632,30 @@ struct pci_slot_match {
     intptr_t    match_data;
 };
 
+/**
+ * One register access in a scatter/gather config space operation.
+ *
+ * \sa pci_device_cfg_readv, pci_device_cfg_writev
+ */
+struct pci_device_cfg_op {
+    /**
+     * Byte offset of the register in configuration space.
+     */
+    pciaddr_t   offset;
+
+    /**
+     * Width of the register in bytes.  Must be 1, 2, or 4.
+     */
+    unsigned    width;
+
+    /**
+     * Pointer to a \c uint8_t, \c uint16_t, or \c uint32_t, matching
+     * \c width, that receives or supplies the register value in the host's
+     * byte order.
+     */
+    void *      value;
+};
+
 /**
  * BAR descriptor for a PCI device.
  */
@@ -0,0 +1,314 @@
+/*
+ * Copyright (c) 2026 The libpciaccess Contributors
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS AND/OR THEIR SUPPLIERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/**
+ * \file pciaccessd.c
+ * Publish the PCI device table for other processes.
+ *
+ * Enumerates the devices once, writes an image of the device table with
+ * \c pci_system_write_image, and writes it again whenever the kernel
+ * reports that a PCI device was added, removed, or bound to a driver.
+ * Processes using libpciaccess map the image instead of enumerating the
+ * devices themselves.  The image is removed when the daemon exits, so that
+ * clients go back to enumerating the devices directly.  The daemon also
+ * holds a lock on a file next to the image while it runs, so that clients
+ * ignore an image left behind when it dies.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <linux/netlink.h>
+
+#include "pciaccess.h"
+
+#ifndef PCIACCESS_IMAGE_PATH
+#define PCIACCESS_IMAGE_PATH "/run/pciaccess/devices"
+#endif
+
+/** Suffix of the file locked while the image is published. */
+#define IMAGE_LOCK_SUFFIX ".lock"
+
+/** How long to wait for more events before updating, in milliseconds. */
+#define SETTLE_MSEC  200
+
+static volatile sig_atomic_t stopping;
+
+
+static void
+handle_signal( int sig )
+{
+    (void) sig;
+    stopping = 1;
+}
+
+
+/**
+ * Open a socket receiving the kernel's device events.
+ */
+static int
+open_uevent_socket( void )
+{
+    struct sockaddr_nl addr;
+    int fd;
+
+    fd = socket( AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC,
+		 NETLINK_KOBJECT_UEVENT );
+    if ( fd == -1 ) {
+	return -1;
+    }
+
+    memset( & addr, 0, sizeof( addr ) );
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1;
+    if ( bind( fd, (struct sockaddr *) & addr, sizeof( addr ) ) != 0 ) {
+	close( fd );
+	return -1;
+    }
+
+    return fd;
+}
+
+
+/**
+ * Read one event and check whether it concerns a PCI device.
+ *
+ * \return
+ * 1 if it does, 0 if not, or -1 on error.
+ */
+static int
+read_pci_event( int fd )
+{
+    char buf[8192];
+    ssize_t bytes;
+    ssize_t i;
+
+    bytes = recv( fd, buf, sizeof( buf ) - 1, 0 );
+    if ( bytes < 0 ) {
+	/* ENOBUFS means events were lost, so assume one was for a PCI
+	 * device.
+	 */
+	if ( errno == ENOBUFS ) {
+	    return 1;
+	}
+
+	return (errno == EINTR) ? 0 : -1;
+    }
+
+    /* The event is a header followed by NUL-terminated KEY=value pairs.
+     */
+    buf[ bytes ] = '\0';
+    for ( i = 0 ; i < bytes ; i += strlen( & buf[i] ) + 1 ) {
+	if ( strcmp( & buf[i], "SUBSYSTEM=pci" ) == 0 ) {
+	    return 1;
+	}
+    }
+
+    return 0;
+}
+
+
+/**
+ * Take the lock that tells clients the image is kept up to date.
+ *
+ * The lock belongs to the open file, so it is kept across \c daemon and
+ * released however the process exits.
+ *
+ * \return
+ * The descriptor holding the lock, or -1 with \c errno set.
+ */
+static int
+lock_image( const char * path )
+{
+    struct flock fl;
+    char * lock_path;
+    int fd;
+
+    lock_path = malloc( strlen( path ) + sizeof( IMAGE_LOCK_SUFFIX ) );
+    if ( lock_path == NULL ) {
+	return -1;
+    }
+
+    sprintf( lock_path, "%s" IMAGE_LOCK_SUFFIX, path );
+    fd = open( lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644 );
+    free( lock_path );
+    if ( fd == -1 ) {
+	return -1;
+    }
+
+    memset( & fl, 0, sizeof( fl ) );
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    if ( fcntl( fd, F_OFD_SETLK, & fl ) != 0 ) {
+	close( fd );
+	return -1;
+    }
+
+    return fd;
+}
+
+
+/**
+ * Enumerate the devices and publish the image.
+ */
+static int
+publish( const char * path )
+{
+    int ret;
+
+    ret = pci_system_init_flags( PCI_SYSTEM_INIT_NO_IMAGE );
+    if ( ret != 0 ) {
+	return ret;
+    }
+
+    ret = pci_system_write_image( path );
+    pci_system_cleanup();
+
+    return ret;
+}
+
+
+int main( int argc, char ** argv )
+{
+    const char * path = NULL;
+    struct sigaction sa;
+    char * dir;
+    int foreground = 0;
+    int errors = 0;
+    int lock_fd;
+    int fd;
+    int ret;
+    int c;
+
+    while ((c = getopt(argc, argv, "fo:")) != -1) {
+	switch (c) {
+	case 'f':
+	    foreground = 1;
+	    break;
+	case 'o':
+	    path = optarg;
+	    break;
+	case '?':
+	    errors++;
+	}
+    }
+    if (errors != 0 || optind != argc) {
+	fprintf(stderr, "usage: %s [-f] [-o image]\n", argv[0]);
+	exit(2);
+    }
+
+    if ( path == NULL ) {
+	path = getenv( "PCIACCESS_IMAGE" );
+	if ( path == NULL || path[0] == '\0' ) {
+	    path = PCIACCESS_IMAGE_PATH;
+	}
+    }
+
+    dir = strdup( path );
+    if ( dir != NULL ) {
+	(void) mkdir( dirname( dir ), 0755 );
+	free( dir );
+    }
+
+    /* Only one daemon may publish the image.
+     */
+    lock_fd = lock_image( path );
+    if ( lock_fd == -1 )
+	err(1, "Couldn't lock %s%s", path, IMAGE_LOCK_SUFFIX);
+
+    /* Listen before the first scan, so that no change is missed.
+     */
+    fd = open_uevent_socket();
+    if ( fd == -1 )
+	err(1, "Couldn't listen to device events");
+
+    ret = publish( path );
+    if ( ret != 0 ) {
+	errno = ret;
+	err(1, "Couldn't publish %s", path);
+    }
+
+    if ( ! foreground && daemon( 0, 0 ) != 0 )
+	err(1, "Couldn't detach");
+
+    /* No SA_RESTART, so that a signal interrupts the wait for events.
+     */
+    memset( & sa, 0, sizeof( sa ) );
+    sa.sa_handler = handle_signal;
+    sigaction( SIGTERM, & sa, NULL );
+    sigaction( SIGINT, & sa, NULL );
+    sigaction( SIGHUP, & sa, NULL );
+
+    while ( ! stopping ) {
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	int changed;
+
+	changed = read_pci_event( fd );
+	if ( changed < 0 ) {
+	    break;
+	}
+
+	if ( changed == 0 ) {
+	    continue;
+	}
+
+	/* Events come in bursts, e.g. when a bridge and the devices behind
+	 * it appear.  Wait for the burst to end before updating.
+	 */
+	while ( ! stopping && poll( & pfd, 1, SETTLE_MSEC ) > 0 ) {
+	    if ( read_pci_event( fd ) < 0 ) {
+		break;
+	    }
+	}
+
+	if ( ! stopping ) {
+	    ret = publish( path );
+	    if ( ret != 0 ) {
+		errno = ret;
+		warn("Couldn't publish %s", path);
+		unlink( path );
+	    }
+	}
+    }
+
+    unlink( path );
+    close( fd );
+    close( lock_fd );
+    return 0;
+}
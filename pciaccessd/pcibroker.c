@@ -0,0 +1,733 @@
+/*
+ * Copyright (c) 2026 The libpciaccess Contributors
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS AND/OR THEIR SUPPLIERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/**
+ * \file pcibroker.c
+ * Config space and BAR access for processes without privileges.
+ *
+ * Listens on a Unix socket and performs the config accesses and BAR
+ * mappings that libpciaccess clients send it, as allowed by the policy
+ * given on the command line.  Like the kernel does for unprivileged users,
+ * only the 64-byte header may be read unless other ranges are given with
+ * \c -r.  Writes are only allowed to the ranges given with \c -w, and BARs
+ * can only be mapped with \c -m or \c -M.
+ *
+ * Clients are limited by the mode of the socket, and by the users and
+ * groups given with \c -u and \c -g, checked against the credentials of
+ * the connecting process.
+ *
+ * \sa linux_broker.h
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <grp.h>
+#include <pwd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "pciaccess.h"
+#include "linux_broker.h"
+
+#define MAX_CLIENTS  64
+#define MAX_RANGES   32
+#define MAX_IDS      16
+
+/** Size of config space. */
+#define CONFIG_SIZE  4096
+
+/**
+ * Registers an access may touch.  An access must lie within a single
+ * range.
+ */
+struct range {
+    unsigned start;
+    unsigned end;       /**< Last byte of the range. */
+};
+
+static struct range read_ranges[ MAX_RANGES ];
+static unsigned num_read_ranges;
+static struct range write_ranges[ MAX_RANGES ];
+static unsigned num_write_ranges;
+static int allow_map;
+static int allow_map_writable;
+
+/* Clients allowed in besides root.  With none, the socket mode decides. */
+static uid_t allowed_uids[ MAX_IDS ];
+static unsigned num_allowed_uids;
+static gid_t allowed_gids[ MAX_IDS ];
+static unsigned num_allowed_gids;
+
+static const char * sysfs_root = "/sys";
+
+static volatile sig_atomic_t stopping;
+
+/* Messages are handled one at a time. */
+static char request[ PCI_BROKER_MAX_MSG ];
+static char reply[ PCI_BROKER_MAX_MSG ];
+
+
+static void
+handle_signal( int sig )
+{
+    (void) sig;
+    stopping = 1;
+}
+
+
+/**
+ * Parse a "start-end" range of config offsets.
+ */
+static int
+parse_range( const char * arg, struct range * ranges, unsigned * num )
+{
+    char * end;
+    unsigned long start;
+    unsigned long last;
+
+    start = strtoul( arg, & end, 0 );
+    if ( *end != '-' ) {
+	return -1;
+    }
+
+    last = strtoul( end + 1, & end, 0 );
+    if ( *end != '\0' || start > last || last >= CONFIG_SIZE
+	 || *num == MAX_RANGES ) {
+	return -1;
+    }
+
+    ranges[ *num ].start = start;
+    ranges[ *num ].end = last;
+    (*num)++;
+    return 0;
+}
+
+
+/**
+ * Parse a user or group, by name or number.
+ */
+static int
+parse_id( const char * arg, int group, unsigned * id )
+{
+    char * end;
+    unsigned long n;
+
+    n = strtoul( arg, & end, 10 );
+    if ( arg[0] != '\0' && *end == '\0' ) {
+	*id = n;
+	return 0;
+    }
+
+    if ( group ) {
+	const struct group * const gr = getgrnam( arg );
+
+	if ( gr == NULL ) {
+	    return -1;
+	}
+
+	*id = gr->gr_gid;
+    }
+    else {
+	const struct passwd * const pw = getpwnam( arg );
+
+	if ( pw == NULL ) {
+	    return -1;
+	}
+
+	*id = pw->pw_uid;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Get the supplementary groups of the process at the other end of a
+ * connection.  Kernels without \c SO_PEERGROUPS fall back to the groups of
+ * its user in the group database.
+ *
+ * \return
+ * The number of groups, stored in \c *groups to be freed, or -1.
+ */
+static int
+peer_groups( int fd, const struct ucred * cred, gid_t ** groups )
+{
+    const struct passwd * pw;
+    int n = 0;
+
+    *groups = NULL;
+
+#ifdef SO_PEERGROUPS
+    {
+	socklen_t len = 0;
+	int ret;
+
+	while ( (ret = getsockopt( fd, SOL_SOCKET, SO_PEERGROUPS, *groups,
+				   & len )) != 0 && errno == ERANGE ) {
+	    free( *groups );
+	    *groups = malloc( len );
+	    if ( *groups == NULL ) {
+		return -1;
+	    }
+	}
+
+	if ( ret == 0 ) {
+	    return len / sizeof( gid_t );
+	}
+
+	ret = errno;
+	free( *groups );
+	*groups = NULL;
+	if ( ret != ENOPROTOOPT ) {
+	    return -1;
+	}
+    }
+#endif
+
+    pw = getpwuid( cred->uid );
+    if ( pw == NULL ) {
+	return -1;
+    }
+
+    (void) getgrouplist( pw->pw_name, cred->gid, NULL, & n );
+    *groups = malloc( (n > 0 ? n : 1) * sizeof( gid_t ) );
+    if ( *groups == NULL
+	 || getgrouplist( pw->pw_name, cred->gid, *groups, & n ) < 0 ) {
+	free( *groups );
+	*groups = NULL;
+	return -1;
+    }
+
+    return n;
+}
+
+
+/**
+ * Check whether the process at the other end of a connection may use the
+ * broker.
+ */
+static int
+client_allowed( int fd )
+{
+    struct ucred cred;
+    socklen_t len = sizeof( cred );
+    gid_t * groups;
+    int allowed = 0;
+    int n;
+    unsigned i;
+
+    if ( num_allowed_uids == 0 && num_allowed_gids == 0 ) {
+	return 1;
+    }
+
+    if ( getsockopt( fd, SOL_SOCKET, SO_PEERCRED, & cred, & len ) != 0
+	 || len != sizeof( cred ) ) {
+	return 0;
+    }
+
+    if ( cred.uid == 0 ) {
+	return 1;
+    }
+
+    for ( i = 0 ; i < num_allowed_uids ; i++ ) {
+	if ( cred.uid == allowed_uids[i] ) {
+	    return 1;
+	}
+    }
+
+    for ( i = 0 ; i < num_allowed_gids ; i++ ) {
+	if ( cred.gid == allowed_gids[i] ) {
+	    return 1;
+	}
+    }
+
+    if ( num_allowed_gids == 0 ) {
+	return 0;
+    }
+
+    n = peer_groups( fd, & cred, & groups );
+    while ( n-- > 0 && ! allowed ) {
+	for ( i = 0 ; i < num_allowed_gids ; i++ ) {
+	    if ( groups[ n ] == allowed_gids[i] ) {
+		allowed = 1;
+		break;
+	    }
+	}
+    }
+
+    free( groups );
+    return allowed;
+}
+
+
+static int
+range_allowed( const struct range * ranges, unsigned num, uint32_t offset,
+	       uint32_t size )
+{
+    unsigned i;
+
+    if ( offset >= CONFIG_SIZE || size > CONFIG_SIZE - offset ) {
+	return 0;
+    }
+
+    if ( size == 0 ) {
+	return 1;
+    }
+
+    for ( i = 0 ; i < num ; i++ ) {
+	if ( offset >= ranges[i].start
+	     && offset + size - 1 <= ranges[i].end ) {
+	    return 1;
+	}
+    }
+
+    return 0;
+}
+
+
+/**
+ * Open the resource file of a memory BAR.
+ *
+ * \return
+ * A descriptor, or -1 with \c errno set.
+ */
+static int
+open_bar( struct pci_device * dev, unsigned bar, int writable )
+{
+    char name[ 256 ];
+
+    if ( bar >= 6 || dev->regions[ bar ].size == 0
+	 || dev->regions[ bar ].is_IO ) {
+	errno = EINVAL;
+	return -1;
+    }
+
+    snprintf( name, sizeof( name ),
+	      "%s/bus/pci/devices/%04x:%02x:%02x.%u/resource%u",
+	      sysfs_root, dev->domain, dev->bus, dev->dev, dev->func, bar );
+
+    return open( name, (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC );
+}
+
+
+/**
+ * Perform one operation.
+ *
+ * \param op      Operation.
+ * \param in      Data of a write.
+ * \param out     Where to store the data of a read.
+ * \param res     Result of the operation.
+ * \param map_fd  Where to store the descriptor of a mapping.
+ */
+static void
+run_op( const struct pci_broker_op * op, const char * in, char * out,
+	struct pci_broker_result * res, int * map_fd )
+{
+    struct pci_device * const dev =
+	pci_device_find_by_slot( op->domain, op->bus, op->dev, op->func );
+    const int writable = (op->flags & PCI_BROKER_MAP_WRITABLE) != 0;
+    pciaddr_t bytes = 0;
+
+    res->err = 0;
+    res->bytes = 0;
+
+    if ( dev == NULL ) {
+	res->err = ENODEV;
+	return;
+    }
+
+    switch ( op->type ) {
+    case PCI_BROKER_OP_READ:
+	if ( ! range_allowed( read_ranges, num_read_ranges, op->offset,
+			      op->size ) ) {
+	    res->err = EPERM;
+	    break;
+	}
+
+	res->err = pci_device_cfg_read_flags( dev, out, op->offset, op->size,
+					      & bytes,
+					      PCI_DEV_CFG_FLAG_UNCACHED );
+	res->bytes = bytes;
+	break;
+
+    case PCI_BROKER_OP_WRITE:
+	if ( ! range_allowed( write_ranges, num_write_ranges, op->offset,
+			      op->size ) ) {
+	    res->err = EPERM;
+	    break;
+	}
+
+	res->err = pci_device_cfg_write( dev, in, op->offset, op->size,
+					 & bytes );
+	res->bytes = bytes;
+	break;
+
+    case PCI_BROKER_OP_MAP:
+	if ( ! allow_map || (writable && ! allow_map_writable) ) {
+	    res->err = EPERM;
+	    break;
+	}
+
+	*map_fd = open_bar( dev, op->offset, writable );
+	if ( *map_fd == -1 ) {
+	    res->err = errno;
+	}
+	break;
+
+    default:
+	res->err = EINVAL;
+	break;
+    }
+}
+
+
+/**
+ * Handle one request from a client.
+ *
+ * \return
+ * Zero on success, or -1 if the connection must be closed.
+ */
+static int
+handle_request( int fd )
+{
+    const struct pci_broker_header * const req =
+	(const struct pci_broker_header *) request;
+    const struct pci_broker_op * const ops =
+	(const struct pci_broker_op *) & req[1];
+    struct pci_broker_header * const rep = (struct pci_broker_header *) reply;
+    struct pci_broker_result * const results =
+	(struct pci_broker_result *) & rep[1];
+    union {
+	struct cmsghdr align;
+	char buf[ CMSG_SPACE( sizeof( int ) ) ];
+    } control;
+    size_t write_size = 0;
+    size_t read_size = 0;
+    const char * in;
+    struct msghdr msg;
+    struct iovec iov;
+    ssize_t bytes;
+    char * out;
+    int map_fd = -1;
+    unsigned n;
+    unsigned i;
+
+    bytes = recv( fd, request, sizeof( request ), MSG_TRUNC );
+    if ( bytes <= 0 || (size_t) bytes > sizeof( request ) ) {
+	return -1;
+    }
+
+    /* Check the whole request before acting on any of it.
+     */
+    n = req->num_ops;
+    if ( (size_t) bytes < sizeof( *req )
+	 || req->magic != PCI_BROKER_MAGIC
+	 || req->version != PCI_BROKER_VERSION
+	 || n > PCI_BROKER_MAX_OPS
+	 || (size_t) bytes != sizeof( *req ) + n * sizeof( *ops )
+	 + req->data_size ) {
+	return -1;
+    }
+
+    for ( i = 0 ; i < n ; i++ ) {
+	if ( ops[i].type == PCI_BROKER_OP_READ ) {
+	    read_size += ops[i].size;
+	}
+	else if ( ops[i].type == PCI_BROKER_OP_WRITE ) {
+	    write_size += ops[i].size;
+	}
+	else if ( ops[i].type == PCI_BROKER_OP_MAP && n != 1 ) {
+	    return -1;
+	}
+    }
+
+    if ( write_size != req->data_size || read_size > PCI_BROKER_MAX_DATA ) {
+	return -1;
+    }
+
+    /* Like the sysfs back-end, stop at the first operation that fails.
+     */
+    in = (const char *) & ops[n];
+    out = (char *) & results[n];
+    for ( i = 0 ; i < n ; i++ ) {
+	if ( i > 0 && results[ i - 1 ].err != 0 ) {
+	    results[i].err = ECANCELED;
+	    results[i].bytes = 0;
+	}
+	else {
+	    run_op( & ops[i], in, out, & results[i], & map_fd );
+	}
+
+	if ( ops[i].type == PCI_BROKER_OP_WRITE ) {
+	    in += ops[i].size;
+	}
+	else if ( ops[i].type == PCI_BROKER_OP_READ ) {
+	    out += results[i].bytes;
+	}
+    }
+
+    rep->magic = PCI_BROKER_MAGIC;
+    rep->version = PCI_BROKER_VERSION;
+    rep->num_ops = n;
+    rep->data_size = out - (char *) & results[n];
+
+    iov.iov_base = reply;
+    iov.iov_len = out - reply;
+    memset( & msg, 0, sizeof( msg ) );
+    msg.msg_iov = & iov;
+    msg.msg_iovlen = 1;
+
+    if ( map_fd != -1 ) {
+	struct cmsghdr * cmsg;
+
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof( control.buf );
+	cmsg = CMSG_FIRSTHDR( & msg );
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN( sizeof( int ) );
+	memcpy( CMSG_DATA( cmsg ), & map_fd, sizeof( int ) );
+    }
+
+    /* Never wait for a client: one that does not read its replies would
+     * stall all the others.  A reply that does not fit in the socket
+     * buffer drops the connection.
+     */
+    bytes = sendmsg( fd, & msg, MSG_NOSIGNAL | MSG_DONTWAIT );
+    if ( map_fd != -1 ) {
+	close( map_fd );
+    }
+
+    return (bytes < 0) ? -1 : 0;
+}
+
+
+static int
+open_socket( const char * path, mode_t mode )
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if ( strlen( path ) >= sizeof( addr.sun_path ) ) {
+	errno = ENAMETOOLONG;
+	return -1;
+    }
+
+    fd = socket( AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0 );
+    if ( fd == -1 ) {
+	return -1;
+    }
+
+    memset( & addr, 0, sizeof( addr ) );
+    addr.sun_family = AF_UNIX;
+    strcpy( addr.sun_path, path );
+
+    (void) unlink( path );
+    if ( bind( fd, (struct sockaddr *) & addr, sizeof( addr ) ) != 0
+	 || chmod( path, mode ) != 0
+	 || (num_allowed_gids != 0
+	     && chown( path, -1, allowed_gids[0] ) != 0)
+	 || listen( fd, 16 ) != 0 ) {
+	close( fd );
+	return -1;
+    }
+
+    return fd;
+}
+
+
+int main( int argc, char ** argv )
+{
+    struct pollfd fds[ 1 + MAX_CLIENTS ];
+    const char * path = NULL;
+    struct sigaction sa;
+    unsigned num_fds = 1;
+    mode_t mode = 0660;
+    int foreground = 0;
+    int errors = 0;
+    int ret;
+    int c;
+
+    while ((c = getopt(argc, argv, "fg:mMp:r:s:u:w:")) != -1) {
+	char * end;
+	unsigned id;
+
+	switch (c) {
+	case 'f':
+	    foreground = 1;
+	    break;
+	case 'g':
+	    if (num_allowed_gids == MAX_IDS || parse_id(optarg, 1, &id) != 0)
+		errors++;
+	    else
+		allowed_gids[num_allowed_gids++] = id;
+	    break;
+	case 'p':
+	    mode = strtoul(optarg, &end, 8);
+	    if (optarg[0] == '\0' || *end != '\0' || (mode & ~0777) != 0)
+		errors++;
+	    break;
+	case 'u':
+	    if (num_allowed_uids == MAX_IDS || parse_id(optarg, 0, &id) != 0)
+		errors++;
+	    else
+		allowed_uids[num_allowed_uids++] = id;
+	    break;
+	case 'M':
+	    allow_map_writable = 1;
+	    /* fallthrough */
+	case 'm':
+	    allow_map = 1;
+	    break;
+	case 'r':
+	    if (parse_range(optarg, read_ranges, &num_read_ranges) != 0)
+		errors++;
+	    break;
+	case 's':
+	    path = optarg;
+	    break;
+	case 'w':
+	    if (parse_range(optarg, write_ranges, &num_write_ranges) != 0)
+		errors++;
+	    break;
+	case '?':
+	    errors++;
+	}
+    }
+    if (errors != 0 || optind != argc) {
+	fprintf(stderr, "usage: %s [-f] [-m|-M] [-r start-end]... "
+		"[-w start-end]... [-u user]... [-g group]... [-p mode] "
+		"[-s socket]\n", argv[0]);
+	exit(2);
+    }
+
+    /* Reading past the header can have side effects on some devices,
+     * which is why the kernel does not let unprivileged users do it.
+     */
+    if ( num_read_ranges == 0 ) {
+	read_ranges[0].start = 0;
+	read_ranges[0].end = 0x3f;
+	num_read_ranges = 1;
+    }
+
+    if ( path == NULL ) {
+	path = getenv( "PCIACCESS_BROKER" );
+	if ( path == NULL || path[0] == '\0' ) {
+	    path = PCI_BROKER_PATH;
+	}
+    }
+
+    if ( getenv( "PCIACCESS_SYSFS_ROOT" ) != NULL
+	 && getenv( "PCIACCESS_SYSFS_ROOT" )[0] != '\0' ) {
+	sysfs_root = getenv( "PCIACCESS_SYSFS_ROOT" );
+    }
+
+    /* The broker itself accesses the devices directly.
+     */
+    setenv( "PCIACCESS_BROKER", "", 1 );
+
+    ret = pci_system_init_flags( PCI_SYSTEM_INIT_NO_IMAGE );
+    if ( ret != 0 ) {
+	errno = ret;
+	err(1, "Couldn't initialize PCI system");
+    }
+
+    /* Mappings need the BARs.
+     */
+    (void) pci_system_probe_all( 0, NULL, 0, NULL );
+
+    fds[0].fd = open_socket( path, mode );
+    fds[0].events = POLLIN;
+    if ( fds[0].fd == -1 )
+	err(1, "Couldn't listen on %s", path);
+
+    if ( ! foreground && daemon( 0, 0 ) != 0 )
+	err(1, "Couldn't detach");
+
+    /* No SA_RESTART, so that a signal interrupts the wait for requests.
+     */
+    memset( & sa, 0, sizeof( sa ) );
+    sa.sa_handler = handle_signal;
+    sigaction( SIGTERM, & sa, NULL );
+    sigaction( SIGINT, & sa, NULL );
+    sigaction( SIGHUP, & sa, NULL );
+    signal( SIGPIPE, SIG_IGN );
+
+    while ( ! stopping ) {
+	unsigned i;
+
+	if ( poll( fds, num_fds, -1 ) < 0 ) {
+	    if ( errno == EINTR ) {
+		continue;
+	    }
+
+	    break;
+	}
+
+	for ( i = num_fds - 1 ; i > 0 ; i-- ) {
+	    if ( fds[i].revents == 0 ) {
+		continue;
+	    }
+
+	    if ( (fds[i].revents & POLLIN) == 0
+		 || handle_request( fds[i].fd ) != 0 ) {
+		close( fds[i].fd );
+		fds[i] = fds[ --num_fds ];
+	    }
+	}
+
+	if ( fds[0].revents & POLLIN ) {
+	    const int fd = accept4( fds[0].fd, NULL, NULL, SOCK_CLOEXEC );
+
+	    if ( fd != -1
+		 && (num_fds == 1 + MAX_CLIENTS || ! client_allowed( fd )) ) {
+		close( fd );
+	    }
+	    else if ( fd != -1 ) {
+		fds[ num_fds ].fd = fd;
+		fds[ num_fds ].events = POLLIN;
+		fds[ num_fds ].revents = 0;
+		num_fds++;
+	    }
+	}
+    }
+
+    unlink( path );
+    pci_system_cleanup();
+    return 0;
+}
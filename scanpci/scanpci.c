@@ -148,7 +148,6 @@ print_pci_device( struct pci_device * dev, int verbose )
 		latency_timer,
 		cache_line_size );
 
-	pci_device_probe( dev );
 	for ( i = 0 ; i < 6 ; i++ ) {
 	    if ( dev->regions[i].base_addr != 0 ) {
 		printf( "  BASE%u     0x%08"PRIxPTR" SIZE %zu  %s",
@@ -223,6 +222,14 @@ int main( int argc, char ** argv )
     if (ret != 0)
 	err(1, "Couldn't initialize PCI system");
 
+    /* Each device's header is dumped with a burst of small reads.
+     */
+    (void) pci_system_set_cfg_readahead( 1000 );
+
+    if ( verbose ) {
+	(void) pci_system_probe_all( 0, NULL, 0, NULL );
+    }
+
     iter = pci_slot_match_iterator_create( NULL );
 
     while ( (dev = pci_device_next( iter )) != NULL ) {
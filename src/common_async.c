@@ -0,0 +1,614 @@
+/*
+ * Copyright (c) 2026 The libpciaccess Contributors
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS AND/OR THEIR SUPPLIERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/**
+ * \file common_async.c
+ * Asynchronous configuration space access.
+ *
+ * Requests are run by the internal worker pool.  Requests for the same
+ * device are run one at a time, in submission order; requests for different
+ * devices may run concurrently.
+ *
+ * A completed request is "reaped" either by \c pci_system_cfg_async_dispatch,
+ * which calls its completion callback, or by \c pci_cfg_request_wait.  The
+ * register shadow and read-ahead line of the device are only updated when the
+ * request is reaped, on the reaping thread, so that they are never touched by
+ * the worker threads.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "pciaccess.h"
+#include "pciaccess_private.h"
+
+struct pci_cfg_request {
+    struct pci_work work;       /**< Must be first. */
+    struct pci_device_private * priv;
+
+    void * data;
+    pciaddr_t offset;
+    pciaddr_t size;
+    int write;
+
+    pci_cfg_callback callback;
+    void * user;
+
+    int err;
+    pciaddr_t bytes;
+    int done;
+
+    /** Next request queued for the same device. */
+    struct pci_cfg_request * dev_next;
+
+    /** Next request on the completion list. */
+    struct pci_cfg_request * done_next;
+};
+
+static pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Completed requests with a callback, waiting to be dispatched.
+ */
+static struct pci_cfg_request * done_head;
+static struct pci_cfg_request * done_tail;
+
+/**
+ * Completion notification descriptors.  \c notify_fd[0] becomes readable
+ * when \c done_head is not empty, and \c notify_fd[1] is written to make it
+ * so.  With an eventfd both are the same descriptor.
+ */
+static int notify_fd[2] = { -1, -1 };
+
+
+/**
+ * Create the completion notification descriptors.  Must be called with
+ * \c async_lock held.
+ *
+ * \return
+ * Zero on success or an \c errno value on failure.
+ */
+static int
+notify_open( void )
+{
+    if ( notify_fd[0] != -1 ) {
+	return 0;
+    }
+
+#ifdef __linux__
+    notify_fd[0] = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+    if ( notify_fd[0] == -1 ) {
+	return errno;
+    }
+
+    notify_fd[1] = notify_fd[0];
+#else
+    {
+	int i;
+
+	if ( pipe( notify_fd ) == -1 ) {
+	    notify_fd[0] = -1;
+	    notify_fd[1] = -1;
+	    return errno;
+	}
+
+	for ( i = 0 ; i < 2 ; i++ ) {
+	    fcntl( notify_fd[i], F_SETFL,
+		   fcntl( notify_fd[i], F_GETFL ) | O_NONBLOCK );
+	    fcntl( notify_fd[i], F_SETFD, FD_CLOEXEC );
+	}
+    }
+#endif
+
+    return 0;
+}
+
+
+static void
+notify_signal( void )
+{
+#ifdef __linux__
+    const uint64_t one = 1;
+
+    (void) write( notify_fd[1], & one, sizeof( one ) );
+#else
+    const char one = 1;
+
+    (void) write( notify_fd[1], & one, sizeof( one ) );
+#endif
+}
+
+
+static void
+notify_clear( void )
+{
+    char buf[64];
+
+    while ( read( notify_fd[0], buf, sizeof( buf ) ) > 0 ) {
+	/* empty */ ;
+    }
+}
+
+
+/**
+ * Mark a request as complete.  Must be called with \c async_lock held.
+ */
+static void
+request_complete( struct pci_cfg_request * req, int err, pciaddr_t bytes )
+{
+    req->err = err;
+    req->bytes = bytes;
+    req->done = 1;
+
+    if ( req->callback != NULL ) {
+	req->done_next = NULL;
+	if ( done_tail != NULL ) {
+	    done_tail->done_next = req;
+	}
+	else {
+	    done_head = req;
+	    notify_signal();
+	}
+
+	done_tail = req;
+    }
+    else {
+	pthread_cond_broadcast( & async_cond );
+    }
+}
+
+
+/**
+ * Worker pool entry point.  Runs a request and then every request queued
+ * behind it for the same device.
+ */
+static void
+request_run( struct pci_work * work )
+{
+    struct pci_cfg_request * req = (struct pci_cfg_request *) work;
+
+    while ( req != NULL ) {
+	struct pci_device_private * const priv = req->priv;
+	struct pci_cfg_request * next;
+	pciaddr_t bytes = 0;
+	int err;
+
+	if ( req->write ) {
+	    err = priv->sys->methods->write( & priv->base, req->data,
+					   req->offset, req->size, & bytes );
+	}
+	else {
+	    err = priv->sys->methods->read( & priv->base, req->data,
+					  req->offset, req->size, & bytes );
+	}
+
+	pthread_mutex_lock( & async_lock );
+	next = req->dev_next;
+	priv->async_head = next;
+	if ( next == NULL ) {
+	    priv->async_tail = NULL;
+	}
+
+	request_complete( req, err, bytes );
+
+	/* pci_cfg_async_drop_system waits for devices to go idle.
+	 */
+	if ( next == NULL ) {
+	    pthread_cond_broadcast( & async_cond );
+	}
+	pthread_mutex_unlock( & async_lock );
+
+	req = next;
+    }
+}
+
+
+static struct pci_cfg_request *
+request_create( struct pci_device * dev, pciaddr_t size,
+		pci_cfg_callback callback, void * user, int write )
+{
+    struct pci_cfg_request * req;
+
+    if ( dev == NULL ) {
+	errno = EFAULT;
+	return NULL;
+    }
+
+    req = calloc( 1, sizeof( *req ) + (write ? size : 0) );
+    if ( req == NULL ) {
+	errno = ENOMEM;
+	return NULL;
+    }
+
+    req->work.func = request_run;
+    req->priv = (struct pci_device_private *) dev;
+    req->size = size;
+    req->write = write;
+    req->callback = callback;
+    req->user = user;
+
+    return req;
+}
+
+
+static struct pci_cfg_request *
+request_submit( struct pci_cfg_request * req )
+{
+    struct pci_device_private * const priv = req->priv;
+    int err;
+
+    pthread_mutex_lock( & async_lock );
+    if ( req->callback != NULL ) {
+	err = notify_open();
+	if ( err != 0 ) {
+	    pthread_mutex_unlock( & async_lock );
+	    free( req );
+	    errno = err;
+	    return NULL;
+	}
+    }
+
+    priv->async_pending++;
+
+    /* Reads that the register shadow can answer complete immediately, as
+     * long as no earlier request for the device is still outstanding.
+     */
+    if ( ! req->write && (priv->async_pending == 1)
+	 && pci_device_config_cache_read( priv, req->data, req->offset,
+					  req->size ) ) {
+	request_complete( req, 0, req->size );
+	pthread_mutex_unlock( & async_lock );
+	return req;
+    }
+
+    if ( priv->async_tail != NULL ) {
+	priv->async_tail->dev_next = req;
+	priv->async_tail = req;
+	pthread_mutex_unlock( & async_lock );
+	return req;
+    }
+
+    priv->async_head = req;
+    priv->async_tail = req;
+    pthread_mutex_unlock( & async_lock );
+
+    /* Without a worker pool, run the request right away.  Completion is
+     * still reported the usual way.
+     */
+    if ( pci_workqueue_submit( & req->work ) != 0 ) {
+	request_run( & req->work );
+    }
+
+    return req;
+}
+
+
+/**
+ * Bring the device's cached config state up to date with a completed
+ * request.  The caller releases the request afterwards.
+ */
+static void
+request_reap( struct pci_cfg_request * req )
+{
+    struct pci_device_private * const priv = req->priv;
+
+    if ( req->write ) {
+	pci_device_config_readahead_invalidate( priv );
+	if ( req->bytes != 0 ) {
+	    pci_device_config_cache_write( priv, req->data, req->offset,
+					   req->bytes );
+	}
+    }
+    else if ( (req->err == 0) && (req->bytes != 0) ) {
+	pci_device_config_cache_fill( priv, req->data, req->offset,
+				      req->bytes );
+    }
+
+    pthread_mutex_lock( & async_lock );
+    priv->async_pending--;
+    pthread_mutex_unlock( & async_lock );
+}
+
+
+/**
+ * Start an asynchronous read of a device's config space.
+ *
+ * \param dev       Device whose config space is to be read.
+ * \param data      Location to store the data.  Must stay valid until the
+ *                  request is reaped.
+ * \param offset    Initial byte offset to read.
+ * \param size      Total number of bytes to read.
+ * \param callback  Function to call from \c pci_system_cfg_async_dispatch
+ *                  once the read completes, or \c NULL to reap the request
+ *                  with \c pci_cfg_request_wait instead.
+ * \param user      Value passed to \c callback.
+ *
+ * \return
+ * Handle of the request, or \c NULL with \c errno set on failure.
+ *
+ * \sa pci_device_cfg_read, pci_system_cfg_async_fd
+ */
+struct pci_cfg_request *
+pci_device_cfg_read_async( struct pci_device * dev, void * data,
+			   pciaddr_t offset, pciaddr_t size,
+			   pci_cfg_callback callback, void * user )
+{
+    struct pci_cfg_request * req;
+
+    if ( data == NULL ) {
+	errno = EFAULT;
+	return NULL;
+    }
+
+    req = request_create( dev, size, callback, user, 0 );
+    if ( req == NULL ) {
+	return NULL;
+    }
+
+    req->data = data;
+    req->offset = offset;
+
+    return request_submit( req );
+}
+
+
+/**
+ * Start an asynchronous write to a device's config space.
+ *
+ * The data is copied, so \c data may be reused as soon as this function
+ * returns.  Writes and reads to the same device are performed in the order
+ * they were submitted.
+ *
+ * \param dev       Device whose config space is to be written.
+ * \param data      Data to write.
+ * \param offset    Initial byte offset to write.
+ * \param size      Total number of bytes to write.
+ * \param callback  Function to call from \c pci_system_cfg_async_dispatch
+ *                  once the write completes, or \c NULL to reap the request
+ *                  with \c pci_cfg_request_wait instead.
+ * \param user      Value passed to \c callback.
+ *
+ * \return
+ * Handle of the request, or \c NULL with \c errno set on failure.
+ *
+ * \sa pci_device_cfg_write, pci_system_cfg_async_fd
+ */
+struct pci_cfg_request *
+pci_device_cfg_write_async( struct pci_device * dev, const void * data,
+			    pciaddr_t offset, pciaddr_t size,
+			    pci_cfg_callback callback, void * user )
+{
+    struct pci_cfg_request * req;
+
+    if ( data == NULL ) {
+	errno = EFAULT;
+	return NULL;
+    }
+
+    req = request_create( dev, size, callback, user, 1 );
+    if ( req == NULL ) {
+	return NULL;
+    }
+
+    req->data = & req[1];
+    req->offset = offset;
+    memcpy( req->data, data, size );
+
+    return request_submit( req );
+}
+
+
+/**
+ * Wait for an asynchronous request submitted without a callback to
+ * complete, and release it.
+ *
+ * \param req    Request to wait for.
+ * \param bytes  Location to store the number of bytes transferred.  May be
+ *               \c NULL.
+ *
+ * \return
+ * Result of the access: zero on success or an \c errno value on failure.
+ * \c EINVAL if \c req has a completion callback.
+ */
+int
+pci_cfg_request_wait( struct pci_cfg_request * req, pciaddr_t * bytes )
+{
+    int err;
+
+    if ( req == NULL ) {
+	return EFAULT;
+    }
+
+    if ( req->callback != NULL ) {
+	return EINVAL;
+    }
+
+    pthread_mutex_lock( & async_lock );
+    while ( ! req->done ) {
+	pthread_cond_wait( & async_cond, & async_lock );
+    }
+    pthread_mutex_unlock( & async_lock );
+
+    err = req->err;
+    if ( bytes != NULL ) {
+	*bytes = req->bytes;
+    }
+
+    request_reap( req );
+    free( req );
+    return err;
+}
+
+
+/**
+ * Get a file descriptor that becomes readable when asynchronous requests
+ * with a callback have completed.
+ *
+ * The descriptor is meant to be added to the caller's event loop.  When it
+ * is readable, call \c pci_system_cfg_async_dispatch.  It must not be read
+ * from or closed by the caller.
+ *
+ * \return
+ * A file descriptor, or -1 with \c errno set on failure.
+ */
+int
+pci_system_cfg_async_fd( void )
+{
+    int err;
+    int fd;
+
+    pthread_mutex_lock( & async_lock );
+    err = notify_open();
+    fd = notify_fd[0];
+    pthread_mutex_unlock( & async_lock );
+
+    if ( err != 0 ) {
+	errno = err;
+	return -1;
+    }
+
+    return fd;
+}
+
+
+/**
+ * Call the completion callbacks of all completed asynchronous requests.
+ *
+ * Callbacks are called on the calling thread, in completion order.  Each
+ * request handle is released when its callback returns.  This function does
+ * not block.
+ *
+ * \return
+ * Number of callbacks called.
+ *
+ * \sa pci_system_cfg_async_fd
+ */
+int
+pci_system_cfg_async_dispatch( void )
+{
+    struct pci_cfg_request * req;
+    int count = 0;
+
+    pthread_mutex_lock( & async_lock );
+    if ( notify_fd[0] != -1 ) {
+	notify_clear();
+    }
+
+    req = done_head;
+    done_head = NULL;
+    done_tail = NULL;
+    pthread_mutex_unlock( & async_lock );
+
+    while ( req != NULL ) {
+	struct pci_cfg_request * const next = req->done_next;
+
+	request_reap( req );
+	(*req->callback)( req, req->err, req->bytes, req->user );
+	free( req );
+
+	req = next;
+	count++;
+    }
+
+    return count;
+}
+
+
+/**
+ * Drop the asynchronous requests on the devices of a system that is being
+ * destroyed.
+ *
+ * Waits for the requests still running on the system's devices, then
+ * releases the completed ones that were never dispatched, without calling
+ * their callbacks.  Requests submitted without a callback must have been
+ * waited for already.
+ */
+_pci_hidden void
+pci_cfg_async_drop_system( struct pci_system * sys )
+{
+    struct pci_cfg_request ** link;
+    size_t i;
+
+    pthread_mutex_lock( & async_lock );
+    for ( i = 0 ; i < sys->num_devices ; i++ ) {
+	while ( sys->devices[i].async_head != NULL ) {
+	    pthread_cond_wait( & async_cond, & async_lock );
+	}
+    }
+
+    done_tail = NULL;
+    link = & done_head;
+    while ( *link != NULL ) {
+	struct pci_cfg_request * const req = *link;
+
+	if ( req->priv->sys == sys ) {
+	    *link = req->done_next;
+	    free( req );
+	}
+	else {
+	    done_tail = req;
+	    link = & req->done_next;
+	}
+    }
+    pthread_mutex_unlock( & async_lock );
+}
+
+
+/**
+ * Release all state of the asynchronous access code.  Must be called after
+ * the worker pool has been stopped.  Completed requests that were never
+ * dispatched are released without calling their callbacks.
+ */
+_pci_hidden void
+pci_cfg_async_cleanup( void )
+{
+    pthread_mutex_lock( & async_lock );
+    while ( done_head != NULL ) {
+	struct pci_cfg_request * const next = done_head->done_next;
+
+	free( done_head );
+	done_head = next;
+    }
+
+    done_tail = NULL;
+
+    if ( notify_fd[0] != -1 ) {
+	close( notify_fd[0] );
+	if ( notify_fd[1] != notify_fd[0] ) {
+	    close( notify_fd[1] );
+	}
+
+	notify_fd[0] = -1;
+	notify_fd[1] = -1;
+    }
+    pthread_mutex_unlock( & async_lock );
+}
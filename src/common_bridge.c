@@ -56,31 +56,42 @@
 static int
 read_bridge_info( struct pci_device_private * priv )
 {
-    uint8_t  buf[0x40];
-    pciaddr_t bytes;
+    union {
+	struct pci_bridge_info * pci;
+	struct pci_pcmcia_bridge_info * pcmcia;
+    } expected = { NULL };
+    const uint8_t * buf;
+    pciaddr_t len;
     int err;
 
 
     /* Make sure the device has been probed.  If not, header_type won't be
      * set and the rest of this function will fail.
      */
-    err = pci_device_probe(& priv->base);
+    err = pci_device_probe_once( priv );
     if (err) {
 	return err;
     }
 
-    switch ( priv->header_type & 0x7f ) {
-    case 0x00:
-	break;
+    if ( (priv->header_type & 0x7f) == 0x00 ) {
+	return 0;
+    }
+
+    buf = pci_device_cfg_view( & priv->base, & len );
+    if ( buf == NULL ) {
+	return errno;
+    }
+
+    if ( len < 0x40 ) {
+	return ENXIO;
+    }
 
+    switch ( priv->header_type & 0x7f ) {
     case 0x01: {
 	struct pci_bridge_info *info;
 
 	info = malloc(sizeof(*info));
 	if (info != NULL) {
-	    pci_device_cfg_read( (struct pci_device *) priv, buf + 0x18, 0x18,
-				 0x40 - 0x18, & bytes );
-
 	    info->primary_bus = buf[0x18];
 	    info->secondary_bus = buf[0x19];
 	    info->subordinate_bus = buf[0x1a];
@@ -127,7 +138,14 @@ read_bridge_info( struct pci_device_private * priv )
 	      + (((uint16_t) buf[0x1f]) << 8);
 	}
 
-	priv->bridge.pci = info;
+	/* Another thread may have read the information concurrently.
+	 */
+	if (info != NULL
+	    && !__atomic_compare_exchange_n(& priv->bridge.pci, & expected.pci,
+					    info, 0, __ATOMIC_RELEASE,
+					    __ATOMIC_RELAXED)) {
+	    free(info);
+	}
 	break;
     }
 
@@ -136,9 +154,6 @@ read_bridge_info( struct pci_device_private * priv )
 
 	info = malloc(sizeof(*info));
 	if (info != NULL) {
-	    pci_device_cfg_read( (struct pci_device *) priv, buf + 0x16, 0x16,
-				 0x40 - 0x16, & bytes );
-
 	    info->primary_bus = buf[0x18];
 	    info->card_bus = buf[0x19];
 	    info->subordinate_bus = buf[0x1a];
@@ -191,7 +206,13 @@ read_bridge_info( struct pci_device_private * priv )
 	      + (((uint16_t) buf[0x3f]) << 8);
 	}
 
-	priv->bridge.pcmcia = info;
+	if (info != NULL
+	    && !__atomic_compare_exchange_n(& priv->bridge.pcmcia,
+					    & expected.pcmcia, info, 0,
+					    __ATOMIC_RELEASE,
+					    __ATOMIC_RELAXED)) {
+	    free(info);
+	}
 	break;
     }
     }
@@ -212,11 +233,12 @@ pci_device_get_bridge_info( struct pci_device * dev )
 {
     struct pci_device_private * priv = (struct pci_device_private *) dev;
 
-    if (priv->bridge.pci == NULL) {
+    if (__atomic_load_n(& priv->bridge.pci, __ATOMIC_ACQUIRE) == NULL) {
 	read_bridge_info(priv);
     }
 
-    return (priv->header_type == 1) ? priv->bridge.pci : NULL;
+    return (priv->header_type == 1)
+	? __atomic_load_n(& priv->bridge.pci, __ATOMIC_ACQUIRE) : NULL;
 }
 
 
@@ -232,11 +254,12 @@ pci_device_get_pcmcia_bridge_info( struct pci_device * dev )
 {
     struct pci_device_private * priv = (struct pci_device_private *) dev;
 
-    if (priv->bridge.pcmcia == NULL) {
+    if (__atomic_load_n(& priv->bridge.pcmcia, __ATOMIC_ACQUIRE) == NULL) {
 	read_bridge_info(priv);
     }
 
-    return (priv->header_type == 2) ? priv->bridge.pcmcia : NULL;
+    return (priv->header_type == 2)
+	? __atomic_load_n(& priv->bridge.pcmcia, __ATOMIC_ACQUIRE) : NULL;
 }
 
 
@@ -290,27 +313,34 @@ pci_device_get_bridge_buses(struct pci_device * dev, int *primary_bus,
 	*subordinate_bus = -1;
 	break;
 
-    case 0x04:
-    if (priv->bridge.pci == NULL)
+    case 0x04: {
+    const struct pci_bridge_info *info;
+
+    if (__atomic_load_n(& priv->bridge.pci, __ATOMIC_ACQUIRE) == NULL)
         read_bridge_info(priv);
-    if ((priv->header_type & 0x7f) == 0x01) {
-	*primary_bus = priv->bridge.pci->primary_bus;
-	*secondary_bus = priv->bridge.pci->secondary_bus;
-	*subordinate_bus = priv->bridge.pci->subordinate_bus;
+    info = __atomic_load_n(& priv->bridge.pci, __ATOMIC_ACQUIRE);
+    if (((priv->header_type & 0x7f) == 0x01) && (info != NULL)) {
+	*primary_bus = info->primary_bus;
+	*secondary_bus = info->secondary_bus;
+	*subordinate_bus = info->subordinate_bus;
     } else {
 	*primary_bus = dev->bus;
 	*secondary_bus = -1;
 	*subordinate_bus = -1;
     }
 	break;
+    }
+
+    case 0x07: {
+    const struct pci_pcmcia_bridge_info *info;
 
-    case 0x07:
-    if (priv->bridge.pcmcia == NULL)
+    if (__atomic_load_n(& priv->bridge.pcmcia, __ATOMIC_ACQUIRE) == NULL)
         read_bridge_info(priv);
-    if ((priv->header_type & 0x7f) == 0x02) {
-	*primary_bus = priv->bridge.pcmcia->primary_bus;
-	*secondary_bus = priv->bridge.pcmcia->card_bus;
-	*subordinate_bus = priv->bridge.pcmcia->subordinate_bus;
+    info = __atomic_load_n(& priv->bridge.pcmcia, __ATOMIC_ACQUIRE);
+    if (((priv->header_type & 0x7f) == 0x02) && (info != NULL)) {
+	*primary_bus = info->primary_bus;
+	*secondary_bus = info->card_bus;
+	*subordinate_bus = info->subordinate_bus;
     } else {
 	*primary_bus = dev->bus;
 	*secondary_bus = -1;
@@ -318,6 +348,7 @@ pci_device_get_bridge_buses(struct pci_device * dev, int *primary_bus,
     }
 	break;
     }
+    }
 
     return 0;
 }
@@ -331,15 +362,20 @@ pci_device_get_parent_bridge(struct pci_device *dev)
     struct pci_id_match bridge_match = {
         PCI_MATCH_ANY, PCI_MATCH_ANY, PCI_MATCH_ANY, PCI_MATCH_ANY,
         (PCI_CLASS_BRIDGE << 16) | (PCI_SUBCLASS_BRIDGE_PCI << 8),
-        0
+        0xffff00, 0
     };
 
     struct pci_device *bridge;
     struct pci_device_iterator *iter;
+    int known;
 
     if (dev == NULL)
         return NULL;
 
+    bridge = pci_image_get_parent(dev, &known);
+    if (known)
+        return bridge;
+
     iter = pci_id_match_iterator_create(& bridge_match);
     if (iter == NULL)
         return NULL;
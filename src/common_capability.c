@@ -27,18 +27,194 @@
  * Platform independent PCI capability related routines.
  *
  * In addition to including the interface glue for \c pci_device_get_agp_info,
- * this file also contains a generic implementation of that function.
+ * this file also contains a generic implementation of that function.  The
+ * capability list is parsed from the device's configuration space snapshot
+ * rather than with one configuration read per list entry.
  *
  * \author Ian Romanick <idr@us.ibm.com>
  */
 
 #include <stdlib.h>
-#include <stdio.h>
 #include <errno.h>
 
 #include "pciaccess.h"
 #include "pciaccess_private.h"
 
+/**
+ * Build the capability offset index for a device.
+ *
+ * The standard capability list is walked in the device's configuration space
+ * snapshot, so no back-end access is needed per capability.  A snapshot is
+ * taken first if the device does not have one yet.  The index is only built
+ * once per device.
+ *
+ * \param priv  Device whose capability list is to be indexed.
+ *
+ * \return
+ * Zero on success or an errno value on failure.  \c ENOSYS is returned if the
+ * device does not have a capability list.
+ */
+_pci_hidden int
+pci_device_index_capabilities( struct pci_device_private * priv )
+{
+    const uint8_t * config;
+    unsigned cap_offset;
+    unsigned ttl;
+    uint16_t status;
+    int err;
+
+
+    if ( __atomic_load_n( & priv->caps_indexed, __ATOMIC_ACQUIRE ) ) {
+	return 0;
+    }
+
+    if ( __atomic_load_n( & priv->config_size, __ATOMIC_ACQUIRE ) == 0 ) {
+	err = pci_device_config_snapshot( priv );
+	if ( err ) {
+	    return err;
+	}
+    }
+
+    pci_device_lock( priv );
+    if ( priv->caps_indexed ) {
+	pci_device_unlock( priv );
+	return 0;
+    }
+
+    config = priv->config;
+    if ( priv->config_size < 64 ) {
+	pci_device_unlock( priv );
+	return ENXIO;
+    }
+
+    /* Are PCI capabilities supported by this device?
+     */
+    status = (uint16_t) config[6] + ((uint16_t) config[7] << 8);
+    if ( (status & 0x0010) == 0 ) {
+	pci_device_unlock( priv );
+	return ENOSYS;
+    }
+
+    /* CardBus bridges keep the capability pointer at a different offset.
+     */
+    cap_offset = ((config[14] & 0x7f) == 0x02) ? config[0x14] : config[0x34];
+
+    /* Each capability takes at least 4 bytes in the space after the
+     * 64-byte header, so a list longer than this must contain a loop.
+     */
+    for ( ttl = (PCI_CONFIG_SPACE_SIZE - 64) / 4 ; ttl > 0 ; ttl-- ) {
+	uint8_t cap_id;
+
+	cap_offset &= ~3U;
+	if ( cap_offset < 64 ) {
+	    break;
+	}
+
+	/* Unprivileged users may only see part of configuration space.
+	 */
+	if ( (cap_offset + 2) > priv->config_size ) {
+	    pci_device_unlock( priv );
+	    return ENXIO;
+	}
+
+	cap_id = config[ cap_offset ];
+	if ( cap_id == 0xff ) {
+	    break;
+	}
+
+	if ( (cap_id <= PCI_CAP_ID_MAX) && (priv->cap_offsets[ cap_id ] == 0) ) {
+	    priv->cap_offsets[ cap_id ] = cap_offset;
+	}
+
+	cap_offset = config[ cap_offset + 1 ];
+    }
+
+    __atomic_store_n( & priv->caps_indexed, 1, __ATOMIC_RELEASE );
+    pci_device_unlock( priv );
+    return 0;
+}
+
+
+/**
+ * Decode the AGP capability from the device's configuration space snapshot.
+ *
+ * \param priv        Device whose AGP capability is to be decoded.
+ * \param cap_offset  Offset of the AGP capability.
+ *
+ * \return
+ * Zero on success or an errno value on failure.
+ */
+static int
+fill_agp_info( struct pci_device_private * priv, unsigned cap_offset )
+{
+    const uint8_t * const config = priv->config;
+    const struct pci_agp_info * expected = NULL;
+    struct pci_agp_info * agp_info;
+    uint32_t agp_status;
+    uint8_t agp_ver;
+
+
+    if ( (cap_offset + 8)
+	 > __atomic_load_n( & priv->config_size, __ATOMIC_ACQUIRE ) ) {
+	return ENXIO;
+    }
+
+    agp_ver = config[ cap_offset + 2 ];
+    agp_status = (uint32_t) config[ cap_offset + 4 ]
+	+ ((uint32_t) config[ cap_offset + 5 ] << 8)
+	+ ((uint32_t) config[ cap_offset + 6 ] << 16)
+	+ ((uint32_t) config[ cap_offset + 7 ] << 24);
+
+    agp_info = calloc( 1, sizeof( struct pci_agp_info ) );
+    if ( agp_info == NULL ) {
+	return ENOMEM;
+    }
+
+    agp_info->config_offset = cap_offset;
+
+    agp_info->major_version = (agp_ver & 0x0f0) >> 4;
+    agp_info->minor_version = (agp_ver & 0x00f);
+
+    agp_info->rates = (agp_status & 0x07);
+
+    /* If AGP3 is supported, then the meaning of the rates values
+     * changes.
+     */
+    if ( (agp_status & 0x08) != 0 ) {
+	agp_info->rates <<= 2;
+    }
+
+    /* Some devices, notably motherboard chipsets, have the AGP3
+     * capability set and the 4x bit set.  This results in an
+     * impossible 16x mode being listed as available.  I'm not 100%
+     * sure this is the right solution.
+     */
+    agp_info->rates &= 0x0f;
+
+
+    agp_info->fast_writes = (agp_status & 0x0010) != 0;
+    agp_info->addr64 =      (agp_status & 0x0020) != 0;
+    agp_info->htrans =      (agp_status & 0x0040) == 0;
+    agp_info->gart64 =      (agp_status & 0x0080) != 0;
+    agp_info->coherent =    (agp_status & 0x0100) != 0;
+    agp_info->sideband =    (agp_status & 0x0200) != 0;
+    agp_info->isochronus =  (agp_status & 0x10000) != 0;
+
+    agp_info->async_req_size = 4 + (1 << ((agp_status & 0xe000) >> 13));
+    agp_info->calibration_cycle_timing = ((agp_status & 0x1c00) >> 10);
+    agp_info->max_requests = 1 + ((agp_status & 0xff000000) >> 24);
+
+    /* Another thread may have decoded the capability concurrently.
+     */
+    if ( ! __atomic_compare_exchange_n( & priv->agp, & expected, agp_info, 0,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED ) ) {
+	free( agp_info );
+    }
+
+    return 0;
+}
+
+
 /**
  * Generic implementation of \c pci_system_methods::fill_capabilities.
  *
@@ -46,18 +222,6 @@
  *
  * \return
  * Zero on success or an errno value on failure.
- *
- * \todo
- * Once more than just the AGP capability is supported, the body of each of
- * the cases in the capability processing loop should probably be broken out
- * into its own function.
- *
- * \todo
- * Once more than just the AGP capability is supported, some care will need
- * to be taken in partial failure cases.  If, say, the first capability is
- * correctly processed but the second fails, the function would be re-called
- * later to try again for the second capability.  This could lead to memory
- * leaks or other quirky behavior.
  */
 _pci_hidden int
 pci_fill_capabilities_generic( struct pci_device * dev )
@@ -65,111 +229,214 @@ pci_fill_capabilities_generic( struct pci_device * dev )
     struct pci_device_private * const dev_priv =
       (struct pci_device_private *) dev;
     int       err;
-    uint16_t  status;
-    uint8_t   cap_offset;
 
 
-    err = pci_device_cfg_read_u16( dev, & status, 6 );
+    err = pci_device_index_capabilities( dev_priv );
     if ( err ) {
 	return err;
     }
 
-    /* Are PCI capabilities supported by this device?
-     */
-    if ( (status & 0x0010) == 0 ) {
-	return ENOSYS;
+    if ( (__atomic_load_n( & dev_priv->agp, __ATOMIC_ACQUIRE ) == NULL)
+	 && (dev_priv->cap_offsets[2] != 0) ) {
+	err = fill_agp_info( dev_priv, dev_priv->cap_offsets[2] );
     }
 
-    err = pci_device_cfg_read_u8( dev, & cap_offset, 52 );
-    if ( err ) {
-	return err;
+    return err;
+}
+
+
+/**
+ * Get AGP capability data for a device.
+ */
+const struct pci_agp_info *
+pci_device_get_agp_info( struct pci_device * dev )
+{
+    struct pci_device_private * dev_priv = (struct pci_device_private *) dev;
+
+    if ( dev == NULL ) {
+	return NULL;
     }
 
+    if ( __atomic_load_n( & dev_priv->agp, __ATOMIC_ACQUIRE ) == NULL ) {
+	(void) (*pci_device_system( dev )->methods->fill_capabilities)( dev );
+    }
+
+    return __atomic_load_n( & dev_priv->agp, __ATOMIC_ACQUIRE );
+}
+
+
+/**
+ * Build the extended capability index for a device.
+ *
+ * The extended capability list, starting at offset 0x100, is walked in the
+ * device's configuration space snapshot.  Devices that do not expose
+ * extended configuration space simply get an empty index.
+ *
+ * \param priv  Device whose extended capability list is to be indexed.
+ *
+ * \return
+ * Zero on success or an errno value on failure.
+ */
+static int
+index_ext_capabilities( struct pci_device_private * priv )
+{
+    const uint8_t * config;
+    struct pci_ext_cap * caps = NULL;
+    unsigned num_caps = 0;
+    unsigned cap_offset = PCI_CONFIG_SPACE_SIZE;
+    unsigned ttl;
+    int err;
 
-    /* Process each of the capabilities list in the PCI header.
-     */
-    while ( cap_offset != 0 ) {
-	uint8_t cap_id;
-	uint8_t next_cap;
 
-	err = pci_device_cfg_read_u8( dev, & cap_id, cap_offset );
+    if ( __atomic_load_n( & priv->ext_caps_indexed, __ATOMIC_ACQUIRE ) ) {
+	return 0;
+    }
+
+    if ( __atomic_load_n( & priv->config_size, __ATOMIC_ACQUIRE ) == 0 ) {
+	err = pci_device_config_snapshot( priv );
 	if ( err ) {
 	    return err;
 	}
+    }
 
-	err = pci_device_cfg_read_u8( dev, & next_cap, cap_offset + 1 );
-	if ( err ) {
-	    return err;
+    pci_device_lock( priv );
+    if ( priv->ext_caps_indexed ) {
+	pci_device_unlock( priv );
+	return 0;
+    }
+
+    config = priv->config;
+
+    /* Each extended capability takes at least 8 bytes, so a list longer
+     * than this must contain a loop.
+     */
+    for ( ttl = (PCI_CONFIG_SPACE_EXT_SIZE - PCI_CONFIG_SPACE_SIZE) / 8 ;
+	  ttl > 0 ; ttl-- ) {
+	struct pci_ext_cap * c;
+	uint32_t header;
+
+	if ( (cap_offset + 4) > priv->config_size ) {
+	    break;
 	}
 
-	switch ( cap_id ) {
-	case 2: {
-	    struct pci_agp_info * agp_info;
-	    uint32_t agp_status;
-	    uint8_t agp_ver;
+	header = (uint32_t) config[ cap_offset ]
+	    + ((uint32_t) config[ cap_offset + 1 ] << 8)
+	    + ((uint32_t) config[ cap_offset + 2 ] << 16)
+	    + ((uint32_t) config[ cap_offset + 3 ] << 24);
 
+	if ( (header == 0) || (header == 0xffffffff) ) {
+	    break;
+	}
 
-	    err = pci_device_cfg_read_u8( dev, & agp_ver, cap_offset + 2 );
-	    if ( err ) {
-		return err;
-	    }
+	c = realloc( caps, (num_caps + 1) * sizeof( *caps ) );
+	if ( c == NULL ) {
+	    pci_device_unlock( priv );
+	    free( caps );
+	    return ENOMEM;
+	}
 
-	    err = pci_device_cfg_read_u32( dev, & agp_status, cap_offset + 4 );
-	    if ( err ) {
-		return err;
-	    }
+	caps = c;
+	c = & caps[ num_caps ];
+	num_caps++;
+
+	c->id = header & 0x0000ffff;
+	c->offset = cap_offset;
+	c->dvsec_vendor = 0;
+	c->dvsec_id = 0;
+
+	if ( (c->id == PCI_EXT_CAP_ID_DVSEC)
+	     && ((cap_offset + 10) <= priv->config_size) ) {
+	    c->dvsec_vendor = (uint16_t) config[ cap_offset + 4 ]
+		+ ((uint16_t) config[ cap_offset + 5 ] << 8);
+	    c->dvsec_id = (uint16_t) config[ cap_offset + 8 ]
+		+ ((uint16_t) config[ cap_offset + 9 ] << 8);
+	}
 
-	    agp_info = calloc( 1, sizeof( struct pci_agp_info ) );
-	    if ( agp_info == NULL ) {
-		return ENOMEM;
-	    }
+	cap_offset = (header >> 20) & ~3U;
+	if ( cap_offset < PCI_CONFIG_SPACE_SIZE ) {
+	    break;
+	}
+    }
+
+    priv->ext_caps = caps;
+    priv->num_ext_caps = num_caps;
+    __atomic_store_n( & priv->ext_caps_indexed, 1, __ATOMIC_RELEASE );
+    pci_device_unlock( priv );
+    return 0;
+}
 
-	    agp_info->config_offset = cap_offset;
 
-	    agp_info->major_version = (agp_ver & 0x0f0) >> 4;
-	    agp_info->minor_version = (agp_ver & 0x00f);
+/**
+ * Find a standard capability of a device.
+ *
+ * The capability list is parsed once per device.  Later calls are answered
+ * from the library's capability index without accessing the device.
+ *
+ * \param dev     Device to search.
+ * \param cap_id  Capability ID, such as \c PCI_CAP_ID_EXP.
+ *
+ * \return
+ * Offset of the first instance of the capability in configuration space, or
+ * zero if the device does not have it.
+ */
+int
+pci_device_find_capability( struct pci_device * dev, unsigned cap_id )
+{
+    struct pci_device_private * priv = (struct pci_device_private *) dev;
 
-	    agp_info->rates = (agp_status & 0x07);
+    if ( (dev == NULL) || (cap_id > PCI_CAP_ID_MAX) ) {
+	return 0;
+    }
 
-	    /* If AGP3 is supported, then the meaning of the rates values
-	     * changes.
-	     */
-	    if ( (agp_status & 0x08) != 0 ) {
-		agp_info->rates <<= 2;
-	    }
+    if ( pci_device_index_capabilities( priv ) != 0 ) {
+	return 0;
+    }
 
-	    /* Some devices, notably motherboard chipsets, have the AGP3
-	     * capability set and the 4x bit set.  This results in an
-	     * impossible 16x mode being listed as available.  I'm not 100%
-	     * sure this is the right solution.
-	     */
-	    agp_info->rates &= 0x0f;
+    return priv->cap_offsets[ cap_id ];
+}
 
 
-	    agp_info->fast_writes = (agp_status & 0x0010) != 0;
-	    agp_info->addr64 =      (agp_status & 0x0020) != 0;
-	    agp_info->htrans =      (agp_status & 0x0040) == 0;
-	    agp_info->gart64 =      (agp_status & 0x0080) != 0;
-	    agp_info->coherent =    (agp_status & 0x0100) != 0;
-	    agp_info->sideband =    (agp_status & 0x0200) != 0;
-	    agp_info->isochronus =  (agp_status & 0x10000) != 0;
+/**
+ * Find an extended capability of a PCI Express device.
+ *
+ * The extended capability list is parsed once per device.  Later calls are
+ * answered from the library's capability index without accessing the
+ * device.
+ *
+ * \param dev       Device to search.
+ * \param cap_id    Extended capability ID, such as \c PCI_EXT_CAP_ID_AER.
+ * \param instance  Which instance of the capability to find, starting from
+ *                  zero for the first.
+ *
+ * \return
+ * Offset of the capability in configuration space, or zero if the device
+ * does not have it.
+ *
+ * \sa pci_device_find_dvsec
+ */
+int
+pci_device_find_ext_capability( struct pci_device * dev, unsigned cap_id,
+				unsigned instance )
+{
+    struct pci_device_private * priv = (struct pci_device_private *) dev;
+    unsigned i;
 
-	    agp_info->async_req_size = 4 + (1 << ((agp_status & 0xe000) >> 13));
-	    agp_info->calibration_cycle_timing = ((agp_status & 0x1c00) >> 10);
-	    agp_info->max_requests = 1 + ((agp_status & 0xff000000) >> 24);
+    if ( dev == NULL ) {
+	return 0;
+    }
 
-	    dev_priv->agp = agp_info;
-	    break;
-	}
+    if ( index_ext_capabilities( priv ) != 0 ) {
+	return 0;
+    }
 
-	/* No other capabilities are currently handled.
-	 */
-	default:
-	    printf( "Unknown cap 0x%02x @ 0x%02x\n", cap_id, cap_offset );
-	    break;
-	}
+    for ( i = 0 ; i < priv->num_ext_caps ; i++ ) {
+	if ( priv->ext_caps[ i ].id == cap_id ) {
+	    if ( instance == 0 ) {
+		return priv->ext_caps[ i ].offset;
+	    }
 
-	cap_offset = next_cap;
+	    instance--;
+	}
     }
 
     return 0;
@@ -177,20 +444,48 @@ pci_fill_capabilities_generic( struct pci_device * dev )
 
 
 /**
- * Get AGP capability data for a device.
+ * Find a Designated Vendor-Specific Extended Capability of a device.
+ *
+ * \param dev        Device to search.
+ * \param vendor_id  DVSEC vendor ID to match, or \c PCI_MATCH_ANY.
+ * \param dvsec_id   DVSEC ID to match, or \c PCI_MATCH_ANY.
+ * \param instance   Which matching DVSEC to find, starting from zero for
+ *                   the first.
+ *
+ * \return
+ * Offset of the DVSEC in configuration space, or zero if the device does not
+ * have a matching one.
+ *
+ * \sa pci_device_find_ext_capability
  */
-const struct pci_agp_info *
-pci_device_get_agp_info( struct pci_device * dev )
+int
+pci_device_find_dvsec( struct pci_device * dev, uint32_t vendor_id,
+		       uint32_t dvsec_id, unsigned instance )
 {
-    struct pci_device_private * dev_priv = (struct pci_device_private *) dev;
+    struct pci_device_private * priv = (struct pci_device_private *) dev;
+    unsigned i;
 
     if ( dev == NULL ) {
-	return NULL;
+	return 0;
     }
 
-    if ( dev_priv->agp == NULL ) {
-	(void) (*pci_sys->methods->fill_capabilities)( dev );
+    if ( index_ext_capabilities( priv ) != 0 ) {
+	return 0;
     }
 
-    return dev_priv->agp;
+    for ( i = 0 ; i < priv->num_ext_caps ; i++ ) {
+	const struct pci_ext_cap * const c = & priv->ext_caps[ i ];
+
+	if ( (c->id == PCI_EXT_CAP_ID_DVSEC)
+	     && PCI_ID_COMPARE( vendor_id, c->dvsec_vendor )
+	     && PCI_ID_COMPARE( dvsec_id, c->dvsec_id ) ) {
+	    if ( instance == 0 ) {
+		return c->offset;
+	    }
+
+	    instance--;
+	}
+    }
+
+    return 0;
 }
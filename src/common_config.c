@@ -0,0 +1,873 @@
+/*
+ * Copyright (c) 2026 The libpciaccess Contributors
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS AND/OR THEIR SUPPLIERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/**
+ * \file common_config.c
+ * Platform independent routines for keeping a copy of a device's
+ * configuration space in memory.
+ *
+ * Each device may have a snapshot of its configuration space, taken with a
+ * single back-end read, which also serves as a shadow of the registers that
+ * do not change behind the library's back.  \c pci_device_cfg_read answers
+ * reads of such registers from the shadow, and \c pci_device_cfg_write
+ * keeps the shadow in sync.
+ *
+ * Optionally, small reads of volatile registers can also be answered from a
+ * recently read 64-byte line of configuration space.  See
+ * \c pci_system_set_cfg_readahead.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "pciaccess.h"
+#include "pciaccess_private.h"
+
+#define S   PCI_CFG_REG_STATIC
+#define V   PCI_CFG_REG_VOLATILE
+#define W   PCI_CFG_REG_WRITE_TRACKED
+
+/**
+ * Register classes for the 64-byte header, indexed by header type.
+ *
+ * The vendor and device IDs are read from the device every time, since
+ * they read as all ones once the device is gone, which is how callers tell
+ * that it was removed.
+ */
+static const uint8_t header_class[3][64] = {
+    /* Type 0: normal device */
+    {
+	V, V, V, V,  W, W, V, V,  S, S, S, S,  W, W, S, V,
+	S, S, S, S,  S, S, S, S,  S, S, S, S,  S, S, S, S,
+	S, S, S, S,  S, S, S, S,  S, S, S, S,  S, S, S, S,
+	S, S, S, S,  S, S, S, S,  S, S, S, S,  W, S, S, S,
+    },
+
+    /* Type 1: PCI-to-PCI bridge */
+    {
+	V, V, V, V,  W, W, V, V,  S, S, S, S,  W, W, S, V,
+	S, S, S, S,  S, S, S, S,  W, W, W, W,  W, W, V, V,
+	W, W, W, W,  W, W, W, W,  W, W, W, W,  W, W, W, W,
+	W, W, W, W,  S, S, S, S,  S, S, S, S,  W, S, W, W,
+    },
+
+    /* Type 2: CardBus bridge */
+    {
+	V, V, V, V,  W, W, V, V,  S, S, S, S,  W, W, S, V,
+	V, V, V, V,  V, V, V, V,  V, V, V, V,  V, V, V, V,
+	V, V, V, V,  V, V, V, V,  V, V, V, V,  V, V, V, V,
+	V, V, V, V,  V, V, V, V,  V, V, V, V,  V, V, V, V,
+    },
+};
+
+/**
+ * Register classes for the PCI Express capability structure.
+ */
+static const uint8_t pcie_cap_class[0x3c] = {
+    S, S, S, S,  S, S, S, S,  W, W, V, V,  S, S, S, S,  /* DevCap, DevCtl */
+    W, W, V, V,  S, S, S, S,  W, W, V, V,  W, W, S, S,  /* Link, Slot, Root */
+    V, V, V, V,  S, S, S, S,  W, W, V, V,  S, S, S, S,  /* RootSta, Dev2 */
+    W, W, V, V,  S, S, S, S,  W, W, V, V,                /* Link2, Slot2 */
+};
+
+#undef S
+#undef V
+#undef W
+
+/**
+ * Allocate the snapshot buffer and shadow validity bitmap for a device.
+ */
+static int
+config_alloc( struct pci_device_private * priv )
+{
+    if ( priv->config == NULL ) {
+	priv->config = calloc( 1, PCI_CONFIG_SPACE_EXT_SIZE
+			       + (PCI_CONFIG_SPACE_EXT_SIZE / 8) );
+	if ( priv->config == NULL ) {
+	    return ENOMEM;
+	}
+
+	priv->config_valid = priv->config + PCI_CONFIG_SPACE_EXT_SIZE;
+    }
+
+    return 0;
+}
+
+/**
+ * Start changing the bytes of a device's snapshot.  Must be called with the
+ * device locked.
+ *
+ * \c config_generation works as a sequence count: it is odd while the bytes
+ * visible through \c pci_device_cfg_view are being changed, and even
+ * otherwise.
+ */
+static void
+config_write_begin( struct pci_device_private * priv )
+{
+    __atomic_store_n( & priv->config_generation, priv->config_generation + 1,
+		      __ATOMIC_RELAXED );
+    __atomic_thread_fence( __ATOMIC_RELEASE );
+}
+
+
+/**
+ * Finish changing the bytes of a device's snapshot.
+ */
+static void
+config_write_end( struct pci_device_private * priv )
+{
+    __atomic_store_n( & priv->config_generation, priv->config_generation + 1,
+		      __ATOMIC_RELEASE );
+}
+
+#define CONFIG_VALID(p, o)  (((p)->config_valid[(o) >> 3] >> ((o) & 7)) & 1)
+
+static void
+config_set_valid( struct pci_device_private * priv, unsigned offset,
+		  int valid )
+{
+    if ( valid ) {
+	priv->config_valid[ offset >> 3 ] |= (1U << (offset & 7));
+    }
+    else {
+	priv->config_valid[ offset >> 3 ] &= ~(1U << (offset & 7));
+    }
+}
+
+
+/**
+ * Classify a byte of configuration space for the register shadow.
+ *
+ * Only the header, the PCI Express capability and capability list headers
+ * are classified.  Everything else, including any byte whose surroundings
+ * are not known yet, is treated as volatile.
+ *
+ * \param priv    Device the byte belongs to.
+ * \param offset  Offset of the byte in configuration space.
+ */
+_pci_hidden enum pci_cfg_reg_class
+pci_device_cfg_reg_class( const struct pci_device_private * priv,
+			  unsigned offset )
+{
+    unsigned header_type;
+    unsigned cap;
+    unsigned i;
+
+
+    if ( (priv->config == NULL) || (offset >= PCI_CONFIG_SPACE_EXT_SIZE) ) {
+	return PCI_CFG_REG_VOLATILE;
+    }
+
+    if ( offset < 16 ) {
+	return header_class[0][ offset ];
+    }
+
+    /* The layout of the rest of the header depends on the header type.
+     */
+    if ( ! CONFIG_VALID( priv, 0x0e ) ) {
+	return PCI_CFG_REG_VOLATILE;
+    }
+
+    header_type = priv->config[0x0e] & 0x7f;
+    if ( header_type > 2 ) {
+	return PCI_CFG_REG_VOLATILE;
+    }
+
+    if ( offset < 64 ) {
+	return header_class[ header_type ][ offset ];
+    }
+
+    if ( __atomic_load_n( & priv->caps_indexed, __ATOMIC_ACQUIRE ) ) {
+	cap = priv->cap_offsets[ PCI_CAP_ID_EXP ];
+	if ( (cap != 0) && (offset >= cap)
+	     && (offset < cap + sizeof( pcie_cap_class )) ) {
+	    return pcie_cap_class[ offset - cap ];
+	}
+
+	for ( i = 0 ; i <= PCI_CAP_ID_MAX ; i++ ) {
+	    cap = priv->cap_offsets[ i ];
+	    if ( (cap != 0) && (offset >= cap) && (offset < cap + 2) ) {
+		return PCI_CFG_REG_STATIC;
+	    }
+	}
+    }
+
+    if ( (offset >= PCI_CONFIG_SPACE_SIZE)
+	 && __atomic_load_n( & priv->ext_caps_indexed, __ATOMIC_ACQUIRE ) ) {
+	for ( i = 0 ; i < priv->num_ext_caps ; i++ ) {
+	    cap = priv->ext_caps[ i ].offset;
+	    if ( (offset >= cap) && (offset < cap + 4) ) {
+		return PCI_CFG_REG_STATIC;
+	    }
+	}
+    }
+
+    return PCI_CFG_REG_VOLATILE;
+}
+
+
+/**
+ * Try to satisfy a configuration read from the register shadow.
+ *
+ * \return
+ * Non-zero if every requested byte was copied from the shadow, zero if the
+ * read has to go to the device.
+ */
+_pci_hidden int
+pci_device_config_cache_read( struct pci_device_private * priv, void * data,
+			      pciaddr_t offset, pciaddr_t size )
+{
+    unsigned i;
+    int hit = 0;
+
+
+    if ( (size == 0) || (offset >= PCI_CONFIG_SPACE_EXT_SIZE)
+	 || (size > PCI_CONFIG_SPACE_EXT_SIZE - offset) ) {
+	return 0;
+    }
+
+    pci_device_lock( priv );
+    if ( priv->config != NULL ) {
+	for ( i = offset ; i < offset + size ; i++ ) {
+	    if ( ! CONFIG_VALID( priv, i )
+		 || (pci_device_cfg_reg_class( priv, i )
+		     == PCI_CFG_REG_VOLATILE) ) {
+		break;
+	    }
+	}
+
+	if ( i == offset + size ) {
+	    (void) memcpy( data, priv->config + offset, size );
+	    hit = 1;
+	}
+    }
+    pci_device_unlock( priv );
+
+    return hit;
+}
+
+
+/**
+ * Record data just read from the device in the register shadow.
+ *
+ * Bytes of static and write-tracked registers become valid.  Volatile bytes
+ * are copied too, so the snapshot holds the latest value seen, but they are
+ * never served from the shadow.
+ */
+static void
+config_cache_fill( struct pci_device_private * priv, const void * data,
+		   pciaddr_t offset, pciaddr_t size )
+{
+    const uint8_t * const bytes = data;
+    unsigned i;
+
+
+    if ( (offset >= PCI_CONFIG_SPACE_EXT_SIZE) || (config_alloc( priv ) != 0) ) {
+	return;
+    }
+
+    if ( size > PCI_CONFIG_SPACE_EXT_SIZE - offset ) {
+	size = PCI_CONFIG_SPACE_EXT_SIZE - offset;
+    }
+
+    if ( (bytes != priv->config + offset)
+	 && (memcmp( priv->config + offset, bytes, size ) != 0) ) {
+	config_write_begin( priv );
+	(void) memcpy( priv->config + offset, bytes, size );
+	config_write_end( priv );
+    }
+
+    /* The header type determines how the rest of the header is classified,
+     * so record it first.
+     */
+    if ( (offset <= 0x0e) && (offset + size > 0x0e) ) {
+	config_set_valid( priv, 0x0e, 1 );
+    }
+
+    for ( i = offset ; i < offset + size ; i++ ) {
+	config_set_valid( priv, i, pci_device_cfg_reg_class( priv, i )
+			  != PCI_CFG_REG_VOLATILE );
+    }
+}
+
+
+_pci_hidden void
+pci_device_config_cache_fill( struct pci_device_private * priv,
+			      const void * data, pciaddr_t offset,
+			      pciaddr_t size )
+{
+    pci_device_lock( priv );
+    config_cache_fill( priv, data, offset, size );
+    pci_device_unlock( priv );
+}
+
+
+/**
+ * Kinds of reset a config write can trigger.
+ */
+enum config_reset {
+    RESET_NONE,
+    RESET_DEVICE,       /**< Function level reset of the device. */
+    RESET_BUS           /**< Reset of the bus below a bridge. */
+};
+
+
+/**
+ * Check whether written bytes set a given bit.
+ *
+ * \param bytes   Data written.
+ * \param offset  Offset of the first byte written.
+ * \param size    Number of bytes written.
+ * \param bit     Offset of the byte holding the reset bit.
+ * \param mask    Reset bit within that byte.
+ */
+static int
+config_sets_bit( const uint8_t * bytes, pciaddr_t offset, pciaddr_t size,
+		 unsigned bit, uint8_t mask )
+{
+    return (bit >= offset) && (bit < offset + size)
+	&& (bytes[ bit - offset ] & mask) != 0;
+}
+
+
+/**
+ * Find out whether a write resets the device or the devices below it.
+ * Must be called with the device locked.
+ *
+ * Until the capability list is indexed, a write past the header might be
+ * a function level reset, and is treated as one.
+ */
+static enum config_reset
+config_write_reset( const struct pci_device_private * priv,
+		    const uint8_t * bytes, pciaddr_t offset, pciaddr_t size )
+{
+    unsigned cap;
+
+    /* Secondary Bus Reset in the Bridge Control register.
+     */
+    if ( CONFIG_VALID( priv, 0x0e )
+	 && ((priv->config[0x0e] & 0x7f) == 1
+	     || (priv->config[0x0e] & 0x7f) == 2)
+	 && config_sets_bit( bytes, offset, size, 0x3e, 0x40 ) ) {
+	return RESET_BUS;
+    }
+
+    if ( offset + size <= 64 || offset >= PCI_CONFIG_SPACE_SIZE ) {
+	return RESET_NONE;
+    }
+
+    if ( ! __atomic_load_n( & priv->caps_indexed, __ATOMIC_ACQUIRE ) ) {
+	return RESET_DEVICE;
+    }
+
+    /* Initiate Function Level Reset in the PCI Express Device Control
+     * register, or in the Advanced Features Control register.
+     */
+    cap = priv->cap_offsets[ PCI_CAP_ID_EXP ];
+    if ( cap != 0 && config_sets_bit( bytes, offset, size, cap + 9, 0x80 ) ) {
+	return RESET_DEVICE;
+    }
+
+    cap = priv->cap_offsets[ PCI_CAP_ID_AF ];
+    if ( cap != 0 && config_sets_bit( bytes, offset, size, cap + 4, 0x01 ) ) {
+	return RESET_DEVICE;
+    }
+
+    return RESET_NONE;
+}
+
+
+/**
+ * Drop a device's whole register shadow and read-ahead line.
+ */
+static void
+config_cache_drop( struct pci_device_private * priv )
+{
+    pci_device_lock( priv );
+    if ( priv->config != NULL ) {
+	memset( priv->config_valid, 0, PCI_CONFIG_SPACE_EXT_SIZE / 8 );
+    }
+
+    if ( priv->cfg_line != NULL ) {
+	priv->cfg_line->size = 0;
+    }
+    pci_device_unlock( priv );
+}
+
+
+/**
+ * Drop the shadows of the devices below a bridge whose secondary bus was
+ * reset.
+ */
+static void
+config_cache_drop_bus( struct pci_device_private * priv )
+{
+    struct pci_system * const sys = priv->sys;
+    uint8_t buses[2];
+    pciaddr_t bytes = 0;
+    size_t i;
+
+    if ( sys->methods->read( & priv->base, buses, 0x19, 2, & bytes ) != 0
+	 || bytes != 2 ) {
+	return;
+    }
+
+    for ( i = 0 ; i < sys->num_devices ; i++ ) {
+	const struct pci_device * const dev = & sys->devices[i].base;
+
+	if ( dev->domain == priv->base.domain
+	     && dev->bus >= buses[0] && dev->bus <= buses[1] ) {
+	    config_cache_drop( & sys->devices[i] );
+	}
+    }
+}
+
+
+/**
+ * Update the register shadow after data was written to the device.
+ *
+ * Static and write-tracked bytes are dropped from the shadow, and re-read
+ * from the device next time.  The device may not keep the value as
+ * written: bits may be hardwired, as in the bridge window registers that
+ * software sizes by writing all ones, or read back as zero, as the
+ * command bits that start a reset or link retraining do.  For the same
+ * reason, the snapshot keeps the last value read rather than the value
+ * written, e.g. the ones written to clear status bits.
+ *
+ * Writes that reset the device drop its whole shadow, and a secondary bus
+ * reset drops the shadows of every device below the bridge.
+ */
+_pci_hidden void
+pci_device_config_cache_write( struct pci_device_private * priv,
+			       const void * data, pciaddr_t offset,
+			       pciaddr_t size )
+{
+    const uint8_t * const bytes = data;
+    enum config_reset reset;
+    unsigned i;
+
+
+    if ( offset >= PCI_CONFIG_SPACE_EXT_SIZE ) {
+	return;
+    }
+
+    if ( size > PCI_CONFIG_SPACE_EXT_SIZE - offset ) {
+	size = PCI_CONFIG_SPACE_EXT_SIZE - offset;
+    }
+
+    pci_device_lock( priv );
+    if ( priv->config == NULL ) {
+	pci_device_unlock( priv );
+	return;
+    }
+
+    reset = config_write_reset( priv, bytes, offset, size );
+    if ( reset != RESET_NONE ) {
+	memset( priv->config_valid, 0, PCI_CONFIG_SPACE_EXT_SIZE / 8 );
+    }
+
+    for ( i = offset ; i < offset + size ; i++ ) {
+	config_set_valid( priv, i, 0 );
+    }
+    pci_device_unlock( priv );
+
+    if ( reset == RESET_BUS ) {
+	config_cache_drop_bus( priv );
+    }
+}
+
+/**
+ * Current \c CLOCK_MONOTONIC time in nanoseconds.
+ */
+_pci_hidden uint64_t
+pci_monotonic_ns( void )
+{
+    struct timespec ts;
+
+    (void) clock_gettime( CLOCK_MONOTONIC, & ts );
+    return ((uint64_t) ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+
+/**
+ * Try to satisfy a configuration read from the device's read-ahead line.
+ *
+ * If read-ahead is enabled and the read fits in one aligned 64-byte line,
+ * the line is used if it was read recently enough.  Otherwise the whole line
+ * is read from the device, and kept for later reads.
+ *
+ * \return
+ * Non-zero if the read was satisfied, zero if the read has to go to the
+ * device as is.
+ */
+_pci_hidden int
+pci_device_config_readahead( struct pci_device_private * priv, void * data,
+			     pciaddr_t offset, pciaddr_t size )
+{
+    const pciaddr_t line_offset = offset & ~((pciaddr_t) PCI_CFG_LINE_SIZE - 1);
+    struct pci_cfg_line * line;
+    pciaddr_t bytes = 0;
+    uint64_t now;
+    int err;
+
+
+    if ( (priv->sys->cfg_readahead_usec == 0) || (size == 0)
+	 || (offset + size > line_offset + PCI_CFG_LINE_SIZE) ) {
+	return 0;
+    }
+
+    now = pci_monotonic_ns();
+
+    pci_device_lock( priv );
+    line = priv->cfg_line;
+    if ( (line != NULL) && (line->offset == line_offset)
+	 && (offset + size <= line_offset + line->size)
+	 && (now - line->stamp
+	     <= (uint64_t) priv->sys->cfg_readahead_usec * 1000) ) {
+	(void) memcpy( data, line->data + (offset - line_offset), size );
+	pci_device_unlock( priv );
+	return 1;
+    }
+
+    if ( line == NULL ) {
+	line = malloc( sizeof( *line ) );
+	if ( line == NULL ) {
+	    pci_device_unlock( priv );
+	    return 0;
+	}
+
+	priv->cfg_line = line;
+    }
+
+    line->size = 0;
+    err = priv->sys->methods->read( & priv->base, line->data, line_offset,
+				  PCI_CFG_LINE_SIZE, & bytes );
+    if ( err || (bytes == 0) ) {
+	pci_device_unlock( priv );
+	return 0;
+    }
+
+    line->offset = line_offset;
+    line->size = bytes;
+    line->stamp = now;
+    config_cache_fill( priv, line->data, line_offset, bytes );
+
+    /* Unprivileged readers may get a short line.
+     */
+    if ( offset + size > line_offset + bytes ) {
+	pci_device_unlock( priv );
+	return 0;
+    }
+
+    (void) memcpy( data, line->data + (offset - line_offset), size );
+    pci_device_unlock( priv );
+    return 1;
+}
+
+
+/**
+ * Discard the device's read-ahead line, e.g., after a write.
+ */
+_pci_hidden void
+pci_device_config_readahead_invalidate( struct pci_device_private * priv )
+{
+    pci_device_lock( priv );
+    if ( priv->cfg_line != NULL ) {
+	priv->cfg_line->size = 0;
+    }
+    pci_device_unlock( priv );
+}
+
+
+/**
+ * Enable or disable config space read-ahead.
+ *
+ * With read-ahead enabled, a read of up to 64 bytes by
+ * \c pci_device_cfg_read fetches the whole aligned 64-byte line containing
+ * it.  Further reads from the same line of the same device during the next
+ * \c window_usec microseconds are served from that line, even for registers
+ * that may change on their own.  Writing to the device discards the line.
+ *
+ * This turns a series of small reads, such as when dumping a device's
+ * header, into a single access to the device, at the cost of returning data
+ * up to \c window_usec old.  Reads made with \c PCI_DEV_CFG_FLAG_UNCACHED
+ * never use the line.
+ *
+ * \param window_usec  How long a line may be used, in microseconds.  Zero,
+ *                     the default, disables read-ahead.
+ *
+ * \return
+ * Zero on success or an \c errno value on failure.
+ */
+int
+pci_system_set_cfg_readahead( unsigned window_usec )
+{
+    return pci_context_set_cfg_readahead( pci_context_default(), window_usec );
+}
+
+
+/**
+ * Enable or disable config space read-ahead for the devices of one context.
+ *
+ * \param ctx          Context to configure.
+ * \param window_usec  How long a line may be used, in microseconds.
+ *
+ * \return
+ * Zero on success or an \c errno value on failure.
+ *
+ * \sa pci_system_set_cfg_readahead
+ */
+int
+pci_context_set_cfg_readahead( struct pci_context * ctx, unsigned window_usec )
+{
+    if ( ctx == NULL || ctx->sys == NULL ) {
+	return EINVAL;
+    }
+
+    ctx->sys->cfg_readahead_usec = window_usec;
+    return 0;
+}
+
+
+/**
+ * Refresh the library's snapshot of a device's configuration space.
+ *
+ * The whole configuration space is fetched with a single call to
+ * \c pci_system_methods::read.  Conventional devices stop after 256 bytes,
+ * PCI Express devices provide 4096 bytes, and unprivileged callers on some
+ * platforms only get the first 64 bytes.  \c pci_device_private::config_size
+ * records how much was actually read.
+ *
+ * \param priv  Device whose configuration space is to be read.
+ *
+ * \return
+ * Zero on success or an \c errno value on failure.
+ */
+_pci_hidden int
+pci_device_config_snapshot( struct pci_device_private * priv )
+{
+    uint8_t data[ PCI_CONFIG_SPACE_EXT_SIZE ];
+    pciaddr_t bytes = 0;
+    pciaddr_t i;
+    int err;
+
+
+    pci_device_lock( priv );
+    err = config_alloc( priv );
+    if ( err ) {
+	pci_device_unlock( priv );
+	return err;
+    }
+
+    /* Read into a scratch buffer, since lock-free readers of the view may be
+     * looking at the snapshot.
+     */
+    err = priv->sys->methods->read( & priv->base, data, 0,
+				  PCI_CONFIG_SPACE_EXT_SIZE, & bytes );
+
+    /* Some back-ends refuse reads that extend past the end of conventional
+     * configuration space instead of returning a short count.
+     */
+    if ( err && (bytes == 0) ) {
+	err = priv->sys->methods->read( & priv->base, data, 0,
+				      PCI_CONFIG_SPACE_SIZE, & bytes );
+    }
+
+    if ( bytes == 0 ) {
+	(void) memset( priv->config_valid, 0, PCI_CONFIG_SPACE_EXT_SIZE / 8 );
+	__atomic_store_n( & priv->config_size, 0, __ATOMIC_RELEASE );
+	pci_device_unlock( priv );
+	return (err != 0) ? err : ENXIO;
+    }
+
+    config_write_begin( priv );
+    (void) memcpy( priv->config, data, bytes );
+    __atomic_store_n( & priv->config_size, bytes, __ATOMIC_RELEASE );
+    config_write_end( priv );
+
+    /* The shadow is refreshed from the bytes just read; only bytes past
+     * them are dropped.
+     */
+    for ( i = bytes ; i < PCI_CONFIG_SPACE_EXT_SIZE ; i++ ) {
+	config_set_valid( priv, i, 0 );
+    }
+
+    config_cache_fill( priv, priv->config, 0, bytes );
+    pci_device_unlock( priv );
+    return 0;
+}
+
+
+/**
+ * Read a device's entire configuration space at once.
+ *
+ * Reads all of the device's configuration space (256 bytes for conventional
+ * PCI devices, 4096 bytes for PCI Express devices) with a single access to
+ * the platform back-end.  The data is kept by the library, where it is used
+ * for capability discovery, and up to \c size bytes of it are copied to
+ * \c buffer.
+ *
+ * \param dev         Device whose configuration space is to be read.
+ * \param buffer      Location to store the data.  This pointer may be
+ *                    \c NULL if only the library's copy is to be refreshed.
+ * \param size        Size, in bytes, of \c buffer.
+ * \param bytes_read  Location to store the number of bytes of configuration
+ *                    space that were read from the device.  This pointer may
+ *                    be \c NULL.
+ *
+ * \return
+ * Zero on success or an \c errno value on failure.
+ *
+ * \note
+ * As with \c pci_device_cfg_read, the data is \b not byte-swapped to the
+ * host's byte order.
+ */
+int
+pci_device_read_config_snapshot( struct pci_device * dev, void * buffer,
+				 pciaddr_t size, pciaddr_t * bytes_read )
+{
+    struct pci_device_private * const priv =
+	(struct pci_device_private *) dev;
+    int err;
+
+
+    if ( bytes_read != NULL ) {
+	*bytes_read = 0;
+    }
+
+    if ( dev == NULL ) {
+	return EFAULT;
+    }
+
+    err = pci_device_config_snapshot( priv );
+    if ( err ) {
+	return err;
+    }
+
+    pci_device_lock( priv );
+    if ( buffer != NULL ) {
+	if ( size > priv->config_size ) {
+	    size = priv->config_size;
+	}
+
+	(void) memcpy( buffer, priv->config, size );
+    }
+
+    if ( bytes_read != NULL ) {
+	*bytes_read = priv->config_size;
+    }
+    pci_device_unlock( priv );
+
+    return 0;
+}
+
+
+/**
+ * Get a read-only view of the library's copy of a device's config space.
+ *
+ * The view points into the snapshot that the library uses for capability
+ * discovery and as its register shadow, so no data is copied.  A snapshot is
+ * taken first if the device has none.  The pointer stays valid until
+ * \c pci_system_cleanup is called, but the bytes it points to are updated
+ * by later snapshots and by config reads made through the library.  To
+ * decode a consistent copy without locking, read
+ * \c pci_device_cfg_generation first and retry while it is odd, then decode,
+ * and retry if the generation has changed since.
+ *
+ * Registers hold the last value the library read from the device, not
+ * values written since, and not the current value of volatile registers
+ * such as status registers.
+ *
+ * \param dev  Device whose config space is wanted.
+ * \param len  Location to store the number of valid bytes in the view.
+ *
+ * \return
+ * Pointer to the device's config space, with the same byte order as
+ * \c pci_device_cfg_read, or \c NULL with \c errno set on failure.
+ *
+ * \sa pci_device_read_config_snapshot
+ */
+const uint8_t *
+pci_device_cfg_view( struct pci_device * dev, pciaddr_t * len )
+{
+    struct pci_device_private * const priv =
+	(struct pci_device_private *) dev;
+    int err;
+
+
+    if ( len != NULL ) {
+	*len = 0;
+    }
+
+    if ( dev == NULL ) {
+	errno = EFAULT;
+	return NULL;
+    }
+
+    if ( __atomic_load_n( & priv->config_size, __ATOMIC_ACQUIRE ) == 0 ) {
+	err = pci_device_config_snapshot( priv );
+	if ( err ) {
+	    errno = err;
+	    return NULL;
+	}
+    }
+
+    if ( len != NULL ) {
+	*len = __atomic_load_n( & priv->config_size, __ATOMIC_ACQUIRE );
+    }
+
+    return priv->config;
+}
+
+
+/**
+ * Get the generation number of a device's config space view.
+ *
+ * The number changes whenever bytes visible through
+ * \c pci_device_cfg_view may have changed.  It is odd while they are
+ * being changed.
+ *
+ * \param dev  Device to query.
+ *
+ * \return
+ * The current generation number.
+ */
+uint64_t
+pci_device_cfg_generation( struct pci_device * dev )
+{
+    const struct pci_device_private * const priv =
+	(const struct pci_device_private *) dev;
+
+    if ( priv == NULL ) {
+	return 0;
+    }
+
+    /* Order the caller's reads of the view before this load, for callers
+     * checking that the view did not change while they decoded it.
+     */
+    __atomic_thread_fence( __ATOMIC_ACQUIRE );
+    return __atomic_load_n( & priv->config_generation, __ATOMIC_ACQUIRE );
+}
@@ -35,6 +35,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <pthread.h>
 
 #if defined(HAVE_STRING_H)
 # include <string.h>
@@ -120,9 +121,41 @@ struct pci_device_leaf {
 
 /**
  * Root of the PCI vendor ID search tree.
+ *
+ * Nodes are never removed, so lookups walk the tree without locking.  New
+ * nodes are published with an atomic compare-and-swap, and vendor nodes are
+ * filled in from the pci.ids file under \c populate_lock.
  */
 _pci_hidden struct pci_id_node * tree = NULL;
 
+static pthread_mutex_t populate_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Install a new node in an empty slot of the tree.
+ *
+ * \return
+ * The node in the slot, which is \c node unless another thread got there
+ * first, or \c NULL if \c node is \c NULL.
+ */
+static struct pci_id_node *
+publish_node( struct pci_id_node ** slot, struct pci_id_node * node )
+{
+    struct pci_id_node * expected = NULL;
+
+    if ( node == NULL ) {
+	return NULL;
+    }
+
+    if ( ! __atomic_compare_exchange_n( slot, & expected, node, 0,
+					__ATOMIC_ACQ_REL,
+					__ATOMIC_ACQUIRE ) ) {
+	free( node );
+	return expected;
+    }
+
+    return node;
+}
+
 /**
  * Get a pointer to the leaf node for a vendor ID.
  *
@@ -134,20 +167,21 @@ insert( uint16_t vendor )
     struct pci_id_node * n;
     unsigned bits = 0;
 
-    if ( tree == NULL ) {
-	tree = calloc( 1, sizeof( struct pci_id_node ) );
+    n = __atomic_load_n( & tree, __ATOMIC_ACQUIRE );
+    if ( n == NULL ) {
+	n = calloc( 1, sizeof( struct pci_id_node ) );
 
-	if ( tree == NULL )
-		return NULL;
+	if ( n != NULL )
+		n->bits = 4;
 
-	tree->bits = 4;
+	n = publish_node( & tree, n );
     }
 
-    n = tree;
     while ( n != NULL ) {
 	const unsigned used_bits = n->bits;
 	const unsigned mask = (1 << used_bits) - 1;
 	const unsigned idx = (vendor & (mask << bits)) >> bits;
+	struct pci_id_node * child;
 
 
 	if ( bits >= 16 ) {
@@ -156,32 +190,28 @@ insert( uint16_t vendor )
 
 	bits += used_bits;
 
-	if ( n->children[ idx ] == NULL ) {
+	child = __atomic_load_n( & n->children[ idx ], __ATOMIC_ACQUIRE );
+	if ( child == NULL ) {
 	    if ( bits < 16 ) {
-		struct pci_id_node * child =
-		    calloc( 1, sizeof( struct pci_id_node ) );
-
-		if ( child == NULL )
-			return NULL;
-
-		child->bits = 4;
+		child = calloc( 1, sizeof( struct pci_id_node ) );
 
-		n->children[ idx ] = child;
+		if ( child != NULL )
+			child->bits = 4;
 	    }
 	    else {
 		struct pci_id_leaf * leaf =
 		    calloc( 1, sizeof( struct pci_id_leaf ) );
 
-		if ( leaf == NULL )
-			return NULL;
+		if ( leaf != NULL )
+			leaf->vendor = vendor;
 
-		leaf->vendor = vendor;
-
-		n->children[ idx ] = (struct pci_id_node *) leaf;
+		child = (struct pci_id_node *) leaf;
 	    }
+
+	    child = publish_node( & n->children[ idx ], child );
 	}
 
-	n = n->children[ idx ];
+	n = child;
     }
 
     return (struct pci_id_leaf *) n;
@@ -198,6 +228,10 @@ insert( uint16_t vendor )
  * cases (i.e., a 0-tab line followed by a 2-tab line) that aren't handled
  * correctly.  I don't think there are any security problems with the code,
  * but it's not impossible.
+ *
+ * Must be called with \c populate_lock held.  The device list is built
+ * privately and published once complete, so that lookups done without the
+ * lock never see a partial list.
  */
 static void
 populate_vendor( struct pci_id_leaf * vend, int fill_device_data )
@@ -205,6 +239,8 @@ populate_vendor( struct pci_id_leaf * vend, int fill_device_data )
     pci_id_file * f;
     char buf[128];
     unsigned vendor = PCI_MATCH_ANY;
+    struct pci_device_leaf * devices = NULL;
+    size_t num_devices = 0;
 
 
     /* If the device tree for this vendor is already populated, don't do
@@ -260,7 +296,9 @@ populate_vendor( struct pci_id_leaf * vend, int fill_device_data )
 		 * of this function with fill_device_data = 0.
 		 */
 		if (vend->vendor_name == NULL) {
-		    vend->vendor_name = strdup( & buf[ num_tabs + 6 ] );
+		    __atomic_store_n( & vend->vendor_name,
+				      strdup( & buf[ num_tabs + 6 ] ),
+				      __ATOMIC_RELEASE );
 		}
 
 		/* If we're not going to fill in all of the device data as
@@ -279,16 +317,16 @@ populate_vendor( struct pci_id_leaf * vend, int fill_device_data )
 
 
 
-	    d = realloc( vend->devices, (vend->num_devices + 1)
+	    d = realloc( devices, (num_devices + 1)
 			 * sizeof( struct pci_device_leaf ) );
 	    if ( d == NULL ) {
 		goto cleanup;
 	    }
 
-	    last_dev = & d[ vend->num_devices - 1 ];
-	    dev = & d[ vend->num_devices ];
-	    vend->num_devices++;
-	    vend->devices = d;
+	    last_dev = & d[ num_devices - 1 ];
+	    dev = & d[ num_devices ];
+	    num_devices++;
+	    devices = d;
 
 	    if ( num_tabs == 1 ) {
 		dev->id.vendor_id = vend->vendor;
@@ -316,6 +354,11 @@ populate_vendor( struct pci_id_leaf * vend, int fill_device_data )
     }
   cleanup:
     pci_id_file_close( f );
+
+    if ( num_devices != 0 ) {
+	vend->devices = devices;
+	__atomic_store_n( & vend->num_devices, num_devices, __ATOMIC_RELEASE );
+    }
 }
 
 
@@ -330,6 +373,7 @@ static const char *
 find_device_name( const struct pci_id_match * m )
 {
     struct pci_id_leaf * vend;
+    size_t num_devices;
     unsigned i;
 
 
@@ -343,12 +387,16 @@ find_device_name( const struct pci_id_match * m )
 	return NULL;
     }
 
-    if ( vend->num_devices == 0 ) {
+    num_devices = __atomic_load_n( & vend->num_devices, __ATOMIC_ACQUIRE );
+    if ( num_devices == 0 ) {
+	pthread_mutex_lock( & populate_lock );
 	populate_vendor( vend, 1 );
+	pthread_mutex_unlock( & populate_lock );
+	num_devices = __atomic_load_n( & vend->num_devices, __ATOMIC_ACQUIRE );
     }
 
 
-    for ( i = 0 ; i < vend->num_devices ; i++ ) {
+    for ( i = 0 ; i < num_devices ; i++ ) {
 	struct pci_device_leaf * d = & vend->devices[ i ];
 
 	if ( DO_MATCH( m->vendor_id, d->id.vendor_id )
@@ -386,12 +434,16 @@ find_vendor_name( const struct pci_id_match * m )
 	return NULL;
     }
 
-    if ( vend->vendor_name == NULL ) {
-	populate_vendor( vend, 0 );
+    if ( __atomic_load_n( & vend->vendor_name, __ATOMIC_ACQUIRE ) == NULL ) {
+	pthread_mutex_lock( & populate_lock );
+	if ( vend->vendor_name == NULL ) {
+	    populate_vendor( vend, 0 );
+	}
+	pthread_mutex_unlock( & populate_lock );
     }
 
 
-    return vend->vendor_name;
+    return __atomic_load_n( & vend->vendor_name, __ATOMIC_ACQUIRE );
 }
 
 
@@ -437,7 +489,11 @@ const char *
 pci_device_get_device_name( const struct pci_device * dev )
 {
     struct pci_id_match m;
+    const char * name;
 
+    if ( pci_image_get_name( dev, 0, & name ) ) {
+	return name;
+    }
 
     m.vendor_id = dev->vendor_id;
     m.device_id = dev->device_id;
@@ -483,7 +539,11 @@ const char *
 pci_device_get_vendor_name( const struct pci_device * dev )
 {
     struct pci_id_match m;
+    const char * name;
 
+    if ( pci_image_get_name( dev, 1, & name ) ) {
+	return name;
+    }
 
     m.vendor_id = dev->vendor_id;
     m.device_id = PCI_MATCH_ANY;
@@ -0,0 +1,413 @@
+/*
+ * Copyright (c) 2026 The libpciaccess Contributors
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS AND/OR THEIR SUPPLIERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/**
+ * \file common_diff.c
+ * Detection of config space changes across snapshots.
+ *
+ * \c pci_system_config_diff keeps the previous snapshot of every device and
+ * compares it with a new one.  Registers known to change on their own, such
+ * as status registers, are masked out of the comparison.  Snapshots are
+ * taken and compared in parallel on the worker pool, and the comparison
+ * itself works on 16 bytes at a time where the compiler provides SSE2 or
+ * NEON.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "pciaccess.h"
+#include "pciaccess_private.h"
+
+/**
+ * Range of a volatile register, relative to the start of its header or
+ * capability.
+ */
+struct volatile_reg {
+    uint16_t offset;
+    uint16_t size;
+};
+
+/** Status and BIST. */
+static const struct volatile_reg header_volatile[] = {
+    { 0x06, 2 }, { 0x0f, 1 },
+};
+
+/** Device, Link, Slot and Root Status, and their second versions. */
+static const struct volatile_reg pcie_volatile[] = {
+    { 0x0a, 2 }, { 0x12, 2 }, { 0x1a, 2 }, { 0x20, 4 },
+    { 0x2a, 2 }, { 0x32, 2 }, { 0x3a, 2 },
+};
+
+/** PME status in PMCSR. */
+static const struct volatile_reg pm_volatile[] = {
+    { 0x05, 1 },
+};
+
+/** Error status, header log, root error status and error source. */
+static const struct volatile_reg aer_volatile[] = {
+    { 0x04, 4 }, { 0x10, 4 }, { 0x1c, 16 }, { 0x30, 8 },
+};
+
+/** First Error Pointer, in the AER capabilities and control register. */
+#define AER_FIRST_ERROR_OFFSET  0x18
+#define AER_FIRST_ERROR_MASK    0x1f
+
+#define ARRAY_SIZE(a)  (sizeof( a ) / sizeof( (a)[0] ))
+
+/**
+ * Per-device result of one comparison.
+ */
+struct diff_result {
+    uint16_t * offsets;
+    unsigned num_offsets;
+};
+
+struct diff_job {
+    struct diff_result * results;
+    int err;
+};
+
+
+static void
+mask_regs( uint8_t * mask, unsigned base, const struct volatile_reg * regs,
+	   unsigned num_regs )
+{
+    unsigned i;
+
+    for ( i = 0 ; i < num_regs ; i++ ) {
+	if ( base + regs[i].offset + regs[i].size
+	     <= PCI_CONFIG_SPACE_EXT_SIZE ) {
+	    memset( mask + base + regs[i].offset, 0, regs[i].size );
+	}
+    }
+}
+
+
+/**
+ * Build the comparison mask of a device.  Bits of volatile registers are
+ * zero, all other bits are one.
+ *
+ * Must be called without the device locked, since looking up capabilities
+ * locks it.
+ */
+static void
+build_mask( struct pci_device_private * priv, uint8_t * mask )
+{
+    struct pci_device * const dev = & priv->base;
+    uint8_t header_type;
+    unsigned cap;
+    unsigned i;
+
+    memset( mask, 0xff, PCI_CONFIG_SPACE_EXT_SIZE );
+    mask_regs( mask, 0, header_volatile, ARRAY_SIZE( header_volatile ) );
+
+    pci_device_lock( priv );
+    header_type = priv->config[0x0e] & 0x7f;
+    pci_device_unlock( priv );
+
+    /* Secondary status of bridges.
+     */
+    switch ( header_type ) {
+    case 0x01:
+	memset( mask + 0x1e, 0, 2 );
+	break;
+    case 0x02:
+	memset( mask + 0x16, 0, 2 );
+	break;
+    }
+
+    cap = pci_device_find_capability( dev, PCI_CAP_ID_EXP );
+    if ( cap != 0 ) {
+	mask_regs( mask, cap, pcie_volatile, ARRAY_SIZE( pcie_volatile ) );
+    }
+
+    cap = pci_device_find_capability( dev, PCI_CAP_ID_PM );
+    if ( cap != 0 ) {
+	mask_regs( mask, cap, pm_volatile, ARRAY_SIZE( pm_volatile ) );
+    }
+
+    for ( i = 0 ; ; i++ ) {
+	cap = pci_device_find_ext_capability( dev, PCI_EXT_CAP_ID_AER, i );
+	if ( cap == 0 ) {
+	    break;
+	}
+
+	mask_regs( mask, cap, aer_volatile, ARRAY_SIZE( aer_volatile ) );
+	if ( cap + AER_FIRST_ERROR_OFFSET < PCI_CONFIG_SPACE_EXT_SIZE ) {
+	    mask[ cap + AER_FIRST_ERROR_OFFSET ] &= ~AER_FIRST_ERROR_MASK;
+	}
+    }
+}
+
+
+/**
+ * Test whether any unmasked byte of a 16-byte block differs.
+ */
+static inline int
+block_differs( const uint8_t * a, const uint8_t * b, const uint8_t * m )
+{
+#if defined(__SSE2__)
+    const __m128i x = _mm_xor_si128( _mm_loadu_si128( (const __m128i *) a ),
+				     _mm_loadu_si128( (const __m128i *) b ) );
+    const __m128i d = _mm_and_si128( x,
+				     _mm_loadu_si128( (const __m128i *) m ) );
+
+    return _mm_movemask_epi8( _mm_cmpeq_epi8( d, _mm_setzero_si128() ) )
+	!= 0xffff;
+#elif defined(__ARM_NEON)
+    const uint8x16_t d = vandq_u8( veorq_u8( vld1q_u8( a ), vld1q_u8( b ) ),
+				   vld1q_u8( m ) );
+    const uint64x2_t w = vreinterpretq_u64_u8( d );
+
+    return (vgetq_lane_u64( w, 0 ) | vgetq_lane_u64( w, 1 )) != 0;
+#else
+    uint64_t x[2];
+    uint64_t y[2];
+    uint64_t z[2];
+
+    memcpy( x, a, 16 );
+    memcpy( y, b, 16 );
+    memcpy( z, m, 16 );
+    return (((x[0] ^ y[0]) & z[0]) | ((x[1] ^ y[1]) & z[1])) != 0;
+#endif
+}
+
+
+/**
+ * Compare a device's new snapshot with the previous one, and replace the
+ * previous one.  The comparison holds the device lock, so that config
+ * accesses from other threads do not update the snapshot under it.
+ *
+ * \return
+ * Zero on success or an \c errno value on failure.
+ */
+static int
+diff_device( struct pci_device_private * priv, struct diff_result * result )
+{
+    uint8_t * prev;
+    uint8_t * mask;
+    uint16_t offsets[ PCI_CONFIG_SPACE_EXT_SIZE / 4 ];
+    unsigned num = 0;
+    unsigned size;
+    unsigned i;
+    unsigned j;
+    int err;
+
+
+    err = pci_device_config_snapshot( priv );
+    if ( err ) {
+	return err;
+    }
+
+    /* The first snapshot only becomes the baseline.
+     */
+    if ( priv->config_prev == NULL ) {
+	priv->config_prev = malloc( 2 * PCI_CONFIG_SPACE_EXT_SIZE );
+	if ( priv->config_prev == NULL ) {
+	    return ENOMEM;
+	}
+
+	build_mask( priv, priv->config_prev + PCI_CONFIG_SPACE_EXT_SIZE );
+
+	pci_device_lock( priv );
+	memcpy( priv->config_prev, priv->config, PCI_CONFIG_SPACE_EXT_SIZE );
+	priv->config_prev_size = priv->config_size;
+	pci_device_unlock( priv );
+	return 0;
+    }
+
+    prev = priv->config_prev;
+    mask = priv->config_prev + PCI_CONFIG_SPACE_EXT_SIZE;
+
+    pci_device_lock( priv );
+
+    /* Bytes only present in one of the snapshots count as changed.
+     */
+    size = (priv->config_size > priv->config_prev_size)
+	? priv->config_size : priv->config_prev_size;
+
+    for ( i = 0 ; i < size ; i += 16 ) {
+	if ( ! block_differs( prev + i, priv->config + i, mask + i )
+	     && (i + 16 <= priv->config_size)
+	     && (i + 16 <= priv->config_prev_size) ) {
+	    continue;
+	}
+
+	for ( j = i ; j < i + 16 ; j += 4 ) {
+	    uint32_t a;
+	    uint32_t b;
+	    uint32_t m;
+
+	    memcpy( & a, prev + j, 4 );
+	    memcpy( & b, priv->config + j, 4 );
+	    memcpy( & m, mask + j, 4 );
+
+	    if ( (((a ^ b) & m) != 0) || (j >= priv->config_size)
+		 || (j >= priv->config_prev_size) ) {
+		offsets[ num++ ] = j;
+	    }
+	}
+    }
+
+    if ( num != 0 ) {
+	result->offsets = malloc( num * sizeof( offsets[0] ) );
+	if ( result->offsets == NULL ) {
+	    pci_device_unlock( priv );
+	    return ENOMEM;
+	}
+
+	memcpy( result->offsets, offsets, num * sizeof( offsets[0] ) );
+	result->num_offsets = num;
+
+	memcpy( prev, priv->config, PCI_CONFIG_SPACE_EXT_SIZE );
+	priv->config_prev_size = priv->config_size;
+    }
+    pci_device_unlock( priv );
+
+    return 0;
+}
+
+
+static void
+diff_one( void * ctx, unsigned index )
+{
+    struct diff_job * const job = ctx;
+    int err;
+
+    err = diff_device( & pci_sys->devices[ index ], & job->results[ index ] );
+    if ( err == ENOMEM ) {
+	job->err = ENOMEM;
+    }
+}
+
+
+/**
+ * Find config space changes since the previous call.
+ *
+ * Takes a new snapshot of every device's config space and compares it with
+ * the snapshot taken by the previous call.  Changes to volatile registers,
+ * i.e. the status registers of the header, of the PCI Express and power
+ * management capabilities and of AER, and AER's First Error Pointer, are
+ * ignored.  The first call for a device only records its baseline.
+ * Devices whose config space cannot be read are skipped and keep their
+ * previous snapshot.
+ *
+ * \param changes      Location to store an array describing each device
+ *                     with changes.  The array and the offset lists it
+ *                     points to are a single allocation, to be released with
+ *                     \c free.  \c NULL is stored if no device changed.
+ * \param num_changes  Location to store the number of entries in
+ *                     \c *changes.
+ *
+ * \return
+ * Zero on success or an \c errno value on failure.
+ */
+int
+pci_system_config_diff( struct pci_config_change ** changes,
+			unsigned * num_changes )
+{
+    struct diff_job job;
+    struct pci_config_change * out = NULL;
+    uint16_t * offsets;
+    size_t total = 0;
+    unsigned count = 0;
+    unsigned i;
+    int err;
+
+
+    if ( (changes == NULL) || (num_changes == NULL) ) {
+	return EFAULT;
+    }
+
+    *changes = NULL;
+    *num_changes = 0;
+
+    if ( pci_sys->num_devices == 0 ) {
+	return 0;
+    }
+
+    job.results = calloc( pci_sys->num_devices, sizeof( *job.results ) );
+    if ( job.results == NULL ) {
+	return ENOMEM;
+    }
+
+    job.err = 0;
+    err = pci_parallel_for( pci_sys->num_devices, diff_one, & job, 0 );
+    if ( err == 0 ) {
+	err = job.err;
+    }
+
+    for ( i = 0 ; i < pci_sys->num_devices ; i++ ) {
+	if ( job.results[i].num_offsets != 0 ) {
+	    count++;
+	    total += job.results[i].num_offsets;
+	}
+    }
+
+    if ( (err == 0) && (count != 0) ) {
+	out = malloc( count * sizeof( *out ) + total * sizeof( *offsets ) );
+	if ( out == NULL ) {
+	    err = ENOMEM;
+	}
+    }
+
+    if ( (err == 0) && (count != 0) ) {
+	offsets = (uint16_t *) & out[ count ];
+	count = 0;
+
+	for ( i = 0 ; i < pci_sys->num_devices ; i++ ) {
+	    const struct diff_result * const r = & job.results[i];
+
+	    if ( r->num_offsets == 0 ) {
+		continue;
+	    }
+
+	    memcpy( offsets, r->offsets, r->num_offsets * sizeof( *offsets ) );
+	    out[ count ].dev = & pci_sys->devices[i].base;
+	    out[ count ].num_offsets = r->num_offsets;
+	    out[ count ].offsets = offsets;
+
+	    offsets += r->num_offsets;
+	    count++;
+	}
+
+	*changes = out;
+	*num_changes = count;
+    }
+
+    for ( i = 0 ; i < pci_sys->num_devices ; i++ ) {
+	free( job.results[i].offsets );
+    }
+
+    free( job.results );
+    return err;
+}
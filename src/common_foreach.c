@@ -0,0 +1,418 @@
+/*
+ * Copyright (c) 2026 The libpciaccess Contributors
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS AND/OR THEIR SUPPLIERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/**
+ * \file common_foreach.c
+ * Parallel walk over the devices of the system.
+ *
+ * The devices to visit are cut into units, either single devices or all
+ * devices below one root port.  Each thread starts with a contiguous share
+ * of the units and, once done with it, steals the second half of the share
+ * of another thread.  Callbacks that take very different amounts of time
+ * for different devices thus still keep every thread busy.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "pciaccess.h"
+#include "pciaccess_private.h"
+
+/**
+ * Units of work still to be started by one thread.
+ */
+struct foreach_share {
+    pthread_mutex_t lock;
+    unsigned head;          /**< Next unit for the owner. */
+    unsigned tail;          /**< One past the last unit. */
+};
+
+struct foreach_job {
+    pci_device_foreach_func func;
+    void * data;
+
+    struct pci_device ** devs;
+    unsigned * units;       /**< Index in \c devs of the start of each unit,
+			     * followed by the number of devices. */
+
+    struct foreach_share * shares;
+    unsigned num_shares;
+
+    int result;             /**< First non-zero value of \c func. */
+};
+
+struct foreach_entry {
+    unsigned group;
+    unsigned index;
+    struct pci_device * dev;
+};
+
+
+static int
+compare_entries( const void * a, const void * b )
+{
+    const struct foreach_entry * const ea = a;
+    const struct foreach_entry * const eb = b;
+
+    if ( ea->group != eb->group ) {
+	return (ea->group < eb->group) ? -1 : 1;
+    }
+
+    return (ea->index < eb->index) ? -1 : (ea->index > eb->index);
+}
+
+
+static unsigned
+device_index( const struct pci_device * dev )
+{
+    return (const struct pci_device_private *) dev
+	- pci_device_system( dev )->devices;
+}
+
+
+/**
+ * Find the bridge whose secondary bus is the bus of \c dev.
+ */
+static struct pci_device *
+find_parent( struct pci_device * const * bridges, unsigned num_bridges,
+	     const struct pci_device * dev )
+{
+    unsigned i;
+
+    for ( i = 0 ; i < num_bridges ; i++ ) {
+	const struct pci_bridge_info * const info =
+	    pci_device_get_bridge_info( bridges[i] );
+
+	if ( bridges[i] != dev && bridges[i]->domain == dev->domain
+	     && info != NULL && info->secondary_bus == dev->bus ) {
+	    return bridges[i];
+	}
+    }
+
+    return NULL;
+}
+
+
+/**
+ * Set the group of each entry to its root port, and sort \c entries so that
+ * devices below the same root port are next to each other.
+ *
+ * A device on a root bus, including a root port, is its own root.
+ *
+ * \return
+ * Zero on success or an \c errno value on failure.
+ */
+static int
+group_by_root_port( struct pci_context * ctx, struct foreach_entry * entries,
+		    unsigned count )
+{
+    /* PCI-to-PCI bridges, class 06h subclass 04h. */
+    static const struct pci_id_match bridge_match = {
+	PCI_MATCH_ANY, PCI_MATCH_ANY, PCI_MATCH_ANY, PCI_MATCH_ANY,
+	0x060400, 0xffff00, 0
+    };
+
+    struct pci_device_iterator * iter;
+    struct pci_device ** bridges;
+    struct pci_device * dev;
+    unsigned num_bridges = 0;
+    unsigned i;
+
+    bridges = malloc( ctx->sys->num_devices * sizeof( *bridges ) );
+    if ( bridges == NULL ) {
+	return ENOMEM;
+    }
+
+    iter = pci_context_id_match_iterator_create( ctx, & bridge_match );
+    if ( iter == NULL ) {
+	free( bridges );
+	return ENOMEM;
+    }
+
+    while ( (dev = pci_device_next( iter )) != NULL ) {
+	bridges[ num_bridges++ ] = dev;
+    }
+
+    pci_iterator_destroy( iter );
+
+    for ( i = 0 ; i < count ; i++ ) {
+	struct pci_device * root = entries[i].dev;
+	struct pci_device * parent;
+	unsigned depth;
+
+	/* Bound the walk in case of an inconsistent bus numbering.
+	 */
+	for ( depth = 0 ; depth < 256 ; depth++ ) {
+	    parent = find_parent( bridges, num_bridges, root );
+	    if ( parent == NULL ) {
+		break;
+	    }
+
+	    root = parent;
+	}
+
+	entries[i].group = device_index( root );
+    }
+
+    free( bridges );
+
+    qsort( entries, count, sizeof( *entries ), compare_entries );
+    return 0;
+}
+
+
+/**
+ * Take the next unit from a thread's own share, or steal half of the share
+ * of another thread.
+ *
+ * \return
+ * Non-zero if a unit was found and stored in \c unit.
+ */
+static int
+foreach_next_unit( struct foreach_job * job, unsigned self, unsigned * unit )
+{
+    struct foreach_share * const own = & job->shares[ self ];
+    unsigned i;
+
+    pthread_mutex_lock( & own->lock );
+    if ( own->head < own->tail ) {
+	*unit = own->head++;
+	pthread_mutex_unlock( & own->lock );
+	return 1;
+    }
+    pthread_mutex_unlock( & own->lock );
+
+    for ( i = 1 ; i < job->num_shares ; i++ ) {
+	struct foreach_share * const victim =
+	    & job->shares[ (self + i) % job->num_shares ];
+	unsigned head;
+	unsigned tail;
+
+	pthread_mutex_lock( & victim->lock );
+	if ( victim->head >= victim->tail ) {
+	    pthread_mutex_unlock( & victim->lock );
+	    continue;
+	}
+
+	/* Take the second half, rounded up so that a single unit left can
+	 * still be stolen.
+	 */
+	tail = victim->tail;
+	head = tail - (tail - victim->head + 1) / 2;
+	victim->tail = head;
+	pthread_mutex_unlock( & victim->lock );
+
+	*unit = head;
+
+	pthread_mutex_lock( & own->lock );
+	own->head = head + 1;
+	own->tail = tail;
+	pthread_mutex_unlock( & own->lock );
+	return 1;
+    }
+
+    return 0;
+}
+
+
+static void
+foreach_worker( void * ctx, unsigned self )
+{
+    struct foreach_job * const job = ctx;
+    unsigned unit;
+
+    while ( __atomic_load_n( & job->result, __ATOMIC_RELAXED ) == 0
+	    && foreach_next_unit( job, self, & unit ) ) {
+	unsigned i;
+
+	for ( i = job->units[ unit ] ; i < job->units[ unit + 1 ] ; i++ ) {
+	    int expected = 0;
+	    int err;
+
+	    err = (*job->func)( job->devs[i], job->data );
+	    if ( err != 0 ) {
+		(void) __atomic_compare_exchange_n( & job->result, & expected,
+						    err, 0, __ATOMIC_RELAXED,
+						    __ATOMIC_RELAXED );
+		return;
+	    }
+	}
+    }
+}
+
+
+/**
+ * Call a function for each device, using several threads.
+ *
+ * Devices are handed to threads as they become free, so a slow device does
+ * not hold up the others.  With \c PCI_FOREACH_GROUP_ROOT_PORT, all devices
+ * below one root port are visited in turn by the same thread, so that each
+ * link only sees the accesses of one callback at a time.  Otherwise the
+ * order in which devices are visited, and by which thread, is unspecified.
+ *
+ * Once \c func returns non-zero, no further calls are started; calls already
+ * running on other threads complete.
+ *
+ * \param match        Devices to visit, or \c NULL for all devices.
+ * \param func         Function to call for each device.  It may be called
+ *                     from several threads at once.
+ * \param data         Value passed to \c func.
+ * \param num_threads  Upper bound on the number of threads, including the
+ *                     caller.  Zero means one per processor.
+ * \param flags        Zero or more \c PCI_FOREACH_ flags.
+ *
+ * \return
+ * Zero if \c func returned zero for every device, the first non-zero value
+ * it returned otherwise, or an \c errno value if the walk could not be set
+ * up.
+ *
+ * \sa pci_context_foreach, pci_device_iterator_split
+ */
+int
+pci_system_foreach( const struct pci_id_match * match,
+		    pci_device_foreach_func func, void * data,
+		    unsigned num_threads, unsigned flags )
+{
+    return pci_context_foreach( pci_context_default(), match, func, data,
+				num_threads, flags );
+}
+
+
+/**
+ * Call a function for each device of a context, using several threads.
+ *
+ * Works as \c pci_system_foreach, on the devices of \c ctx instead of those
+ * of the system set up by \c pci_system_init.
+ *
+ * \param ctx  Context whose devices are visited.  The other parameters and
+ *             the return value are those of \c pci_system_foreach.
+ *
+ * \sa pci_system_foreach, pci_context_create
+ */
+int
+pci_context_foreach( struct pci_context * ctx,
+		     const struct pci_id_match * match,
+		     pci_device_foreach_func func, void * data,
+		     unsigned num_threads, unsigned flags )
+{
+    struct pci_system * sys;
+    struct pci_device_iterator * iter;
+    struct foreach_entry * entries;
+    struct foreach_job job;
+    struct pci_device * dev;
+    unsigned count = 0;
+    unsigned num_units;
+    unsigned i;
+    int err;
+
+    if ( ctx == NULL || ctx->sys == NULL || func == NULL ) {
+	return EINVAL;
+    }
+
+    sys = ctx->sys;
+    if ( sys->num_devices == 0 ) {
+	return 0;
+    }
+
+    entries = malloc( sys->num_devices * sizeof( *entries ) );
+    job.devs = malloc( sys->num_devices * sizeof( *job.devs ) );
+    job.units = malloc( (sys->num_devices + 1) * sizeof( *job.units ) );
+    iter = pci_context_id_match_iterator_create( ctx, match );
+    if ( entries == NULL || job.devs == NULL || job.units == NULL
+	 || iter == NULL ) {
+	err = ENOMEM;
+	goto out;
+    }
+
+    while ( (dev = pci_device_next( iter )) != NULL ) {
+	entries[ count ].index = device_index( dev );
+	entries[ count ].group = entries[ count ].index;
+	entries[ count ].dev = dev;
+	count++;
+    }
+
+    err = 0;
+    if ( count == 0 ) {
+	goto out;
+    }
+
+    if ( flags & PCI_FOREACH_GROUP_ROOT_PORT ) {
+	err = group_by_root_port( ctx, entries, count );
+	if ( err ) {
+	    goto out;
+	}
+    }
+
+    num_units = 0;
+    for ( i = 0 ; i < count ; i++ ) {
+	if ( i == 0 || entries[i].group != entries[ i - 1 ].group ) {
+	    job.units[ num_units++ ] = i;
+	}
+
+	job.devs[i] = entries[i].dev;
+    }
+    job.units[ num_units ] = count;
+
+    if ( num_threads == 0 ) {
+	num_threads = pci_workqueue_num_threads() + 1;
+    }
+
+    job.num_shares = (num_threads < num_units) ? num_threads : num_units;
+    job.shares = calloc( job.num_shares, sizeof( *job.shares ) );
+    if ( job.shares == NULL ) {
+	err = ENOMEM;
+	goto out;
+    }
+
+    for ( i = 0 ; i < job.num_shares ; i++ ) {
+	pthread_mutex_init( & job.shares[i].lock, NULL );
+	job.shares[i].head = (unsigned)
+	    (((uint64_t) num_units * i) / job.num_shares);
+	job.shares[i].tail = (unsigned)
+	    (((uint64_t) num_units * (i + 1)) / job.num_shares);
+    }
+
+    job.func = func;
+    job.data = data;
+    job.result = 0;
+
+    err = pci_parallel_for( job.num_shares, foreach_worker, & job,
+			    job.num_shares );
+    if ( err == 0 ) {
+	err = job.result;
+    }
+
+    for ( i = 0 ; i < job.num_shares ; i++ ) {
+	pthread_mutex_destroy( & job.shares[i].lock );
+    }
+    free( job.shares );
+
+out:
+    pci_iterator_destroy( iter );
+    free( job.units );
+    free( job.devs );
+    free( entries );
+    return err;
+}
@@ -0,0 +1,695 @@
+/*
+ * Copyright (c) 2026 The libpciaccess Contributors
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS AND/OR THEIR SUPPLIERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/**
+ * \file common_image.c
+ * Shared, read-only image of the device table.
+ *
+ * Enumerating the devices and looking up their names costs every process
+ * that initializes the library many file accesses.  \c pciaccessd does this
+ * once per host and publishes the result with \c pci_system_write_image.
+ * Back-ends then map the image, check that it still describes the devices
+ * present, and take the identity, BARs, names and topology of the devices
+ * from it.
+ *
+ * An update writes a new file and renames it over the old one, so an image
+ * that has been mapped never changes.  The publisher holds a lock on a file
+ * next to the image for as long as it runs, and clients ignore an image
+ * whose publisher is gone, since nothing updates it anymore.
+ */
+
+#ifndef ANDROID
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pciaccess.h"
+#include "pciaccess_private.h"
+
+#ifndef PCIACCESS_IMAGE_PATH
+#define PCIACCESS_IMAGE_PATH "/run/pciaccess/devices"
+#endif
+
+/** Environment variable overriding \c PCIACCESS_IMAGE_PATH. */
+#define IMAGE_PATH_ENV "PCIACCESS_IMAGE"
+
+/** Suffix of the file locked by the publisher of an image. */
+#define IMAGE_LOCK_SUFFIX ".lock"
+
+
+/**
+ * Path of the image.
+ *
+ * \return
+ * The path, or \c NULL if the use of the image is disabled by setting the
+ * environment variable to an empty string.  Set-user-ID programs ignore the
+ * environment variable.
+ */
+static const char *
+image_path( void )
+{
+    const char * path = pci_getenv( IMAGE_PATH_ENV );
+
+    if ( path == NULL ) {
+	return PCIACCESS_IMAGE_PATH;
+    }
+
+    return (path[0] != '\0') ? path : NULL;
+}
+
+
+/**
+ * Check that a name offset from a device record lies within the string
+ * table.  Offset zero means "no name".
+ */
+static int
+name_is_valid( const struct pci_image_header * image, uint32_t offset )
+{
+    return offset == 0 || offset < image->strings_size;
+}
+
+
+/**
+ * Check that an image is complete and consistent.
+ */
+static int
+image_is_valid( const struct pci_image_header * image, size_t size )
+{
+    const char * const base = (const char *) image;
+    const struct pci_image_device * devs;
+    uint32_t i;
+
+    if ( size < sizeof( *image )
+	 || image->magic != PCI_IMAGE_MAGIC
+	 || image->version != PCI_IMAGE_VERSION
+	 || image->generation == 0
+	 || image->size != size
+	 || image->device_size != sizeof( struct pci_image_device ) ) {
+	return 0;
+    }
+
+    if ( (size - sizeof( *image )) / sizeof( struct pci_image_device )
+	 < image->num_devices ) {
+	return 0;
+    }
+
+    if ( image->strings < sizeof( *image )
+	 + (size_t) image->num_devices * sizeof( struct pci_image_device )
+	 || image->strings > size
+	 || image->strings_size > size - image->strings ) {
+	return 0;
+    }
+
+    /* Every name must be terminated within the table.
+     */
+    if ( image->strings_size != 0
+	 && base[ image->strings + image->strings_size - 1 ] != '\0' ) {
+	return 0;
+    }
+
+    /* ...and every record's names must start within it.
+     */
+    devs = (const struct pci_image_device *) & image[1];
+    for ( i = 0 ; i < image->num_devices ; i++ ) {
+	if ( (devs[i].flags & PCI_IMAGE_DEVICE_NAMES)
+	     && (! name_is_valid( image, devs[i].vendor_name )
+		 || ! name_is_valid( image, devs[i].device_name )) ) {
+	    return 0;
+	}
+    }
+
+    return 1;
+}
+
+
+/**
+ * Check that the process that publishes the image at \c path still runs,
+ * by testing for its write lock on the lock file.
+ */
+static int
+publisher_is_alive( const char * path )
+{
+    struct flock fl;
+    char * lock_path;
+    int alive = 0;
+    int fd;
+
+    lock_path = malloc( strlen( path ) + sizeof( IMAGE_LOCK_SUFFIX ) );
+    if ( lock_path == NULL ) {
+	return 0;
+    }
+
+    sprintf( lock_path, "%s" IMAGE_LOCK_SUFFIX, path );
+    fd = open( lock_path, O_RDONLY | O_CLOEXEC );
+    free( lock_path );
+    if ( fd == -1 ) {
+	return 0;
+    }
+
+    memset( & fl, 0, sizeof( fl ) );
+    fl.l_type = F_RDLCK;
+    fl.l_whence = SEEK_SET;
+    if ( fcntl( fd, F_GETLK, & fl ) == 0 && fl.l_type != F_UNLCK ) {
+	alive = 1;
+    }
+
+    close( fd );
+    return alive;
+}
+
+
+/**
+ * Map the shared image for a system.
+ *
+ * \return
+ * Zero on success, with \c pci_system::image set, or an \c errno value if
+ * there is no usable image.  An image whose publisher is gone is not used,
+ * since nothing keeps it up to date.
+ */
+_pci_hidden int
+pci_image_open( struct pci_system * sys )
+{
+    const char * const path = image_path();
+    struct stat st;
+    void * image;
+    int fd;
+
+    if ( path == NULL ) {
+	return ENOENT;
+    }
+
+    fd = open( path, O_RDONLY | O_CLOEXEC );
+    if ( fd == -1 ) {
+	return errno;
+    }
+
+    if ( ! publisher_is_alive( path ) ) {
+	close( fd );
+	return ESTALE;
+    }
+
+    if ( fstat( fd, & st ) != 0 || st.st_size <= 0 ) {
+	close( fd );
+	return EINVAL;
+    }
+
+    image = mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+    close( fd );
+    if ( image == MAP_FAILED ) {
+	return errno;
+    }
+
+    if ( ! image_is_valid( image, st.st_size ) ) {
+	munmap( image, st.st_size );
+	return EINVAL;
+    }
+
+    sys->image = image;
+    sys->image_size = st.st_size;
+    return 0;
+}
+
+
+/**
+ * Unmap the shared image of a system, if any.
+ */
+_pci_hidden void
+pci_image_close( struct pci_system * sys )
+{
+    if ( sys->image != NULL ) {
+	munmap( (void *) sys->image, sys->image_size );
+	sys->image = NULL;
+	sys->image_size = 0;
+    }
+}
+
+
+static const struct pci_image_device *
+image_devices( const struct pci_image_header * image )
+{
+    return (const struct pci_image_device *) & image[1];
+}
+
+
+static uint64_t
+image_key( uint32_t domain, uint32_t bus, uint32_t dev, uint32_t func )
+{
+    return ((uint64_t) domain << 16) | (bus << 8) | (dev << 3) | func;
+}
+
+
+/**
+ * Find the record of a device in an image.
+ *
+ * \return
+ * The record, or \c NULL if the image does not have the device.
+ */
+_pci_hidden const struct pci_image_device *
+pci_image_find( const struct pci_image_header * image, uint32_t domain,
+		uint32_t bus, uint32_t dev, uint32_t func )
+{
+    const struct pci_image_device * const devs = image_devices( image );
+    const uint64_t key = image_key( domain, bus, dev, func );
+    unsigned low = 0;
+    unsigned high = image->num_devices;
+
+    while ( low < high ) {
+	const unsigned mid = low + (high - low) / 2;
+	const uint64_t k = image_key( devs[ mid ].domain, devs[ mid ].bus,
+				      devs[ mid ].dev, devs[ mid ].func );
+
+	if ( k == key ) {
+	    return & devs[ mid ];
+	}
+
+	if ( k < key ) {
+	    low = mid + 1;
+	}
+	else {
+	    high = mid;
+	}
+    }
+
+    return NULL;
+}
+
+
+/**
+ * Fill in the identity of a device from its image record.
+ */
+_pci_hidden void
+pci_image_fill_identity( const struct pci_image_device * rec,
+			 struct pci_device * dev )
+{
+    struct pci_device_private * const priv =
+	(struct pci_device_private *) dev;
+
+    dev->vendor_id = rec->vendor_id;
+    dev->device_id = rec->device_id;
+    dev->subvendor_id = rec->subvendor_id;
+    dev->subdevice_id = rec->subdevice_id;
+    dev->device_class = rec->device_class;
+    dev->revision = rec->revision;
+    priv->image = rec;
+}
+
+
+/**
+ * Fill in what \c pci_device_probe finds from a device's image record.
+ *
+ * \return
+ * Zero on success, or \c ENOENT if the image does not have the data.
+ */
+_pci_hidden int
+pci_image_fill_probe( struct pci_device * dev )
+{
+    struct pci_device_private * const priv =
+	(struct pci_device_private *) dev;
+    const struct pci_image_device * const rec = priv->image;
+    unsigned i;
+
+    if ( rec == NULL || ! (rec->flags & PCI_IMAGE_DEVICE_PROBED) ) {
+	return ENOENT;
+    }
+
+    dev->irq = rec->irq;
+    dev->revision = rec->revision;
+    priv->header_type = rec->header_type;
+
+    for ( i = 0 ; i < 6 ; i++ ) {
+	const struct pci_image_region * const r = & rec->regions[i];
+
+	dev->regions[i].base_addr = r->base_addr;
+	dev->regions[i].size = r->size;
+	dev->regions[i].is_IO = (r->flags & PCI_IMAGE_REGION_IO) != 0;
+	dev->regions[i].is_64 = (r->flags & PCI_IMAGE_REGION_64) != 0;
+	dev->regions[i].is_prefetchable =
+	    (r->flags & PCI_IMAGE_REGION_PREFETCH) != 0;
+    }
+
+    priv->rom_base = rec->rom_base;
+    dev->rom_size = rec->rom_size;
+    return 0;
+}
+
+
+/**
+ * Get the vendor or device name of a device from its image record.
+ *
+ * \param dev     Device.
+ * \param vendor  Non-zero for the vendor name, zero for the device name.
+ * \param name    Location to store the name, \c NULL if it has none.
+ *
+ * \return
+ * Non-zero if the image has the answer.
+ */
+_pci_hidden int
+pci_image_get_name( const struct pci_device * dev, int vendor,
+		    const char ** name )
+{
+    const struct pci_device_private * const priv =
+	(const struct pci_device_private *) dev;
+    const struct pci_image_device * const rec = priv->image;
+    uint32_t offset;
+
+    if ( rec == NULL || ! (rec->flags & PCI_IMAGE_DEVICE_NAMES) ) {
+	return 0;
+    }
+
+    offset = vendor ? rec->vendor_name : rec->device_name;
+    *name = (offset != 0)
+	? (const char *) priv->sys->image + priv->sys->image->strings + offset
+	: NULL;
+    return 1;
+}
+
+
+/**
+ * Get the bridge a device is behind from its image record.
+ *
+ * \param dev    Device.
+ * \param known  Set to non-zero if the image has the answer.
+ *
+ * \return
+ * The bridge, or \c NULL if the device is not behind one, or if the bridge
+ * is not in the device's system.
+ */
+_pci_hidden struct pci_device *
+pci_image_get_parent( struct pci_device * dev, int * known )
+{
+    const struct pci_device_private * const priv =
+	(const struct pci_device_private *) dev;
+    const struct pci_image_device * const rec = priv->image;
+    struct pci_context ctx;
+
+    *known = (rec != NULL);
+    if ( rec == NULL || ! (rec->flags & PCI_IMAGE_DEVICE_PARENT) ) {
+	return NULL;
+    }
+
+    ctx.sys = priv->sys;
+    return pci_context_find_by_slot( & ctx, rec->parent_domain,
+				     rec->parent_bus, rec->parent_dev,
+				     rec->parent_func );
+}
+
+
+/**
+ * String table of an image being built.
+ */
+struct image_builder {
+    char * strings;
+    size_t strings_size;
+    size_t strings_alloc;
+    int failed;             /**< An allocation failed. */
+};
+
+
+/**
+ * Add a string to the table of an image being built.
+ *
+ * \return
+ * Offset of the string in the table, or zero if \c str is \c NULL or on
+ * allocation failure.
+ */
+static uint32_t
+add_string( struct image_builder * b, const char * str )
+{
+    const size_t len = (str != NULL) ? strlen( str ) + 1 : 0;
+    uint32_t offset;
+
+    if ( len == 0 ) {
+	return 0;
+    }
+
+    if ( b->strings_size + len > b->strings_alloc ) {
+	size_t alloc = (b->strings_alloc != 0) ? b->strings_alloc * 2 : 4096;
+	char * strings;
+
+	while ( alloc < b->strings_size + len ) {
+	    alloc *= 2;
+	}
+
+	strings = realloc( b->strings, alloc );
+	if ( strings == NULL ) {
+	    b->failed = 1;
+	    return 0;
+	}
+
+	b->strings = strings;
+	b->strings_alloc = alloc;
+    }
+
+    offset = b->strings_size;
+    memcpy( b->strings + offset, str, len );
+    b->strings_size += len;
+    return offset;
+}
+
+
+static void
+fill_record( struct image_builder * b, struct pci_device_private * priv,
+	     struct pci_image_device * rec )
+{
+    struct pci_device * const dev = & priv->base;
+    struct pci_device * parent;
+    unsigned i;
+
+    rec->domain = dev->domain;
+    rec->bus = dev->bus;
+    rec->dev = dev->dev;
+    rec->func = dev->func;
+    rec->revision = dev->revision;
+    rec->header_type = priv->header_type;
+    rec->vendor_id = dev->vendor_id;
+    rec->device_id = dev->device_id;
+    rec->subvendor_id = dev->subvendor_id;
+    rec->subdevice_id = dev->subdevice_id;
+    rec->device_class = dev->device_class;
+    rec->irq = dev->irq;
+
+    if ( __atomic_load_n( & priv->probed, __ATOMIC_ACQUIRE ) ) {
+	for ( i = 0 ; i < 6 ; i++ ) {
+	    struct pci_image_region * const r = & rec->regions[i];
+
+	    r->base_addr = dev->regions[i].base_addr;
+	    r->size = dev->regions[i].size;
+	    r->flags = (dev->regions[i].is_IO ? PCI_IMAGE_REGION_IO : 0)
+		| (dev->regions[i].is_64 ? PCI_IMAGE_REGION_64 : 0)
+		| (dev->regions[i].is_prefetchable
+		   ? PCI_IMAGE_REGION_PREFETCH : 0);
+	}
+
+	rec->rom_base = priv->rom_base;
+	rec->rom_size = dev->rom_size;
+	rec->flags |= PCI_IMAGE_DEVICE_PROBED;
+    }
+
+    rec->vendor_name = add_string( b, pci_device_get_vendor_name( dev ) );
+    rec->device_name = add_string( b, pci_device_get_device_name( dev ) );
+    rec->flags |= PCI_IMAGE_DEVICE_NAMES;
+
+    parent = pci_device_get_parent_bridge( dev );
+    if ( parent != NULL ) {
+	rec->parent_domain = parent->domain;
+	rec->parent_bus = parent->bus;
+	rec->parent_dev = parent->dev;
+	rec->parent_func = parent->func;
+	rec->flags |= PCI_IMAGE_DEVICE_PARENT;
+    }
+}
+
+
+/**
+ * Read the generation of the image currently at \c path.
+ */
+static uint64_t
+current_generation( const char * path )
+{
+    struct pci_image_header header;
+    ssize_t bytes;
+    int fd;
+
+    fd = open( path, O_RDONLY | O_CLOEXEC );
+    if ( fd == -1 ) {
+	return 0;
+    }
+
+    bytes = pread( fd, & header, sizeof( header ), 0 );
+    close( fd );
+
+    if ( bytes != sizeof( header ) || header.magic != PCI_IMAGE_MAGIC ) {
+	return 0;
+    }
+
+    return header.generation;
+}
+
+
+static int
+write_all( int fd, const void * buf, size_t size )
+{
+    const char * p = buf;
+
+    while ( size > 0 ) {
+	const ssize_t bytes = write( fd, p, size );
+
+	if ( bytes < 0 ) {
+	    if ( errno == EINTR ) {
+		continue;
+	    }
+
+	    return errno;
+	}
+
+	p += bytes;
+	size -= bytes;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Publish the device table for other processes.
+ *
+ * Writes a read-only image of the devices set up by \c pci_system_init,
+ * with their identity, BARs, names, and the bridge each one is behind.
+ * Processes that initialize the library afterwards take this information
+ * from the image instead of gathering it again, as long as the image
+ * describes the devices present.  All devices are probed first.
+ *
+ * The image replaces any previous one atomically, with a higher generation
+ * number.  This is normally done by \c pciaccessd.  Clients only use the
+ * image while the process that publishes it holds a write lock on the file
+ * named \c path followed by \c .lock, as \c pciaccessd does for as long as
+ * it runs, so that an image nothing updates anymore is ignored.
+ *
+ * \param path  Where to write the image, or \c NULL for the path used by
+ *              clients.
+ *
+ * \return
+ * Zero on success or an \c errno value on failure.
+ *
+ * \sa PCI_SYSTEM_INIT_NO_IMAGE
+ */
+int
+pci_system_write_image( const char * path )
+{
+    struct image_builder b;
+    struct pci_image_header * header;
+    struct pci_image_device * recs;
+    char * tmp_path = NULL;
+    size_t devices_size;
+    size_t i;
+    int fd = -1;
+    int err;
+
+    if ( path == NULL ) {
+	path = image_path();
+    }
+
+    if ( pci_sys == NULL || path == NULL ) {
+	return EINVAL;
+    }
+
+    (void) pci_system_probe_all( 0, NULL, 0, NULL );
+
+    memset( & b, 0, sizeof( b ) );
+    devices_size = pci_sys->num_devices * sizeof( *recs );
+    header = calloc( 1, sizeof( *header ) + devices_size );
+    tmp_path = malloc( strlen( path ) + sizeof( ".XXXXXX" ) );
+    if ( header == NULL || tmp_path == NULL ) {
+	err = ENOMEM;
+	goto out;
+    }
+
+    /* The string table starts with an empty string, so that offset zero
+     * can mean "no name".
+     */
+    (void) add_string( & b, "" );
+
+    /* Devices are enumerated in address order, which is the order lookups
+     * in the image expect.
+     */
+    recs = (struct pci_image_device *) & header[1];
+    for ( i = 0 ; i < pci_sys->num_devices ; i++ ) {
+	fill_record( & b, & pci_sys->devices[i], & recs[i] );
+    }
+
+    if ( b.failed ) {
+	err = ENOMEM;
+	goto out;
+    }
+
+    header->magic = PCI_IMAGE_MAGIC;
+    header->version = PCI_IMAGE_VERSION;
+    header->generation = current_generation( path ) + 1;
+    header->num_devices = pci_sys->num_devices;
+    header->device_size = sizeof( *recs );
+    header->strings = sizeof( *header ) + devices_size;
+    header->strings_size = b.strings_size;
+    header->size = header->strings + b.strings_size;
+
+    sprintf( tmp_path, "%s.XXXXXX", path );
+    fd = mkstemp( tmp_path );
+    if ( fd == -1 ) {
+	err = errno;
+	goto out;
+    }
+
+    err = write_all( fd, header, header->strings );
+    if ( err == 0 ) {
+	err = write_all( fd, b.strings, b.strings_size );
+    }
+
+    if ( err == 0 && fchmod( fd, 0644 ) != 0 ) {
+	err = errno;
+    }
+
+    if ( err == 0 && rename( tmp_path, path ) != 0 ) {
+	err = errno;
+    }
+
+out:
+    if ( fd != -1 ) {
+	close( fd );
+	if ( err != 0 ) {
+	    unlink( tmp_path );
+	}
+    }
+
+    free( tmp_path );
+    free( b.strings );
+    free( header );
+    return err;
+}
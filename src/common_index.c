@@ -0,0 +1,360 @@
+/*
+ * Copyright (c) 2026 The libpciaccess Contributors
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS AND/OR THEIR SUPPLIERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/**
+ * \file common_index.c
+ * Compact index of device identities.
+ *
+ * The IDs and class of every device are copied into one array per field, so
+ * that ID matching reads a few bytes per device instead of a whole
+ * \c pci_device_private.  Matching compares 8 devices at a time where the
+ * compiler provides SSE2 or NEON.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "pciaccess.h"
+#include "pciaccess_private.h"
+
+/** Number of devices compared at once. */
+#define BLOCK  8
+
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/**
+ * Build the index of a system's devices.
+ *
+ * Each array has \c BLOCK zeroed entries past the last device, so that a
+ * block can always be loaded whole.  Lazily enumerated devices are
+ * materialized first; if one cannot be, no index is built and lookups scan
+ * the devices instead.
+ *
+ * \return
+ * Zero on success or an \c errno value on failure.
+ */
+static int
+build_index( struct pci_system * sys )
+{
+    const size_t n = sys->num_devices;
+    const size_t padded = n + BLOCK;
+    struct pci_device_index * idx;
+    struct pci_device ** devices;
+    uint16_t * ids;
+    uint32_t * classes;
+    size_t i;
+
+    /* Arrays are laid out by decreasing alignment after the header.
+     */
+    idx = calloc( 1, sizeof( *idx ) + n * sizeof( struct pci_device * )
+		  + padded * sizeof( uint32_t )
+		  + 4 * padded * sizeof( uint16_t ) );
+    if ( idx == NULL ) {
+	return ENOMEM;
+    }
+
+    devices = (struct pci_device **) & idx[1];
+    classes = (uint32_t *) & devices[ n ];
+    ids = (uint16_t *) & classes[ padded ];
+
+    for ( i = 0 ; i < n ; i++ ) {
+	struct pci_device_private * const priv = & sys->devices[i];
+
+	const int err = pci_device_materialize( priv );
+
+	if ( err ) {
+	    free( idx );
+	    return err;
+	}
+
+	devices[i] = & priv->base;
+	classes[i] = priv->base.device_class;
+	ids[ 0 * padded + i ] = priv->base.vendor_id;
+	ids[ 1 * padded + i ] = priv->base.device_id;
+	ids[ 2 * padded + i ] = priv->base.subvendor_id;
+	ids[ 3 * padded + i ] = priv->base.subdevice_id;
+    }
+
+    idx->num_devices = n;
+    idx->devices = devices;
+    idx->device_class = classes;
+    idx->vendor_id = & ids[ 0 * padded ];
+    idx->device_id = & ids[ 1 * padded ];
+    idx->subvendor_id = & ids[ 2 * padded ];
+    idx->subdevice_id = & ids[ 3 * padded ];
+
+    __atomic_store_n( & sys->index, idx, __ATOMIC_RELEASE );
+    return 0;
+}
+
+
+/**
+ * Get the index of a system's devices, building it if needed.
+ *
+ * \return
+ * The index, or \c NULL with \c errno set if it could not be built.
+ */
+_pci_hidden const struct pci_device_index *
+pci_system_index_get( struct pci_system * sys )
+{
+    const struct pci_device_index * idx;
+    int err = 0;
+
+    idx = __atomic_load_n( & sys->index, __ATOMIC_ACQUIRE );
+    if ( idx != NULL ) {
+	return idx;
+    }
+
+    pthread_mutex_lock( & index_lock );
+    if ( sys->index == NULL ) {
+	err = build_index( sys );
+    }
+    idx = sys->index;
+    pthread_mutex_unlock( & index_lock );
+
+    if ( err ) {
+	errno = err;
+    }
+
+    return idx;
+}
+
+
+_pci_hidden void
+pci_system_index_destroy( struct pci_system * sys )
+{
+    free( sys->index );
+    sys->index = NULL;
+}
+
+
+/**
+ * One field of an ID match, prepared for comparison.
+ */
+struct id_field {
+    int any;            /**< The field matches every device. */
+    uint16_t value;
+};
+
+
+/**
+ * Prepare an ID field of a match.
+ *
+ * \return
+ * Zero if no device can match the field.
+ */
+static int
+prepare_field( uint32_t match, struct id_field * field )
+{
+    field->any = (match == (uint32_t) PCI_MATCH_ANY);
+    field->value = match;
+
+    return field->any || match <= 0xffff;
+}
+
+
+/**
+ * Compute which of \c BLOCK devices match.
+ *
+ * \return
+ * A mask with bit \c i set if device \c first + \c i matches.
+ */
+static inline unsigned
+match_block( const struct pci_device_index * idx,
+	     const struct id_field * fields, uint32_t class,
+	     uint32_t class_mask, unsigned first )
+{
+    const uint16_t * const arrays[4] = {
+	idx->vendor_id, idx->device_id, idx->subvendor_id, idx->subdevice_id
+    };
+    unsigned i;
+#if defined(__SSE2__)
+    __m128i ok;
+    __m128i c0;
+    __m128i c1;
+
+    c0 = _mm_and_si128( _mm_loadu_si128( (const __m128i *)
+					 & idx->device_class[ first ] ),
+			_mm_set1_epi32( class_mask ) );
+    c1 = _mm_and_si128( _mm_loadu_si128( (const __m128i *)
+					 & idx->device_class[ first + 4 ] ),
+			_mm_set1_epi32( class_mask ) );
+    ok = _mm_packs_epi32( _mm_cmpeq_epi32( c0, _mm_set1_epi32( class ) ),
+			  _mm_cmpeq_epi32( c1, _mm_set1_epi32( class ) ) );
+
+    for ( i = 0 ; i < 4 ; i++ ) {
+	if ( ! fields[i].any ) {
+	    const __m128i v = _mm_loadu_si128( (const __m128i *)
+					       & arrays[i][ first ] );
+
+	    ok = _mm_and_si128( ok,
+				_mm_cmpeq_epi16( v,
+						 _mm_set1_epi16( fields[i].value ) ) );
+	}
+    }
+
+    return _mm_movemask_epi8( _mm_packs_epi16( ok, _mm_setzero_si128() ) );
+#elif defined(__ARM_NEON)
+    uint16x8_t ok;
+    uint32x4_t c0;
+    uint32x4_t c1;
+    uint64_t bytes;
+    unsigned mask = 0;
+
+    c0 = vandq_u32( vld1q_u32( & idx->device_class[ first ] ),
+		    vdupq_n_u32( class_mask ) );
+    c1 = vandq_u32( vld1q_u32( & idx->device_class[ first + 4 ] ),
+		    vdupq_n_u32( class_mask ) );
+    ok = vcombine_u16( vmovn_u32( vceqq_u32( c0, vdupq_n_u32( class ) ) ),
+		       vmovn_u32( vceqq_u32( c1, vdupq_n_u32( class ) ) ) );
+
+    for ( i = 0 ; i < 4 ; i++ ) {
+	if ( ! fields[i].any ) {
+	    ok = vandq_u16( ok, vceqq_u16( vld1q_u16( & arrays[i][ first ] ),
+					   vdupq_n_u16( fields[i].value ) ) );
+	}
+    }
+
+    bytes = vget_lane_u64( vreinterpret_u64_u8( vmovn_u16( ok ) ), 0 );
+    for ( i = 0 ; i < BLOCK ; i++ ) {
+	mask |= ((bytes >> (8 * i)) & 1) << i;
+    }
+
+    return mask;
+#else
+    unsigned mask = 0;
+    unsigned j;
+
+    for ( j = 0 ; j < BLOCK ; j++ ) {
+	unsigned ok = (idx->device_class[ first + j ] & class_mask) == class;
+
+	for ( i = 0 ; i < 4 ; i++ ) {
+	    ok &= fields[i].any || arrays[i][ first + j ] == fields[i].value;
+	}
+
+	mask |= ok << j;
+    }
+
+    return mask;
+#endif
+}
+
+
+/**
+ * Find the first device of an index that matches an ID match.
+ *
+ * \param idx    Index to search.
+ * \param match  ID match, with the same meaning as for
+ *               \c pci_id_match_iterator_create.
+ * \param start  Index of the first device to check.
+ * \param end    One past the index of the last device to check.
+ *
+ * \return
+ * The index of the first matching device, or \c end if there is none.
+ */
+_pci_hidden unsigned
+pci_device_index_match( const struct pci_device_index * idx,
+			const struct pci_id_match * match,
+			unsigned start, unsigned end )
+{
+    struct id_field fields[4];
+    unsigned i;
+
+    if ( ! prepare_field( match->vendor_id, & fields[0] )
+	 || ! prepare_field( match->device_id, & fields[1] )
+	 || ! prepare_field( match->subvendor_id, & fields[2] )
+	 || ! prepare_field( match->subdevice_id, & fields[3] ) ) {
+	return end;
+    }
+
+    for ( i = start ; i < end ; i += BLOCK ) {
+	unsigned mask = match_block( idx, fields, match->device_class,
+				     match->device_class_mask, i );
+
+	if ( end - i < BLOCK ) {
+	    mask &= (1U << (end - i)) - 1;
+	}
+
+	if ( mask != 0 ) {
+	    return i + __builtin_ctz( mask );
+	}
+    }
+
+    return end;
+}
+
+
+/**
+ * Get the index of the devices of the default system.
+ *
+ * \return
+ * The index, or \c NULL with \c errno set on failure.
+ *
+ * \sa pci_context_get_device_index
+ */
+const struct pci_device_index *
+pci_system_get_device_index( void )
+{
+    return pci_context_get_device_index( pci_context_default() );
+}
+
+
+/**
+ * Get an index of the identities of a context's devices.
+ *
+ * The index holds one array per identity field, in the order iterators
+ * return the devices.  Entry \c i of every array describes
+ * \c devices[i].  Callers that match or count many devices can scan the
+ * arrays they need without touching the devices themselves.
+ *
+ * The index is built when the context is created, or on first use for
+ * contexts created with \c PCI_SYSTEM_INIT_LAZY.  It is read-only and
+ * remains valid until the context is destroyed.
+ *
+ * \param ctx  Context whose devices are indexed.
+ *
+ * \return
+ * The index, or \c NULL with \c errno set on failure.
+ *
+ * \sa pci_system_get_device_index
+ */
+const struct pci_device_index *
+pci_context_get_device_index( struct pci_context * ctx )
+{
+    if ( ctx == NULL || ctx->sys == NULL ) {
+	errno = EINVAL;
+	return NULL;
+    }
+
+    return pci_system_index_get( ctx->sys );
+}
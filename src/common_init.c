@@ -29,17 +29,52 @@
  * \author Ian Romanick <idr@us.ibm.com>
  */
 
+#define _GNU_SOURCE
+
+#ifndef ANDROID
+#include "config.h"
+#endif
+
 #include <stdlib.h>
+#include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "pciaccess.h"
 #include "pciaccess_private.h"
 
 _pci_hidden struct pci_system * pci_sys;
 
+/**
+ * Context handle for \c pci_sys, see \c pci_context_default.
+ */
+static struct pci_context default_context;
+
+/**
+ * Number of systems alive, including \c pci_sys.  State shared by all of
+ * them, such as the worker pool, is released when the last one goes.
+ */
+static pthread_mutex_t systems_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned num_systems;
+
+static int pci_system_init_internal( unsigned flags,
+    const struct pci_system_filter * filter );
+
 /**
  * Initialize the PCI subsystem for access.
  *
+ * Initialization and \c pci_system_cleanup must not run concurrently with
+ * any other call into the library.  In between, the device table does not
+ * change, so iterators and lookups run without locking, and every other
+ * function may be called from any thread.  Data that is built lazily, such
+ * as device names, capability indexes, and bridge information, is published
+ * atomically once complete.
+ *
+ * On Linux, each device's config file is kept open after its first config
+ * access, so the library may hold up to a quarter of the process's
+ * \c RLIMIT_NOFILE descriptors.  They are opened close-on-exec and released
+ * by \c pci_system_cleanup.
+ *
  * \return
  * Zero on success or an errno value on failure.  In particular, if no
  * platform-specific initializers are available, \c ENOSYS will be returned.
@@ -49,26 +84,252 @@ _pci_hidden struct pci_system * pci_sys;
 
 int
 pci_system_init( void )
+{
+    return pci_system_init_flags( 0 );
+}
+
+
+/**
+ * Initialize the PCI subsystem for access, with flags.
+ *
+ * With \c PCI_SYSTEM_INIT_LAZY, platforms that support it only record the
+ * address of each device during initialization.  A device's identity
+ * (vendor, device, class, revision, and subsystem IDs) is read the first
+ * time the device is returned by an iterator or by
+ * \c pci_device_find_by_slot.  Other platforms ignore the flag.
+ *
+ * \param flags  Zero or more \c PCI_SYSTEM_INIT_ flags.
+ *
+ * \return
+ * Zero on success or an errno value on failure.
+ *
+ * \sa pci_system_init
+ */
+int
+pci_system_init_flags( unsigned flags )
+{
+    return pci_system_init_internal( flags, NULL );
+}
+
+
+/**
+ * Initialize the PCI subsystem for access to a subset of the devices.
+ *
+ * Only devices matching at least one entry of \c matches are enumerated;
+ * the others are invisible to iterators and \c pci_device_find_by_slot.
+ * Where the platform allows it, devices are discarded using the kernel's
+ * description of them, without reading their config space.
+ *
+ * \param matches      Array of ID matches.
+ * \param num_matches  Number of entries in \c matches.  If zero, all
+ *                     devices are enumerated.
+ *
+ * \return
+ * Zero on success or an errno value on failure.
+ *
+ * \sa pci_system_init, pci_system_init_filtered_slots
+ */
+int
+pci_system_init_filtered( const struct pci_id_match * matches,
+			  unsigned num_matches )
+{
+    struct pci_system_filter filter = { 0 };
+
+    if ( matches == NULL && num_matches != 0 ) {
+	return EINVAL;
+    }
+
+    filter.ids = matches;
+    filter.num_ids = num_matches;
+    return pci_system_init_internal( 0, & filter );
+}
+
+
+/**
+ * Initialize the PCI subsystem for access to the devices in some slots.
+ *
+ * Like \c pci_system_init_filtered, but devices are selected by address,
+ * which allows them to be discarded before anything but the directory
+ * listing is read.
+ *
+ * \param matches      Array of slot matches.
+ * \param num_matches  Number of entries in \c matches.  If zero, all
+ *                     devices are enumerated.
+ *
+ * \return
+ * Zero on success or an errno value on failure.
+ *
+ * \sa pci_system_init, pci_system_init_filtered
+ */
+int
+pci_system_init_filtered_slots( const struct pci_slot_match * matches,
+				unsigned num_matches )
+{
+    struct pci_system_filter filter = { 0 };
+
+    if ( matches == NULL && num_matches != 0 ) {
+	return EINVAL;
+    }
+
+    filter.slots = matches;
+    filter.num_slots = num_matches;
+    return pci_system_init_internal( 0, & filter );
+}
+
+
+/**
+ * Drop the devices that do not pass \c filter from a system's device list.
+ *
+ * Backends that cannot filter during enumeration leave it to this.  It is a
+ * no-op for backends that already did.
+ */
+static void
+pci_system_apply_filter( struct pci_system * sys,
+			 const struct pci_system_filter * filter )
+{
+    size_t kept = 0;
+    size_t i;
+
+    for ( i = 0 ; i < sys->num_devices ; i++ ) {
+	struct pci_device_private * const priv = & sys->devices[i];
+
+	if ( pci_system_filter_match( filter, & priv->base,
+				      ! priv->identity_pending ) ) {
+	    if ( kept != i ) {
+		sys->devices[ kept ] = *priv;
+	    }
+	    kept++;
+	    continue;
+	}
+
+	free( (char *) priv->device_string );
+	free( (char *) priv->agp );
+	if ( sys->methods->destroy_device != NULL ) {
+	    (*sys->methods->destroy_device)( & priv->base );
+	}
+    }
+
+    sys->num_devices = kept;
+}
+
+
+/**
+ * Enumerate the PCI devices into a new system.
+ *
+ * \param flags       \c PCI_SYSTEM_INIT_ flags.
+ * \param filter      Devices to keep, or \c NULL for all of them.
+ * \param is_default  Non-zero if the system is to become \c pci_sys.  Only
+ *                    platforms whose back-end can build a system without
+ *                    installing it as \c pci_sys support other systems.
+ * \param sys         Location to store the new system.  It may be set even
+ *                    on failure, in which case it must still be destroyed.
+ *
+ * \return
+ * Zero on success or an errno value on failure.
+ */
+_pci_hidden int
+pci_system_create( unsigned flags, const struct pci_system_filter * filter,
+		   int is_default, struct pci_system ** sys )
 {
     int err = ENOSYS;
+    size_t i;
+
+    (void) flags;
+    (void) is_default;
+
+    *sys = NULL;
 
 #ifdef linux
-    err = pci_system_linux_sysfs_create();
-#elif defined(__FreeBSD__) || defined(__FreeBSD_kernel__) || defined(__DragonFly__)
+    err = pci_system_linux_sysfs_create( flags, filter, sys );
+#else
+    if ( ! is_default ) {
+	return ENOSYS;
+    }
+
+# if defined(__FreeBSD__) || defined(__FreeBSD_kernel__) || defined(__DragonFly__)
     err = pci_system_freebsd_create();
-#elif defined(__NetBSD__)
+# elif defined(__NetBSD__)
     err = pci_system_netbsd_create();
-#elif defined(__OpenBSD__)
+# elif defined(__OpenBSD__)
     err = pci_system_openbsd_create();
-#elif defined(__sun)
+# elif defined(__sun)
     err = pci_system_solx_devfs_create();
-#elif defined(__GNU__)
+# elif defined(__GNU__)
     err = pci_system_x86_create();
+# endif
+
+    *sys = pci_sys;
 #endif
 
+    if ( *sys == NULL ) {
+	return err;
+    }
+
+    pthread_mutex_lock( & systems_lock );
+    num_systems++;
+    pthread_mutex_unlock( & systems_lock );
+
+    (*sys)->flags = flags;
+    for ( i = 0 ; i < (*sys)->num_devices ; i++ ) {
+	(*sys)->devices[i].sys = *sys;
+    }
+
+    if ( err == 0 && filter != NULL ) {
+	pci_system_apply_filter( *sys, filter );
+    }
+
+    /* Device records may be moved until the table is final.
+     */
+    for ( i = 0 ; i < (*sys)->num_devices ; i++ ) {
+	pthread_mutex_init( & (*sys)->devices[i].lock, NULL );
+	pthread_mutex_init( & (*sys)->devices[i].probe_lock, NULL );
+    }
+
+    /* Lazily enumerated systems build their index on first use, since
+     * building it reads every device's identity.
+     */
+    if ( err == 0 && ! (flags & PCI_SYSTEM_INIT_LAZY) ) {
+	(void) pci_system_index_get( *sys );
+    }
+
+    return err;
+}
+
+
+static int
+pci_system_init_internal( unsigned flags,
+			  const struct pci_system_filter * filter )
+{
+    struct pci_system * sys;
+    int err;
+
+    err = pci_system_create( flags, filter, 1, & sys );
+    pci_sys = sys;
+    default_context.sys = sys;
     return err;
 }
 
+/**
+ * Get an environment variable that points the library at other files or
+ * services.
+ *
+ * Set-user-ID and set-group-ID programs get \c NULL, since their
+ * environment comes from a less privileged caller.
+ */
+_pci_hidden const char *
+pci_getenv( const char * name )
+{
+#ifdef HAVE_SECURE_GETENV
+    return secure_getenv( name );
+#else
+    if ( getuid() != geteuid() || getgid() != getegid() ) {
+	return NULL;
+    }
+
+    return getenv( name );
+#endif
+}
+
 void
 pci_system_init_dev_mem(int fd)
 {
@@ -78,50 +339,208 @@ pci_system_init_dev_mem(int fd)
 }
 
 /**
- * Shutdown all access to the PCI subsystem.
+ * Release a system and all of its devices.
  *
- * \sa pci_system_init
+ * Watches and asynchronous requests on the system's devices are dropped
+ * first.  State shared by all systems is released with the last system.
  */
-void
-pci_system_cleanup( void )
+_pci_hidden void
+pci_system_destroy( struct pci_system * sys )
 {
     unsigned i;
     unsigned j;
+    int last;
 
 
-    if ( pci_sys == NULL ) {
-	return;
-    }
-
-    pci_io_cleanup();
+    pci_watch_drop_system( sys );
+    pci_cfg_async_drop_system( sys );
 
-    if ( pci_sys->devices ) {
-	for ( i = 0 ; i < pci_sys->num_devices ; i++ ) {
+    if ( sys->devices ) {
+	for ( i = 0 ; i < sys->num_devices ; i++ ) {
 	    for ( j = 0 ; j < 6 ; j++ ) {
-		(void) pci_device_unmap_region( & pci_sys->devices[i].base, j );
+		(void) pci_device_unmap_region( & sys->devices[i].base, j );
 	    }
 
-	    free( (char *) pci_sys->devices[i].device_string );
-	    free( (char *) pci_sys->devices[i].agp );
+	    free( (char *) sys->devices[i].device_string );
+	    free( (char *) sys->devices[i].agp );
+	    free( sys->devices[i].config );
+	    free( sys->devices[i].ext_caps );
+	    free( sys->devices[i].cfg_line );
+	    free( sys->devices[i].config_prev );
 
-	    pci_sys->devices[i].device_string = NULL;
-	    pci_sys->devices[i].agp = NULL;
+	    sys->devices[i].device_string = NULL;
+	    sys->devices[i].agp = NULL;
+	    sys->devices[i].config = NULL;
+	    sys->devices[i].config_valid = NULL;
+	    sys->devices[i].ext_caps = NULL;
+	    sys->devices[i].cfg_line = NULL;
+	    sys->devices[i].config_prev = NULL;
 
-	    if ( pci_sys->methods->destroy_device != NULL ) {
-		(*pci_sys->methods->destroy_device)( & pci_sys->devices[i].base );
+	    if ( sys->methods->destroy_device != NULL ) {
+		(*sys->methods->destroy_device)( & sys->devices[i].base );
 	    }
+
+	    pthread_mutex_destroy( & sys->devices[i].lock );
+	    pthread_mutex_destroy( & sys->devices[i].probe_lock );
 	}
 
-	free( pci_sys->devices );
-	pci_sys->devices = NULL;
-	pci_sys->num_devices = 0;
+	free( sys->devices );
+	sys->devices = NULL;
+	sys->num_devices = 0;
+    }
+
+    pci_io_cleanup( sys );
+    pci_system_index_destroy( sys );
+
+    if ( sys->methods->destroy_system != NULL ) {
+	(*sys->methods->destroy_system)( sys );
+    }
+    else if ( sys->methods->destroy != NULL ) {
+	(*sys->methods->destroy)();
     }
 
+    free( sys );
+
+    pthread_mutex_lock( & systems_lock );
+    last = (--num_systems == 0);
+    pthread_mutex_unlock( & systems_lock );
 
-    if ( pci_sys->methods->destroy != NULL ) {
-	(*pci_sys->methods->destroy)();
+    if ( last ) {
+	pci_watch_cleanup();
+	pci_workqueue_cleanup();
+	pci_cfg_async_cleanup();
     }
+}
+
 
-    free( pci_sys );
+/**
+ * Shutdown all access to the PCI subsystem.
+ *
+ * Contexts created with \c pci_context_create are not affected.
+ *
+ * \sa pci_system_init
+ */
+void
+pci_system_cleanup( void )
+{
+    if ( pci_sys == NULL ) {
+	return;
+    }
+
+    pci_system_destroy( pci_sys );
     pci_sys = NULL;
+    default_context.sys = NULL;
+}
+
+
+/**
+ * Create an independent view of the PCI subsystem.
+ *
+ * A context has its own device table, with its own register shadows,
+ * capability indexes, cached file descriptors, and read-ahead policy.  It is
+ * not affected by \c pci_system_init or \c pci_system_cleanup, so separate
+ * components of a process can each keep one without coordinating.  Devices
+ * of a context are used with the regular \c pci_device_ functions.
+ *
+ * Functions that do not take a device or a context, such as
+ * \c pci_system_config_diff, the VGA arbiter, and the sampler, only
+ * operate on the devices of the default system set up by
+ * \c pci_system_init.
+ *
+ * \param flags  Zero or more \c PCI_SYSTEM_INIT_ flags.
+ *
+ * \return
+ * A new context, or \c NULL with \c errno set on failure.  \c ENOSYS if
+ * the platform only supports the default system.
+ *
+ * \sa pci_context_destroy, pci_context_create_filtered
+ */
+struct pci_context *
+pci_context_create( unsigned flags )
+{
+    return pci_context_create_filtered( flags, NULL, 0, NULL, 0 );
+}
+
+
+/**
+ * Create an independent view of a subset of the PCI devices.
+ *
+ * Like \c pci_context_create, but the context only has the devices that
+ * match at least one entry of \c ids (if \c num_ids is not zero) and at
+ * least one entry of \c slots (if \c num_slots is not zero).
+ *
+ * \sa pci_system_init_filtered, pci_system_init_filtered_slots
+ */
+struct pci_context *
+pci_context_create_filtered( unsigned flags,
+			     const struct pci_id_match * ids, unsigned num_ids,
+			     const struct pci_slot_match * slots,
+			     unsigned num_slots )
+{
+    struct pci_system_filter filter;
+    struct pci_context * ctx;
+    int err;
+
+    if ( (ids == NULL && num_ids != 0) || (slots == NULL && num_slots != 0) ) {
+	errno = EINVAL;
+	return NULL;
+    }
+
+    ctx = calloc( 1, sizeof( *ctx ) );
+    if ( ctx == NULL ) {
+	errno = ENOMEM;
+	return NULL;
+    }
+
+    filter.ids = ids;
+    filter.num_ids = num_ids;
+    filter.slots = slots;
+    filter.num_slots = num_slots;
+
+    err = pci_system_create( flags,
+			     (num_ids != 0 || num_slots != 0) ? & filter : NULL,
+			     0, & ctx->sys );
+    if ( err ) {
+	if ( ctx->sys != NULL ) {
+	    pci_system_destroy( ctx->sys );
+	}
+
+	free( ctx );
+	errno = err;
+	return NULL;
+    }
+
+    return ctx;
+}
+
+
+/**
+ * Destroy a context created with \c pci_context_create.
+ *
+ * Pointers to the context's devices become invalid.  The default context is
+ * ignored; use \c pci_system_cleanup for it.
+ */
+void
+pci_context_destroy( struct pci_context * ctx )
+{
+    if ( ctx == NULL || ctx == & default_context ) {
+	return;
+    }
+
+    pci_system_destroy( ctx->sys );
+    free( ctx );
+}
+
+
+/**
+ * Get the context of the system set up by \c pci_system_init.
+ *
+ * \return
+ * The default context, or \c NULL if \c pci_system_init has not been
+ * called.
+ */
+struct pci_context *
+pci_context_default( void )
+{
+    return (pci_sys != NULL) ? & default_context : NULL;
 }
@@ -32,6 +32,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "pciaccess.h"
 #include "pciaccess_private.h"
@@ -105,7 +106,7 @@ pci_device_read_rom( struct pci_device * dev, void * buffer )
     }
 
 
-    return (pci_sys->methods->read_rom)( dev, buffer );
+    return (pci_device_system( dev )->methods->read_rom)( dev, buffer );
 }
 
 /**
@@ -118,9 +119,9 @@ pci_device_read_rom( struct pci_device * dev, void * buffer )
 int
 pci_device_is_boot_vga( struct pci_device * dev )
 {
-	if (!pci_sys->methods->boot_vga)
+	if (!pci_device_system( dev )->methods->boot_vga)
 		return 0;
-	return pci_sys->methods->boot_vga( dev );
+	return pci_device_system( dev )->methods->boot_vga( dev );
 }
 
 /**
@@ -133,9 +134,9 @@ pci_device_is_boot_vga( struct pci_device * dev )
 int
 pci_device_has_kernel_driver( struct pci_device * dev )
 {
-	if (!pci_sys->methods->has_kernel_driver)
+	if (!pci_device_system( dev )->methods->has_kernel_driver)
 		return 0;
-	return pci_sys->methods->has_kernel_driver( dev );
+	return pci_device_system( dev )->methods->has_kernel_driver( dev );
 }
 
 /**
@@ -154,12 +155,167 @@ pci_device_has_kernel_driver( struct pci_device * dev )
 int
 pci_device_probe( struct pci_device * dev )
 {
+    int err;
+
     if ( dev == NULL ) {
 	return EFAULT;
     }
 
 
-    return (pci_sys->methods->probe)( dev );
+    pthread_mutex_lock( & ((struct pci_device_private *) dev)->probe_lock );
+    err = (pci_device_system( dev )->methods->probe)( dev );
+    if ( err == 0 ) {
+	__atomic_store_n( & ((struct pci_device_private *) dev)->probed, 1,
+			  __ATOMIC_RELEASE );
+    }
+    pthread_mutex_unlock( & ((struct pci_device_private *) dev)->probe_lock );
+
+    return err;
+}
+
+
+/**
+ * Probe a device unless it has been probed successfully already.
+ *
+ * Unlike checking \c pci_device_private::probed before calling
+ * \c pci_device_probe, this never probes a device again while another
+ * thread reads what the first probe found.
+ *
+ * \return
+ * Zero on success or an \c errno value on failure.
+ */
+_pci_hidden int
+pci_device_probe_once( struct pci_device_private * priv )
+{
+    int err = 0;
+
+    if ( __atomic_load_n( & priv->probed, __ATOMIC_ACQUIRE ) ) {
+	return 0;
+    }
+
+    pthread_mutex_lock( & priv->probe_lock );
+    if ( ! priv->probed ) {
+	err = (priv->sys->methods->probe)( & priv->base );
+	if ( err == 0 ) {
+	    __atomic_store_n( & priv->probed, 1, __ATOMIC_RELEASE );
+	}
+    }
+    pthread_mutex_unlock( & priv->probe_lock );
+
+    return err;
+}
+
+
+/**
+ * Shared state of a \c pci_system_probe_all call.
+ */
+struct probe_all {
+    struct pci_system * sys;    /**< System probed if \c devs is \c NULL. */
+    struct pci_device ** devs;
+    unsigned flags;
+    int * errors;
+    int err;
+};
+
+
+static void
+probe_all_one( void * ctx, unsigned index )
+{
+    struct probe_all * const job = ctx;
+    struct pci_device * const dev = (job->devs != NULL)
+	? job->devs[ index ] : & job->sys->devices[ index ].base;
+    int err = 0;
+
+    if ( job->flags & PCI_PROBE_ALL_FORCE ) {
+	err = pci_device_probe( dev );
+    }
+    else {
+	err = pci_device_probe_once( (struct pci_device_private *) dev );
+    }
+
+    if ( job->errors != NULL ) {
+	job->errors[ index ] = err;
+    }
+
+    if ( err != 0 ) {
+	__atomic_store_n( & job->err, err, __ATOMIC_RELAXED );
+    }
+}
+
+
+/**
+ * Probe many devices.
+ *
+ * Equivalent to calling \c pci_device_probe for each device, but the probes
+ * are spread over the library's worker threads.  Probes only serialize on
+ * the probed device's own lock, so as many run at once as there are
+ * threads.  Devices that have already been probed successfully are skipped
+ * unless \c PCI_PROBE_ALL_FORCE is given.
+ *
+ * \param flags     Zero or more \c PCI_PROBE_ALL_ flags.
+ * \param devs      Devices to probe, or \c NULL to probe every device in
+ *                  the system set up by \c pci_system_init.
+ * \param num_devs  Number of devices in \c devs.  Ignored if \c devs is
+ *                  \c NULL.
+ * \param errors    If not \c NULL, location to store the result of each
+ *                  device's probe: zero for success (or if it was skipped),
+ *                  an \c errno value otherwise.  Without \c devs, there is
+ *                  one entry per device, in the order the devices are
+ *                  returned by an iterator created with a \c NULL slot match.
+ *
+ * \return
+ * Zero if every probe succeeded, or the \c errno value of one of the failed
+ * probes.
+ *
+ * \sa pci_device_probe, pci_context_probe_all
+ */
+int
+pci_system_probe_all( unsigned flags, struct pci_device ** devs,
+		      unsigned num_devs, int * errors )
+{
+    return pci_context_probe_all( pci_context_default(), flags, devs,
+				  num_devs, errors );
+}
+
+
+/**
+ * Probe many devices of a context.
+ *
+ * Works as \c pci_system_probe_all, but without \c devs the devices of
+ * \c ctx are probed instead of those of the system set up by
+ * \c pci_system_init.
+ *
+ * \param ctx  Context whose devices are probed if \c devs is \c NULL.  The
+ *             other parameters and the return value are those of
+ *             \c pci_system_probe_all.
+ *
+ * \sa pci_system_probe_all, pci_context_create
+ */
+int
+pci_context_probe_all( struct pci_context * ctx, unsigned flags,
+		       struct pci_device ** devs, unsigned num_devs,
+		       int * errors )
+{
+    struct probe_all job;
+    int err;
+
+    job.sys = NULL;
+    if ( devs == NULL ) {
+	if ( ctx == NULL || ctx->sys == NULL ) {
+	    return EINVAL;
+	}
+
+	job.sys = ctx->sys;
+	num_devs = ctx->sys->num_devices;
+    }
+
+    job.devs = devs;
+    job.flags = flags;
+    job.errors = errors;
+    job.err = 0;
+
+    err = pci_parallel_for( num_devs, probe_all_one, & job, 0 );
+    return (err != 0) ? err : job.err;
 }
 
 
@@ -229,6 +385,25 @@ int pci_device_map_memory_range(struct pci_device *dev,
 }
 
 
+/**
+ * Lock a device's mutable state: the register shadow, the capability
+ * indexes, and the mapping list.  Each device has its own lock, so a slow
+ * device does not hold up others.  The lock is not recursive.
+ */
+_pci_hidden void
+pci_device_lock( struct pci_device_private * priv )
+{
+    pthread_mutex_lock( & priv->lock );
+}
+
+
+_pci_hidden void
+pci_device_unlock( struct pci_device_private * priv )
+{
+    pthread_mutex_unlock( & priv->lock );
+}
+
+
 /**
  * Map the specified memory range so that it can be accessed by the CPU.
  *
@@ -285,12 +460,15 @@ pci_device_map_range(struct pci_device *dev, pciaddr_t base,
         return ENOENT;
     }
 
+    pci_device_lock(devp);
+
     /* Make sure that there isn't already a mapping with the same base and
      * size.
      */
     for (i = 0; i < devp->num_mappings; i++) {
         if ((devp->mappings[i].base == base)
             && (devp->mappings[i].size == size)) {
+            pci_device_unlock(devp);
             return EINVAL;
         }
     }
@@ -299,6 +477,7 @@ pci_device_map_range(struct pci_device *dev, pciaddr_t base,
     mappings = realloc(devp->mappings,
                        (sizeof(devp->mappings[0]) * (devp->num_mappings + 1)));
     if (mappings == NULL) {
+        pci_device_unlock(devp);
         return ENOMEM;
     }
 
@@ -309,7 +488,7 @@ pci_device_map_range(struct pci_device *dev, pciaddr_t base,
     mappings[devp->num_mappings].memory = NULL;
 
     if (dev->regions[region].memory == NULL) {
-        err = (*pci_sys->methods->map_range)(dev,
+        err = (*pci_device_system( dev )->methods->map_range)(dev,
                                              &mappings[devp->num_mappings]);
     }
 
@@ -322,6 +501,7 @@ pci_device_map_range(struct pci_device *dev, pciaddr_t base,
     }
 
     devp->mappings = mappings;
+    pci_device_unlock(devp);
 
     return err;
 }
@@ -418,6 +598,8 @@ pci_device_unmap_range(struct pci_device *dev, void *memory,
         return EFAULT;
     }
 
+    pci_device_lock(devp);
+
     for (i = 0; i < devp->num_mappings; i++) {
         if ((devp->mappings[i].memory == memory)
             && (devp->mappings[i].size == size)) {
@@ -426,11 +608,12 @@ pci_device_unmap_range(struct pci_device *dev, void *memory,
     }
 
     if (i == devp->num_mappings) {
+        pci_device_unlock(devp);
         return ENOENT;
     }
 
 
-    err = (*pci_sys->methods->unmap_range)(dev, &devp->mappings[i]);
+    err = (*pci_device_system( dev )->methods->unmap_range)(dev, &devp->mappings[i]);
     if (!err) {
         const unsigned entries_to_move = (devp->num_mappings - i) - 1;
 
@@ -445,6 +628,7 @@ pci_device_unmap_range(struct pci_device *dev, void *memory,
                                  (sizeof(devp->mappings[0]) * devp->num_mappings));
     }
 
+    pci_device_unlock(devp);
     return err;
 }
 
@@ -457,6 +641,11 @@ pci_device_unmap_range(struct pci_device *dev, void *memory,
  * requested.  This is particularly the case if a non-root user tries to read
  * beyond the first 64-bytes of configuration space.
  *
+ * Registers that do not change on their own, such as the IDs or the command
+ * register, are returned from the library's shadow of configuration space
+ * once they have been read.  Use \c pci_device_cfg_read_flags with
+ * \c PCI_DEV_CFG_FLAG_UNCACHED to always read from the device.
+ *
  * \param dev         Device whose PCI configuration data is to be read.
  * \param data        Location to store the data
  * \param offset      Initial byte offset to read
@@ -477,15 +666,59 @@ pci_device_cfg_read( struct pci_device * dev, void * data,
 		     pciaddr_t offset, pciaddr_t size,
 		     pciaddr_t * bytes_read )
 {
+    return pci_device_cfg_read_flags( dev, data, offset, size, bytes_read, 0 );
+}
+
+
+/**
+ * Read arbitrary bytes from device's PCI config space
+ *
+ * Same as \c pci_device_cfg_read, but with flags controlling the access.
+ *
+ * \param dev         Device whose PCI configuration data is to be read.
+ * \param data        Location to store the data
+ * \param offset      Initial byte offset to read
+ * \param size        Total number of bytes to read
+ * \param bytes_read  Location to store the actual number of bytes read.  This
+ *                    pointer may be \c NULL.
+ * \param flags       Bitwise-or of \c PCI_DEV_CFG_FLAG_ values.
+ *
+ * \returns
+ * Zero on success or an errno value on failure.
+ *
+ * \sa pci_device_cfg_read
+ */
+int
+pci_device_cfg_read_flags( struct pci_device * dev, void * data,
+			   pciaddr_t offset, pciaddr_t size,
+			   pciaddr_t * bytes_read, unsigned flags )
+{
+    struct pci_device_private * const priv =
+	(struct pci_device_private *) dev;
     pciaddr_t  scratch;
+    int err;
 
     if ( (dev == NULL) || (data == NULL) ) {
 	return EFAULT;
     }
 
-    return pci_sys->methods->read( dev, data, offset, size,
-				   (bytes_read == NULL)
-				   ? & scratch : bytes_read );
+    if ( bytes_read == NULL ) {
+	bytes_read = & scratch;
+    }
+
+    if ( ((flags & PCI_DEV_CFG_FLAG_UNCACHED) == 0)
+	 && (pci_device_config_cache_read( priv, data, offset, size )
+	     || pci_device_config_readahead( priv, data, offset, size )) ) {
+	*bytes_read = size;
+	return 0;
+    }
+
+    err = pci_device_system( dev )->methods->read( dev, data, offset, size, bytes_read );
+    if ( (err == 0) && (*bytes_read != 0) ) {
+	pci_device_config_cache_fill( priv, data, offset, *bytes_read );
+    }
+
+    return err;
 }
 
 
@@ -541,7 +774,8 @@ pci_device_cfg_read_u32( struct pci_device * dev, uint32_t * data,
  *
  * Writes data to the device's PCI configuration space.  As with the system
  * write command, less data may be written, without an error, than was
- * requested.
+ * requested.  The library's shadow of configuration space is updated to
+ * match.
  *
  * \param dev         Device whose PCI configuration data is to be written.
  * \param data        Location of the source data
@@ -565,14 +799,24 @@ pci_device_cfg_write( struct pci_device * dev, const void * data,
 		      pciaddr_t * bytes_written )
 {
     pciaddr_t  scratch;
+    int err;
 
     if ( (dev == NULL) || (data == NULL) ) {
 	return EFAULT;
     }
 
-    return pci_sys->methods->write( dev, data, offset, size,
-				    (bytes_written == NULL)
-				    ? & scratch : bytes_written );
+    if ( bytes_written == NULL ) {
+	bytes_written = & scratch;
+    }
+
+    err = pci_device_system( dev )->methods->write( dev, data, offset, size, bytes_written );
+    pci_device_config_readahead_invalidate( (struct pci_device_private *) dev );
+    if ( *bytes_written != 0 ) {
+	pci_device_config_cache_write( (struct pci_device_private *) dev,
+				       data, offset, *bytes_written );
+    }
+
+    return err;
 }
 
 
@@ -644,6 +888,585 @@ pci_device_cfg_write_bits( struct pci_device * dev, uint32_t mask,
     return err;
 }
 
+
+/**
+ * In-process locks for atomic read-modify-writes.  Back-end locks only
+ * exclude other processes, so threads of this process are serialized here.
+ * Devices are spread over a fixed set of locks.
+ */
+#define CFG_RMW_LOCK  PTHREAD_MUTEX_INITIALIZER
+static pthread_mutex_t cfg_rmw_locks[8] = {
+    CFG_RMW_LOCK, CFG_RMW_LOCK, CFG_RMW_LOCK, CFG_RMW_LOCK,
+    CFG_RMW_LOCK, CFG_RMW_LOCK, CFG_RMW_LOCK, CFG_RMW_LOCK
+};
+
+
+/**
+ * Modify bits of a config register, optionally atomically.
+ *
+ * Reads the 32-bit register at \c offset, replaces the bits selected by
+ * \c mask with those of \c data, and writes back the bytes that \c mask
+ * touches.  Bytes of the register outside \c mask are not written, so
+ * write-1-to-clear status bits next to the updated field are left alone.
+ *
+ * With \c PCI_DEV_CFG_FLAG_ATOMIC, the register is read from the device
+ * rather than the register shadow, and the read-modify-write is serialized
+ * against other atomic read-modify-writes of the same register by any
+ * thread or process.  Other kinds of config writes are not excluded.  When
+ * uncontended, this costs two extra system calls on Linux.
+ *
+ * \param dev     Device whose config space is to be modified.
+ * \param mask    Bits of the register to change.
+ * \param data    New value of the bits.  Bits outside \c mask are ignored.
+ * \param offset  Byte offset of the register.  Must be 32-bit aligned.
+ * \param flags   Zero or more of \c PCI_DEV_CFG_FLAG_UNCACHED and
+ *                \c PCI_DEV_CFG_FLAG_ATOMIC.
+ *
+ * \return
+ * Zero on success or an \c errno value on failure.  \c ENOSYS if
+ * \c PCI_DEV_CFG_FLAG_ATOMIC is given but the platform cannot lock config
+ * space across processes.
+ *
+ * \sa pci_device_get_cfg_lock_stats
+ */
+int
+pci_device_cfg_write_bits_flags( struct pci_device * dev, uint32_t mask,
+				 uint32_t data, pciaddr_t offset,
+				 unsigned flags )
+{
+    struct pci_device_private * const priv =
+	(struct pci_device_private *) dev;
+    pthread_mutex_t * lock = NULL;
+    uint64_t wait_start;
+    int contended = 0;
+    uint8_t buf[4];
+    pciaddr_t bytes = 0;
+    unsigned first;
+    unsigned last;
+    uint32_t temp;
+    int err;
+
+    if ( dev == NULL ) {
+	return EFAULT;
+    }
+
+    if ( (offset & 3) != 0 ) {
+	return EINVAL;
+    }
+
+    if ( mask == 0 ) {
+	return 0;
+    }
+
+    for ( first = 0 ; ((mask >> (first * 8)) & 0xff) == 0 ; first++ ) {
+	/* empty */ ;
+    }
+
+    for ( last = 3 ; ((mask >> (last * 8)) & 0xff) == 0 ; last-- ) {
+	/* empty */ ;
+    }
+
+    if ( (flags & PCI_DEV_CFG_FLAG_ATOMIC) != 0 ) {
+	if ( pci_device_system( dev )->methods->lock_config == NULL ) {
+	    return ENOSYS;
+	}
+
+	flags |= PCI_DEV_CFG_FLAG_UNCACHED;
+	lock = & cfg_rmw_locks[ ((uintptr_t) priv / sizeof( *priv )) % 8 ];
+	wait_start = pci_monotonic_ns();
+
+	if ( pthread_mutex_trylock( lock ) != 0 ) {
+	    contended = 1;
+	    pthread_mutex_lock( lock );
+	}
+
+	err = pci_device_system( dev )->methods->lock_config( dev, offset + first,
+					     last - first + 1, & contended );
+	if ( err != 0 ) {
+	    pthread_mutex_unlock( lock );
+	    return err;
+	}
+
+	__atomic_add_fetch( & priv->lock_stats.acquisitions, 1,
+			    __ATOMIC_RELAXED );
+	if ( contended ) {
+	    __atomic_add_fetch( & priv->lock_stats.contended, 1,
+				__ATOMIC_RELAXED );
+	    __atomic_add_fetch( & priv->lock_stats.wait_ns,
+				pci_monotonic_ns() - wait_start,
+				__ATOMIC_RELAXED );
+	}
+    }
+
+    err = pci_device_cfg_read_flags( dev, buf, offset, 4, & bytes, flags );
+    if ( (err == 0) && (bytes != 4) ) {
+	err = ENXIO;
+    }
+
+    if ( err == 0 ) {
+	memcpy( & temp, buf, 4 );
+	temp = HTOLE_32( (LETOH_32( temp ) & ~mask) | (data & mask) );
+	memcpy( buf, & temp, 4 );
+
+	err = pci_device_cfg_write( dev, buf + first, offset + first,
+				    last - first + 1, & bytes );
+	if ( (err == 0) && (bytes != last - first + 1) ) {
+	    err = ENOSPC;
+	}
+    }
+
+    if ( lock != NULL ) {
+	pci_device_system( dev )->methods->unlock_config( dev, offset + first,
+					 last - first + 1 );
+	pthread_mutex_unlock( lock );
+    }
+
+    return err;
+}
+
+
+/**
+ * Get statistics of a device's atomic config read-modify-writes.
+ *
+ * \param dev    Device to query, or \c NULL for the sum over all devices.
+ * \param stats  Location to store the statistics.
+ *
+ * \return
+ * Zero on success or an \c errno value on failure.
+ *
+ * \sa pci_device_cfg_write_bits_flags
+ */
+int
+pci_device_get_cfg_lock_stats( struct pci_device * dev,
+			       struct pci_cfg_lock_stats * stats )
+{
+    size_t i;
+
+    if ( stats == NULL ) {
+	return EFAULT;
+    }
+
+    memset( stats, 0, sizeof( *stats ) );
+
+    if ( dev == NULL && pci_sys == NULL ) {
+	return 0;
+    }
+
+    for ( i = 0 ; i < ((dev != NULL) ? 1 : pci_sys->num_devices) ; i++ ) {
+	const struct pci_cfg_lock_stats * const s = (dev != NULL)
+	    ? & ((struct pci_device_private *) dev)->lock_stats
+	    : & pci_sys->devices[i].lock_stats;
+
+	stats->acquisitions += __atomic_load_n( & s->acquisitions,
+						__ATOMIC_RELAXED );
+	stats->contended += __atomic_load_n( & s->contended,
+					     __ATOMIC_RELAXED );
+	stats->wait_ns += __atomic_load_n( & s->wait_ns, __ATOMIC_RELAXED );
+    }
+
+    return 0;
+}
+
+/**
+ * Register access of a scatter/gather operation, in config space order.
+ */
+struct cfg_op_ref {
+    pciaddr_t offset;
+    unsigned width;
+    unsigned index;     /**< Index in the caller's array of operations. */
+};
+
+static int
+cfg_op_ref_compare( const void * a, const void * b )
+{
+    const struct cfg_op_ref * const ra = a;
+    const struct cfg_op_ref * const rb = b;
+
+    if ( ra->offset != rb->offset ) {
+	return (ra->offset < rb->offset) ? -1 : 1;
+    }
+
+    return (ra->index < rb->index) ? -1 : (ra->index > rb->index);
+}
+
+static int
+cfg_op_check( const struct pci_device_cfg_op * op )
+{
+    if ( op->value == NULL ) {
+	return EFAULT;
+    }
+
+    if ( (op->width != 1) && (op->width != 2) && (op->width != 4) ) {
+	return EINVAL;
+    }
+
+    return 0;
+}
+
+/**
+ * Store little-endian config data in the caller's value for \c op.
+ */
+static void
+cfg_op_store( const struct pci_device_cfg_op * op, const uint8_t * src )
+{
+    uint16_t v16;
+    uint32_t v32;
+
+    switch ( op->width ) {
+    case 1:
+	*(uint8_t *) op->value = src[0];
+	break;
+    case 2:
+	(void) memcpy( & v16, src, 2 );
+	*(uint16_t *) op->value = LETOH_16( v16 );
+	break;
+    case 4:
+	(void) memcpy( & v32, src, 4 );
+	*(uint32_t *) op->value = LETOH_32( v32 );
+	break;
+    }
+}
+
+/**
+ * Fetch the caller's value for \c op as little-endian config data.
+ */
+static void
+cfg_op_load( const struct pci_device_cfg_op * op, uint8_t * dst )
+{
+    uint16_t v16;
+    uint32_t v32;
+
+    switch ( op->width ) {
+    case 1:
+	dst[0] = *(const uint8_t *) op->value;
+	break;
+    case 2:
+	v16 = HTOLE_16( *(const uint16_t *) op->value );
+	(void) memcpy( dst, & v16, 2 );
+	break;
+    case 4:
+	v32 = HTOLE_32( *(const uint32_t *) op->value );
+	(void) memcpy( dst, & v32, 4 );
+	break;
+    }
+}
+
+/**
+ * Merge sorted register accesses into contiguous spans.
+ *
+ * Accesses that overlap or are directly adjacent share a span.  The span
+ * data pointers are laid out back to back in \c buf, which must hold at
+ * least the sum of the access widths.
+ *
+ * \return
+ * The number of spans stored in \c spans.
+ */
+static unsigned
+cfg_ops_coalesce( const struct cfg_op_ref * refs, unsigned num_refs,
+		  struct pci_cfg_span * spans, uint8_t * buf )
+{
+    unsigned num_spans = 0;
+    unsigned i;
+
+
+    for ( i = 0 ; i < num_refs ; i++ ) {
+	const pciaddr_t end = refs[i].offset + refs[i].width;
+	struct pci_cfg_span * const last =
+	    (num_spans > 0) ? & spans[ num_spans - 1 ] : NULL;
+
+	if ( (last != NULL) && (refs[i].offset <= last->offset + last->size) ) {
+	    if ( end > last->offset + last->size ) {
+		last->size = end - last->offset;
+	    }
+	}
+	else {
+	    spans[ num_spans ].offset = refs[i].offset;
+	    spans[ num_spans ].size = refs[i].width;
+	    spans[ num_spans ].bytes = 0;
+	    num_spans++;
+	}
+    }
+
+    for ( i = 0 ; i < num_spans ; i++ ) {
+	spans[i].data = buf;
+	buf += spans[i].size;
+    }
+
+    return num_spans;
+}
+
+/**
+ * Transfer a set of spans with as few back-end accesses as possible.
+ */
+static int
+cfg_spans_transfer( struct pci_device * dev, struct pci_cfg_span * spans,
+		    unsigned num_spans, int write )
+{
+    unsigned i;
+    int err = 0;
+
+
+    if ( write && (pci_device_system( dev )->methods->writev != NULL) ) {
+	return pci_device_system( dev )->methods->writev( dev, spans, num_spans );
+    }
+
+    if ( ! write && (pci_device_system( dev )->methods->readv != NULL) ) {
+	return pci_device_system( dev )->methods->readv( dev, spans, num_spans );
+    }
+
+    for ( i = 0 ; (i < num_spans) && (err == 0) ; i++ ) {
+	err = (write)
+	    ? pci_device_system( dev )->methods->write( dev, spans[i].data, spans[i].offset,
+				       spans[i].size, & spans[i].bytes )
+	    : pci_device_system( dev )->methods->read( dev, spans[i].data, spans[i].offset,
+				      spans[i].size, & spans[i].bytes );
+    }
+
+    return err;
+}
+
+
+/**
+ * Read several registers from a device's PCI config space
+ *
+ * Reads each register described by \c ops.  Registers that can be answered
+ * from the library's shadow of configuration space are.  The rest are sorted
+ * by offset, merged into contiguous ranges, and read with as few back-end
+ * accesses as possible.
+ *
+ * \param dev      Device whose PCI configuration data is to be read.
+ * \param ops      Registers to read.
+ * \param num_ops  Number of entries in \c ops.
+ *
+ * \returns
+ * Zero on success or an errno value on failure.  \c ENXIO is returned if
+ * some register could not be read, e.g., because it lies beyond the part of
+ * configuration space visible to the caller.  All registers that could be
+ * read are stored even in that case.
+ *
+ * \sa pci_device_cfg_writev, pci_device_cfg_readv_flags
+ */
+int
+pci_device_cfg_readv( struct pci_device * dev,
+		      const struct pci_device_cfg_op * ops, unsigned num_ops )
+{
+    return pci_device_cfg_readv_flags( dev, ops, num_ops, 0 );
+}
+
+
+/**
+ * Read several registers from a device's PCI config space, with flags
+ *
+ * Like \c pci_device_cfg_readv, but \c PCI_DEV_CFG_FLAG_UNCACHED makes
+ * every register be read from the device.
+ *
+ * \param dev      Device whose PCI configuration data is to be read.
+ * \param ops      Registers to read.
+ * \param num_ops  Number of entries in \c ops.
+ * \param flags    Zero or more \c PCI_DEV_CFG_FLAG_ values.
+ *
+ * \returns
+ * Zero on success or an errno value on failure.
+ */
+int
+pci_device_cfg_readv_flags( struct pci_device * dev,
+			    const struct pci_device_cfg_op * ops,
+			    unsigned num_ops, unsigned flags )
+{
+    struct pci_device_private * const priv =
+	(struct pci_device_private *) dev;
+    struct cfg_op_ref * refs;
+    struct pci_cfg_span * spans;
+    uint8_t * buf;
+    uint8_t tmp[4];
+    unsigned num_refs = 0;
+    unsigned num_spans;
+    unsigned total = 0;
+    unsigned i;
+    unsigned j;
+    int err = 0;
+
+
+    if ( (dev == NULL) || ((ops == NULL) && (num_ops != 0)) ) {
+	return EFAULT;
+    }
+
+    if ( num_ops == 0 ) {
+	return 0;
+    }
+
+    for ( i = 0 ; i < num_ops ; i++ ) {
+	err = cfg_op_check( & ops[i] );
+	if ( err ) {
+	    return err;
+	}
+    }
+
+    refs = malloc( num_ops * (sizeof( *refs ) + sizeof( *spans ) + 4) );
+    if ( refs == NULL ) {
+	return ENOMEM;
+    }
+
+    spans = (struct pci_cfg_span *) & refs[ num_ops ];
+    buf = (uint8_t *) & spans[ num_ops ];
+
+    for ( i = 0 ; i < num_ops ; i++ ) {
+	if ( ((flags & (PCI_DEV_CFG_FLAG_UNCACHED
+			| PCI_DEV_CFG_FLAG_NO_SHADOW)) == 0)
+	     && pci_device_config_cache_read( priv, tmp, ops[i].offset,
+					      ops[i].width ) ) {
+	    cfg_op_store( & ops[i], tmp );
+	    continue;
+	}
+
+	refs[ num_refs ].offset = ops[i].offset;
+	refs[ num_refs ].width = ops[i].width;
+	refs[ num_refs ].index = i;
+	num_refs++;
+	total += ops[i].width;
+    }
+
+    if ( num_refs == 0 ) {
+	free( refs );
+	return 0;
+    }
+
+    qsort( refs, num_refs, sizeof( *refs ), cfg_op_ref_compare );
+    num_spans = cfg_ops_coalesce( refs, num_refs, spans, buf );
+
+    err = cfg_spans_transfer( dev, spans, num_spans, 0 );
+
+    for ( i = 0 ; i < num_spans ; i++ ) {
+	if ( (spans[i].bytes != 0)
+	     && ((flags & PCI_DEV_CFG_FLAG_NO_SHADOW) == 0) ) {
+	    pci_device_config_cache_fill( priv, spans[i].data, spans[i].offset,
+					  spans[i].bytes );
+	}
+    }
+
+    for ( i = 0, j = 0 ; i < num_refs ; i++ ) {
+	while ( refs[i].offset >= spans[j].offset + spans[j].size ) {
+	    j++;
+	}
+
+	if ( refs[i].offset + refs[i].width
+	     > spans[j].offset + spans[j].bytes ) {
+	    if ( err == 0 ) {
+		err = ENXIO;
+	    }
+
+	    continue;
+	}
+
+	cfg_op_store( & ops[ refs[i].index ], (uint8_t *) spans[j].data
+		      + (refs[i].offset - spans[j].offset) );
+    }
+
+    free( refs );
+    return err;
+}
+
+
+/**
+ * Write several registers to a device's PCI config space
+ *
+ * Writes each register described by \c ops.  The registers are sorted by
+ * offset, merged into contiguous ranges, and written with as few back-end
+ * accesses as possible.  Registers are therefore written in ascending offset
+ * order, not in the order of \c ops.
+ *
+ * \param dev      Device whose PCI configuration data is to be written.
+ * \param ops      Registers to write.  The ranges may not overlap.
+ * \param num_ops  Number of entries in \c ops.
+ *
+ * \returns
+ * Zero on success or an errno value on failure.  \c ENOSPC is returned if
+ * some register could not be written completely.
+ *
+ * \sa pci_device_cfg_readv
+ */
+int
+pci_device_cfg_writev( struct pci_device * dev,
+		       const struct pci_device_cfg_op * ops, unsigned num_ops )
+{
+    struct pci_device_private * const priv =
+	(struct pci_device_private *) dev;
+    struct cfg_op_ref * refs;
+    struct pci_cfg_span * spans;
+    uint8_t * buf;
+    unsigned num_spans;
+    unsigned i;
+    unsigned j;
+    int err = 0;
+
+
+    if ( (dev == NULL) || ((ops == NULL) && (num_ops != 0)) ) {
+	return EFAULT;
+    }
+
+    if ( num_ops == 0 ) {
+	return 0;
+    }
+
+    for ( i = 0 ; i < num_ops ; i++ ) {
+	err = cfg_op_check( & ops[i] );
+	if ( err ) {
+	    return err;
+	}
+    }
+
+    refs = malloc( num_ops * (sizeof( *refs ) + sizeof( *spans ) + 4) );
+    if ( refs == NULL ) {
+	return ENOMEM;
+    }
+
+    spans = (struct pci_cfg_span *) & refs[ num_ops ];
+    buf = (uint8_t *) & spans[ num_ops ];
+
+    for ( i = 0 ; i < num_ops ; i++ ) {
+	refs[i].offset = ops[i].offset;
+	refs[i].width = ops[i].width;
+	refs[i].index = i;
+    }
+
+    qsort( refs, num_ops, sizeof( *refs ), cfg_op_ref_compare );
+
+    for ( i = 1 ; i < num_ops ; i++ ) {
+	if ( refs[i].offset < refs[i - 1].offset + refs[i - 1].width ) {
+	    free( refs );
+	    return EINVAL;
+	}
+    }
+
+    num_spans = cfg_ops_coalesce( refs, num_ops, spans, buf );
+
+    for ( i = 0, j = 0 ; i < num_ops ; i++ ) {
+	while ( refs[i].offset >= spans[j].offset + spans[j].size ) {
+	    j++;
+	}
+
+	cfg_op_load( & ops[ refs[i].index ], (uint8_t *) spans[j].data
+		     + (refs[i].offset - spans[j].offset) );
+    }
+
+    err = cfg_spans_transfer( dev, spans, num_spans, 1 );
+
+    pci_device_config_readahead_invalidate( priv );
+    for ( i = 0 ; i < num_spans ; i++ ) {
+	if ( spans[i].bytes != 0 ) {
+	    pci_device_config_cache_write( priv, spans[i].data,
+					   spans[i].offset, spans[i].bytes );
+	}
+
+	if ( (err == 0) && (spans[i].bytes != spans[i].size) ) {
+	    err = ENOSPC;
+	}
+    }
+
+    free( refs );
+    return err;
+}
+
 void
 pci_device_enable(struct pci_device *dev)
 {
@@ -651,8 +1474,8 @@ pci_device_enable(struct pci_device *dev)
 	return;
     }
 
-    if (pci_sys->methods->enable)
-	pci_sys->methods->enable(dev);
+    if (pci_device_system( dev )->methods->enable)
+	pci_device_system( dev )->methods->enable(dev);
 }
 
 /**
@@ -674,10 +1497,10 @@ pci_device_map_legacy(struct pci_device *dev, pciaddr_t base, pciaddr_t size,
     if (base > 0x100000 || base + size > 0x100000)
 	return EINVAL;
 
-    if (!pci_sys->methods->map_legacy)
+    if (!pci_device_system( dev )->methods->map_legacy)
 	return ENOSYS;
 
-    return pci_sys->methods->map_legacy(dev, base, size, map_flags, addr);
+    return pci_device_system( dev )->methods->map_legacy(dev, base, size, map_flags, addr);
 }
 
 /**
@@ -693,8 +1516,109 @@ pci_device_map_legacy(struct pci_device *dev, pciaddr_t base, pciaddr_t size,
 int
 pci_device_unmap_legacy(struct pci_device *dev, void *addr, pciaddr_t size)
 {
-    if (!pci_sys->methods->unmap_legacy)
+    if (!pci_device_system( dev )->methods->unmap_legacy)
 	return ENOSYS;
 
-    return pci_sys->methods->unmap_legacy(dev, addr, size);
+    return pci_device_system( dev )->methods->unmap_legacy(dev, addr, size);
+}
+
+
+struct cfg_read_many {
+    struct pci_device ** devs;
+    pciaddr_t offset;
+    unsigned width;
+    uint8_t * out;
+    int err;
+};
+
+
+static void
+cfg_read_many_one( void * ctx, unsigned index )
+{
+    struct cfg_read_many * const job = ctx;
+    uint8_t * const dst = job->out + ((size_t) index * job->width);
+    uint32_t buf = 0;
+    pciaddr_t bytes = 0;
+    int err;
+
+    err = pci_device_cfg_read( job->devs[index], & buf, job->offset, job->width,
+			       & bytes );
+    if ( (err == 0) && (bytes != job->width) ) {
+	err = ENXIO;
+    }
+
+    if ( err != 0 ) {
+	int expected = 0;
+
+	memset( dst, 0xff, job->width );
+	(void) __atomic_compare_exchange_n( & job->err, & expected, err, 0,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED );
+	return;
+    }
+
+    switch ( job->width ) {
+    case 1:
+	memcpy( dst, & buf, 1 );
+	break;
+    case 2: {
+	uint16_t v;
+
+	memcpy( & v, & buf, sizeof( v ) );
+	v = LETOH_16( v );
+	memcpy( dst, & v, sizeof( v ) );
+	break;
+    }
+    case 4:
+	buf = LETOH_32( buf );
+	memcpy( dst, & buf, sizeof( buf ) );
+	break;
+    }
+}
+
+
+/**
+ * Read the same config register from many devices.
+ *
+ * The reads are spread over the library's worker threads, so that devices
+ * are accessed concurrently.  Results are stored in host byte order, packed
+ * back to back in \c out, one \c width sized element per device.  The
+ * element for a device that could not be read is set to all ones, which is
+ * also what the hardware returns for a device that has gone away.
+ *
+ * \param devs      Devices to read from.
+ * \param num_devs  Number of devices in \c devs.
+ * \param offset    Offset of the register in config space.
+ * \param width     Width of the register in bytes.  Must be 1, 2, or 4.
+ * \param out       Location to store the \c num_devs values.
+ *
+ * \return
+ * Zero if every read succeeded, \c EINVAL for an invalid \c width or an
+ * unaligned \c offset, or the \c errno value of one of the failed reads.
+ *
+ * \sa pci_device_cfg_read
+ */
+int
+pci_system_cfg_read_many( struct pci_device ** devs, unsigned num_devs,
+			  pciaddr_t offset, unsigned width, void * out )
+{
+    struct cfg_read_many job;
+    int err;
+
+    if ( ((width != 1) && (width != 2) && (width != 4))
+	 || ((offset & (width - 1)) != 0) ) {
+	return EINVAL;
+    }
+
+    if ( num_devs == 0 ) {
+	return 0;
+    }
+
+    job.devs = devs;
+    job.offset = offset;
+    job.width = width;
+    job.out = out;
+    job.err = 0;
+
+    err = pci_parallel_for( num_devs, cfg_read_many_one, & job, 0 );
+    return (err != 0) ? err : job.err;
 }
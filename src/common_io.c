@@ -25,62 +25,81 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include "pciaccess.h"
 #include "pciaccess_private.h"
 
+/*
+ * Handles are allocated one at a time, so that they never move once returned
+ * to the caller.  The list is only used to free forgotten handles at
+ * cleanup.
+ */
+static pthread_mutex_t ios_lock = PTHREAD_MUTEX_INITIALIZER;
 static struct pci_io_handle *ios;
-static unsigned int num_ios;
 
 static struct pci_io_handle *
-new_io_handle(void)
+new_io_handle(struct pci_system *sys)
 {
     struct pci_io_handle *new;
 
-    new = realloc(ios, sizeof(struct pci_io_handle) * (num_ios + 1));
+    new = calloc(1, sizeof(struct pci_io_handle));
     if (!new)
 	return NULL;
 
+    new->sys = sys;
+
+    pthread_mutex_lock(&ios_lock);
+    new->next = ios;
+    if (ios)
+	ios->prev = new;
     ios = new;
-    num_ios++;
+    pthread_mutex_unlock(&ios_lock);
 
-    return ios + num_ios - 1;
+    return new;
 }
 
 static void
 delete_io_handle(struct pci_io_handle *handle)
 {
-    struct pci_io_handle *new;
-    int i = 0;
-
-    if (!handle || !num_ios || (void *)handle < (void *)ios ||
-        (void *)handle > (void *)(ios + num_ios - 1))
+    if (!handle)
         return;
 
-    for (i = 0; i < num_ios; i++) {
-        if (ios + i == handle) {
-            memmove(&ios[i], &ios[i+1], sizeof(struct pci_io_handle) *
-                                        (num_ios - i - 1));
-            break;
-        }
-    }
+    pthread_mutex_lock(&ios_lock);
+    if (handle->prev)
+        handle->prev->next = handle->next;
+    else
+        ios = handle->next;
+    if (handle->next)
+        handle->next->prev = handle->prev;
+    pthread_mutex_unlock(&ios_lock);
 
-    num_ios--;
-    if (num_ios) {
-        new = realloc(ios, sizeof(struct pci_io_handle) * num_ios);
-        if (new)
-            ios = new;
-    } else {
-        free(ios);
-        ios = NULL;
-    }
+    free(handle);
 }
 
+/**
+ * Free the handles still open on the devices of \c sys.
+ */
 _pci_hidden void
-pci_io_cleanup(void)
+pci_io_cleanup(struct pci_system *sys)
 {
-    free(ios);
-    ios = NULL;
-    num_ios = 0;
+    struct pci_io_handle *handle;
+    struct pci_io_handle *next;
+
+    pthread_mutex_lock(&ios_lock);
+    for (handle = ios; handle; handle = next) {
+        next = handle->next;
+        if (handle->sys != sys)
+            continue;
+
+        if (handle->prev)
+            handle->prev->next = handle->next;
+        else
+            ios = handle->next;
+        if (handle->next)
+            handle->next->prev = handle->prev;
+        free(handle);
+    }
+    pthread_mutex_unlock(&ios_lock);
 }
 
 /**
@@ -94,10 +113,11 @@ pci_io_cleanup(void)
 struct pci_io_handle *
 pci_device_open_io(struct pci_device *dev, pciaddr_t base, pciaddr_t size)
 {
+    struct pci_system *sys = pci_device_system(dev);
     struct pci_io_handle *ret;
     int bar;
 
-    if (!pci_sys->methods->open_device_io)
+    if (!sys->methods->open_device_io)
 	return NULL;
 
     for (bar = 0; bar < 6; bar++) {
@@ -111,11 +131,11 @@ pci_device_open_io(struct pci_device *dev, pciaddr_t base, pciaddr_t size)
 	if ((base + size) > (region->base_addr + region->size))
 	    continue;
 
-	ret = new_io_handle();
+	ret = new_io_handle(sys);
 	if (!ret)
 	    return NULL;
 
-	if (!pci_sys->methods->open_device_io(ret, dev, bar, base, size)) {
+	if (!sys->methods->open_device_io(ret, dev, bar, base, size)) {
 	    delete_io_handle(ret);
 	    return NULL;
 	}
@@ -136,16 +156,17 @@ pci_device_open_io(struct pci_device *dev, pciaddr_t base, pciaddr_t size)
 struct pci_io_handle *
 pci_legacy_open_io(struct pci_device *dev, pciaddr_t base, pciaddr_t size)
 {
+    struct pci_system *sys = pci_device_system(dev);
     struct pci_io_handle *ret;
 
-    if (!pci_sys->methods->open_legacy_io)
+    if (!sys->methods->open_legacy_io)
 	return NULL;
 
-    ret = new_io_handle();
+    ret = new_io_handle(sys);
     if (!ret)
 	return NULL;
 
-    if (!pci_sys->methods->open_legacy_io(ret, dev, base, size)) {
+    if (!sys->methods->open_legacy_io(ret, dev, base, size)) {
 	delete_io_handle(ret);
 	return NULL;
     }
@@ -159,8 +180,8 @@ pci_legacy_open_io(struct pci_device *dev, pciaddr_t base, pciaddr_t size)
 void
 pci_device_close_io(struct pci_device *dev, struct pci_io_handle *handle)
 {
-    if (dev && handle && pci_sys->methods->close_io)
-	pci_sys->methods->close_io(dev, handle);
+    if (dev && handle && handle->sys->methods->close_io)
+	handle->sys->methods->close_io(dev, handle);
 
     delete_io_handle(handle);
 }
@@ -179,7 +200,7 @@ pci_io_read32(struct pci_io_handle *handle, uint32_t reg)
     if (reg + 4 > handle->size)
 	return UINT32_MAX;
 
-    return pci_sys->methods->read32(handle, reg);
+    return handle->sys->methods->read32(handle, reg);
 }
 
 /**
@@ -196,7 +217,7 @@ pci_io_read16(struct pci_io_handle *handle, uint32_t reg)
     if (reg + 2 > handle->size)
 	return UINT16_MAX;
 
-    return pci_sys->methods->read16(handle, reg);
+    return handle->sys->methods->read16(handle, reg);
 }
 
 /**
@@ -212,7 +233,7 @@ pci_io_read8(struct pci_io_handle *handle, uint32_t reg)
     if (reg + 1 > handle->size)
 	return UINT8_MAX;
 
-    return pci_sys->methods->read8(handle, reg);
+    return handle->sys->methods->read8(handle, reg);
 }
 
 /**
@@ -226,7 +247,7 @@ pci_io_write32(struct pci_io_handle *handle, uint32_t reg, uint32_t data)
     if (reg + 4 > handle->size)
 	return;
 
-    pci_sys->methods->write32(handle, reg, data);
+    handle->sys->methods->write32(handle, reg, data);
 }
 
 /**
@@ -240,7 +261,7 @@ pci_io_write16(struct pci_io_handle *handle, uint32_t reg, uint16_t data)
     if (reg + 2 > handle->size)
 	return;
 
-    pci_sys->methods->write16(handle, reg, data);
+    handle->sys->methods->write16(handle, reg, data);
 }
 
 /**
@@ -253,5 +274,5 @@ pci_io_write8(struct pci_io_handle *handle, uint32_t reg, uint8_t data)
     if (reg + 1 > handle->size)
 	return;
 
-    pci_sys->methods->write8(handle, reg, data);
+    handle->sys->methods->write8(handle, reg, data);
 }
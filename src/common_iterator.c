@@ -31,6 +31,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "pciaccess.h"
 #include "pciaccess_private.h"
@@ -41,7 +42,9 @@
  * \private
  */
 struct pci_device_iterator {
+    struct pci_system * sys;
     unsigned next_index;
+    unsigned end_index;     /**< One past the last index to visit. */
 
     enum {
 	match_any,
@@ -67,16 +70,39 @@ struct pci_device_iterator {
  */
 struct pci_device_iterator *
 pci_slot_match_iterator_create( const struct pci_slot_match * match )
+{
+    return pci_context_slot_match_iterator_create( pci_context_default(),
+						   match );
+}
+
+
+/**
+ * Create an iterator over the devices of a context.
+ *
+ * \param ctx    Context whose devices are iterated.
+ * \param match  Slot match, or \c NULL to iterate all devices.
+ *
+ * \return
+ * A pointer to a fully initialized \c pci_device_iterator structure on
+ * success, or \c NULL on failure.
+ *
+ * \sa pci_slot_match_iterator_create, pci_context_create
+ */
+struct pci_device_iterator *
+pci_context_slot_match_iterator_create( struct pci_context * ctx,
+					const struct pci_slot_match * match )
 {
     struct pci_device_iterator * iter;
 
-    if ( pci_sys == NULL ) {
+    if ( ctx == NULL || ctx->sys == NULL ) {
 	return NULL;
     }
 
     iter = malloc( sizeof( *iter ) );
     if ( iter != NULL ) {
+	iter->sys = ctx->sys;
 	iter->next_index = 0;
+	iter->end_index = ctx->sys->num_devices;
 
 	if ( match != NULL ) {
 	    iter->mode = match_slot;
@@ -103,16 +129,39 @@ pci_slot_match_iterator_create( const struct pci_slot_match * match )
  */
 struct pci_device_iterator *
 pci_id_match_iterator_create( const struct pci_id_match * match )
+{
+    return pci_context_id_match_iterator_create( pci_context_default(),
+						 match );
+}
+
+
+/**
+ * Create an iterator over the devices of a context that match an ID.
+ *
+ * \param ctx    Context whose devices are iterated.
+ * \param match  ID match, or \c NULL to iterate all devices.
+ *
+ * \return
+ * A pointer to a fully initialized \c pci_device_iterator structure on
+ * success, or \c NULL on failure.
+ *
+ * \sa pci_id_match_iterator_create, pci_context_create
+ */
+struct pci_device_iterator *
+pci_context_id_match_iterator_create( struct pci_context * ctx,
+				      const struct pci_id_match * match )
 {
     struct pci_device_iterator * iter;
 
-    if ( pci_sys == NULL ) {
+    if ( ctx == NULL || ctx->sys == NULL ) {
 	return NULL;
     }
 
     iter = malloc( sizeof( *iter ) );
     if ( iter != NULL ) {
+	iter->sys = ctx->sys;
 	iter->next_index = 0;
+	iter->end_index = ctx->sys->num_devices;
 
 	if ( match != NULL ) {
 	    iter->mode = match_id;
@@ -128,6 +177,113 @@ pci_id_match_iterator_create( const struct pci_id_match * match )
 }
 
 
+/**
+ * Make sure the identity fields of a lazily enumerated device are filled in.
+ *
+ * Concurrent callers for the same device are serialized by the device's
+ * \c probe_lock, and all of them return only once the fields are set.  If
+ * they cannot be read, the device stays pending and the next call tries
+ * again.
+ *
+ * \return
+ * Zero on success or an \c errno value on failure.
+ *
+ * \sa PCI_SYSTEM_INIT_LAZY
+ */
+_pci_hidden int
+pci_device_materialize( struct pci_device_private * priv )
+{
+    int err = 0;
+
+    if ( ! __atomic_load_n( & priv->identity_pending, __ATOMIC_ACQUIRE ) ) {
+	return 0;
+    }
+
+    pthread_mutex_lock( & priv->probe_lock );
+    if ( priv->identity_pending ) {
+	err = priv->sys->methods->materialize( & priv->base );
+	if ( err == 0 ) {
+	    __atomic_store_n( & priv->identity_pending, 0, __ATOMIC_RELEASE );
+	}
+    }
+    pthread_mutex_unlock( & priv->probe_lock );
+
+    return err;
+}
+
+
+/**
+ * Check whether a device's address matches a slot match.
+ */
+_pci_hidden int
+pci_slot_match_device( const struct pci_slot_match * match,
+		       const struct pci_device * dev )
+{
+    return PCI_ID_COMPARE( match->domain, dev->domain )
+	&& PCI_ID_COMPARE( match->bus, dev->bus )
+	&& PCI_ID_COMPARE( match->dev, dev->dev )
+	&& PCI_ID_COMPARE( match->func, dev->func );
+}
+
+
+/**
+ * Check whether a device's identity matches an ID match.
+ */
+_pci_hidden int
+pci_id_match_device( const struct pci_id_match * match,
+		     const struct pci_device * dev )
+{
+    return PCI_ID_COMPARE( match->vendor_id, dev->vendor_id )
+	&& PCI_ID_COMPARE( match->device_id, dev->device_id )
+	&& PCI_ID_COMPARE( match->subvendor_id, dev->subvendor_id )
+	&& PCI_ID_COMPARE( match->subdevice_id, dev->subdevice_id )
+	&& ((dev->device_class & match->device_class_mask)
+	    == match->device_class);
+}
+
+
+/**
+ * Check whether a device passes an initialization filter.
+ *
+ * \param filter     Filter to apply.
+ * \param dev        Device to check.
+ * \param check_ids  If zero, only the slot part of the filter is applied,
+ *                   for use before the device's identity is known.
+ *
+ * \return
+ * Non-zero if the device matches at least one of the filter's slot matches
+ * (if there are any) and at least one of its ID matches (if there are any).
+ */
+_pci_hidden int
+pci_system_filter_match( const struct pci_system_filter * filter,
+			 const struct pci_device * dev, int check_ids )
+{
+    unsigned i;
+
+    if ( filter->num_slots != 0 ) {
+	for ( i = 0 ; i < filter->num_slots ; i++ ) {
+	    if ( pci_slot_match_device( & filter->slots[i], dev ) )
+		break;
+	}
+
+	if ( i == filter->num_slots )
+	    return 0;
+    }
+
+    if ( check_ids && filter->num_ids != 0 ) {
+	for ( i = 0 ; i < filter->num_ids ; i++ ) {
+	    if ( pci_id_match_device( & filter->ids[i], dev ) )
+		break;
+	}
+
+	if ( i == filter->num_ids )
+	    return 0;
+    }
+
+    return 1;
+}
+
+
 /**
  * Destroy an iterator previously created with \c pci_iterator_create.
  *
@@ -144,6 +300,48 @@ pci_iterator_destroy( struct pci_device_iterator * iter )
 }
 
 
+/**
+ * Split the remaining devices of an iterator in two.
+ *
+ * The devices not yet returned by \c iter are divided into two halves of
+ * (almost) the same size.  \c iter keeps the first half and a new iterator,
+ * with the same match, gets the second.  Each can be split again and handed
+ * to a separate thread.  The two iterators together return the same devices
+ * that \c iter would have returned.
+ *
+ * \param iter  Iterator to split.
+ *
+ * \return
+ * A new iterator, to be destroyed with \c pci_iterator_destroy, or \c NULL
+ * if fewer than two devices are left to split or on allocation failure.
+ *
+ * \sa pci_system_foreach
+ */
+struct pci_device_iterator *
+pci_device_iterator_split( struct pci_device_iterator * iter )
+{
+    struct pci_device_iterator * tail;
+    unsigned middle;
+
+    if ( iter == NULL || iter->end_index - iter->next_index < 2 ) {
+	return NULL;
+    }
+
+    tail = malloc( sizeof( *tail ) );
+    if ( tail == NULL ) {
+	return NULL;
+    }
+
+    middle = iter->next_index + (iter->end_index - iter->next_index) / 2;
+
+    *tail = *iter;
+    tail->next_index = middle;
+    iter->end_index = middle;
+
+    return tail;
+}
+
+
 /**
  * Iterate to the next PCI device.
  *
@@ -157,29 +355,31 @@ struct pci_device *
 pci_device_next( struct pci_device_iterator * iter )
 {
     struct pci_device_private * d = NULL;
+    struct pci_system * sys;
 
     if (!iter)
 	return NULL;
 
+    sys = iter->sys;
+
     switch( iter->mode ) {
     case match_any:
-	if ( iter->next_index < pci_sys->num_devices ) {
-	    d = & pci_sys->devices[ iter->next_index ];
+	if ( iter->next_index < iter->end_index ) {
+	    d = & sys->devices[ iter->next_index ];
 	    iter->next_index++;
+	    (void) pci_device_materialize( d );
 	}
 
 	break;
 
     case match_slot: {
-	while ( iter->next_index < pci_sys->num_devices ) {
+	while ( iter->next_index < iter->end_index ) {
 	    struct pci_device_private * const temp =
-	      & pci_sys->devices[ iter->next_index ];
+	      & sys->devices[ iter->next_index ];
 
 	    iter->next_index++;
-	    if ( PCI_ID_COMPARE( iter->match.slot.domain, temp->base.domain )
-		 && PCI_ID_COMPARE( iter->match.slot.bus, temp->base.bus )
-		 && PCI_ID_COMPARE( iter->match.slot.dev, temp->base.dev )
-		 && PCI_ID_COMPARE( iter->match.slot.func, temp->base.func ) ) {
+	    if ( pci_slot_match_device( & iter->match.slot, & temp->base ) ) {
+		(void) pci_device_materialize( temp );
 		d = temp;
 		break;
 	    }
@@ -189,17 +389,28 @@ pci_device_next( struct pci_device_iterator * iter )
     }
 
     case match_id: {
-	while ( iter->next_index < pci_sys->num_devices ) {
+	const struct pci_device_index * const idx = pci_system_index_get( sys );
+
+	if ( idx != NULL ) {
+	    const unsigned i = pci_device_index_match( idx, & iter->match.id,
+						       iter->next_index,
+						       iter->end_index );
+
+	    if ( i < iter->end_index ) {
+		d = & sys->devices[i];
+	    }
+
+	    iter->next_index = (i < iter->end_index) ? i + 1 : i;
+	    break;
+	}
+
+	while ( iter->next_index < iter->end_index ) {
 	    struct pci_device_private * const temp =
-	      & pci_sys->devices[ iter->next_index ];
+	      & sys->devices[ iter->next_index ];
 
 	    iter->next_index++;
-	    if ( PCI_ID_COMPARE( iter->match.id.vendor_id, temp->base.vendor_id )
-		 && PCI_ID_COMPARE( iter->match.id.device_id, temp->base.device_id )
-		 && PCI_ID_COMPARE( iter->match.id.subvendor_id, temp->base.subvendor_id )
-		 && PCI_ID_COMPARE( iter->match.id.subdevice_id, temp->base.subdevice_id )
-		 && ((temp->base.device_class & iter->match.id.device_class_mask)
-		     == iter->match.id.device_class) ) {
+	    if ( pci_device_materialize( temp ) == 0
+		 && pci_id_match_device( & iter->match.id, & temp->base ) ) {
 		d = temp;
 		break;
 	    }
@@ -216,11 +427,31 @@ pci_device_next( struct pci_device_iterator * iter )
 struct pci_device *
 pci_device_find_by_slot( uint32_t domain, uint32_t bus, uint32_t dev,
 			 uint32_t func )
+{
+    return pci_context_find_by_slot( pci_context_default(), domain, bus, dev,
+				     func );
+}
+
+
+/**
+ * Find the device of a context at a particular address.
+ *
+ * \sa pci_device_find_by_slot
+ */
+struct pci_device *
+pci_context_find_by_slot( struct pci_context * ctx, uint32_t domain,
+			  uint32_t bus, uint32_t dev, uint32_t func )
 {
     struct pci_device_iterator  iter;
 
 
+    if ( ctx == NULL || ctx->sys == NULL ) {
+	return NULL;
+    }
+
+    iter.sys = ctx->sys;
     iter.next_index = 0;
+    iter.end_index = ctx->sys->num_devices;
     iter.mode = match_slot;
     iter.match.slot.domain = domain;
     iter.match.slot.bus = bus;
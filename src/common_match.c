@@ -0,0 +1,422 @@
+/*
+ * Copyright (c) 2026 The libpciaccess Contributors
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS AND/OR THEIR SUPPLIERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/**
+ * \file common_match.c
+ * Compiled tables of ID matches.
+ *
+ * Drivers commonly check each device against a table of hundreds of
+ * \c pci_id_match entries.  A compiled table finds the entries that can
+ * match a device through a hash on the exact vendor and device IDs, and
+ * on the vendor ID alone for entries that match any device of a vendor.
+ * Only entries with a wildcard vendor ID are checked one by one.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "pciaccess.h"
+#include "pciaccess_private.h"
+
+/** Hash key flag for entries that match on the vendor ID alone. */
+#define KEY_VENDOR_ONLY  (UINT64_C(1) << 32)
+
+/**
+ * Hash slot, giving the entries of one key.
+ */
+struct match_slot {
+    uint64_t key;
+    unsigned first;     /**< First position in \c pci_match_table::hashed. */
+    unsigned count;     /**< Zero for an empty slot. */
+};
+
+/**
+ * Compiled table of ID matches.
+ *
+ * \sa pci_match_table_compile
+ */
+struct pci_match_table {
+    /** Copy of the entries, in their original order. */
+    struct pci_id_match * entries;
+    unsigned num_entries;
+
+    /** Open-addressed hash of keys, \c mask + 1 slots. */
+    struct match_slot * slots;
+    unsigned mask;
+
+    /**
+     * Entry numbers, grouped by key and in increasing order within each
+     * key.
+     */
+    unsigned * hashed;
+
+    /** Entries checked for every device, in increasing order. */
+    unsigned * residual;
+    unsigned num_residual;
+};
+
+/**
+ * Key of an entry, as sorted during compilation.
+ */
+struct keyed_entry {
+    uint64_t key;
+    unsigned entry;
+};
+
+
+static inline unsigned
+hash_key( uint64_t key, unsigned mask )
+{
+    return (unsigned) ((key * UINT64_C(0x9e3779b97f4a7c15)) >> 32) & mask;
+}
+
+
+static int
+compare_keyed( const void * a, const void * b )
+{
+    const struct keyed_entry * const x = a;
+    const struct keyed_entry * const y = b;
+
+    if ( x->key != y->key ) {
+	return (x->key < y->key) ? -1 : 1;
+    }
+
+    return (x->entry < y->entry) ? -1 : (x->entry > y->entry);
+}
+
+
+static const struct match_slot *
+find_slot( const struct pci_match_table * table, uint64_t key )
+{
+    unsigned i = hash_key( key, table->mask );
+
+    while ( table->slots[i].count != 0 ) {
+	if ( table->slots[i].key == key ) {
+	    return & table->slots[i];
+	}
+
+	i = (i + 1) & table->mask;
+    }
+
+    return NULL;
+}
+
+
+/**
+ * Compile a table of ID matches.
+ *
+ * The fields of each entry have the same meaning as for
+ * \c pci_id_match_iterator_create.  The entries are copied, so \c matches
+ * need not outlive the compiled table.
+ *
+ * \param matches      Array of ID matches.
+ * \param num_matches  Number of entries in \c matches.
+ *
+ * \return
+ * A compiled table, to be destroyed with \c pci_match_table_destroy, or
+ * \c NULL with \c errno set on failure.
+ *
+ * \sa pci_match_table_lookup, pci_match_table_annotate
+ */
+struct pci_match_table *
+pci_match_table_compile( const struct pci_id_match * matches,
+			 unsigned num_matches )
+{
+    struct pci_match_table * table;
+    struct keyed_entry * keyed;
+    unsigned num_keyed = 0;
+    unsigned num_slots;
+    unsigned i;
+
+    if ( matches == NULL && num_matches != 0 ) {
+	errno = EINVAL;
+	return NULL;
+    }
+
+    table = calloc( 1, sizeof( *table ) );
+    keyed = malloc( (num_matches + 1) * sizeof( *keyed ) );
+    if ( table == NULL || keyed == NULL ) {
+	goto fail;
+    }
+
+    table->entries = malloc( (num_matches + 1) * sizeof( *table->entries ) );
+    table->hashed = malloc( (num_matches + 1) * sizeof( *table->hashed ) );
+    table->residual = malloc( (num_matches + 1) * sizeof( *table->residual ) );
+    if ( table->entries == NULL || table->hashed == NULL
+	 || table->residual == NULL ) {
+	goto fail;
+    }
+
+    if ( num_matches != 0 ) {
+	memcpy( table->entries, matches, num_matches * sizeof( *matches ) );
+    }
+    table->num_entries = num_matches;
+
+    /* Entries with an ID that is neither a wildcard nor a 16-bit value can
+     * never match, and are left out.
+     */
+    for ( i = 0 ; i < num_matches ; i++ ) {
+	const struct pci_id_match * const m = & matches[i];
+
+	if ( m->vendor_id == (uint32_t) PCI_MATCH_ANY ) {
+	    table->residual[ table->num_residual++ ] = i;
+	}
+	else if ( m->vendor_id > 0xffff
+		  || (m->device_id != (uint32_t) PCI_MATCH_ANY
+		      && m->device_id > 0xffff) ) {
+	    continue;
+	}
+	else if ( m->device_id == (uint32_t) PCI_MATCH_ANY ) {
+	    keyed[ num_keyed ].key = KEY_VENDOR_ONLY | m->vendor_id;
+	    keyed[ num_keyed++ ].entry = i;
+	}
+	else {
+	    keyed[ num_keyed ].key = ((uint64_t) m->vendor_id << 16)
+		| m->device_id;
+	    keyed[ num_keyed++ ].entry = i;
+	}
+    }
+
+    qsort( keyed, num_keyed, sizeof( *keyed ), compare_keyed );
+
+    /* At most half of the slots are used.
+     */
+    num_slots = 4;
+    while ( num_slots < 2 * num_keyed ) {
+	num_slots *= 2;
+    }
+
+    table->slots = calloc( num_slots, sizeof( *table->slots ) );
+    if ( table->slots == NULL ) {
+	goto fail;
+    }
+    table->mask = num_slots - 1;
+
+    for ( i = 0 ; i < num_keyed ; i++ ) {
+	unsigned s;
+
+	table->hashed[i] = keyed[i].entry;
+	if ( i != 0 && keyed[i].key == keyed[ i - 1 ].key ) {
+	    continue;
+	}
+
+	s = hash_key( keyed[i].key, table->mask );
+	while ( table->slots[s].count != 0 ) {
+	    s = (s + 1) & table->mask;
+	}
+
+	table->slots[s].key = keyed[i].key;
+	table->slots[s].first = i;
+	while ( i + table->slots[s].count < num_keyed
+		&& keyed[ i + table->slots[s].count ].key == keyed[i].key ) {
+	    table->slots[s].count++;
+	}
+    }
+
+    free( keyed );
+    return table;
+
+fail:
+    free( keyed );
+    pci_match_table_destroy( table );
+    errno = ENOMEM;
+    return NULL;
+}
+
+
+/**
+ * Destroy a table compiled by \c pci_match_table_compile.
+ */
+void
+pci_match_table_destroy( struct pci_match_table * table )
+{
+    if ( table != NULL ) {
+	free( table->entries );
+	free( table->slots );
+	free( table->hashed );
+	free( table->residual );
+	free( table );
+    }
+}
+
+
+/**
+ * Check the fields of an entry that the hash does not cover.
+ */
+static inline int
+entry_matches( const struct pci_id_match * m, uint16_t vendor_id,
+	       uint16_t device_id, uint16_t subvendor_id,
+	       uint16_t subdevice_id, uint32_t device_class )
+{
+    return PCI_ID_COMPARE( m->vendor_id, vendor_id )
+	&& PCI_ID_COMPARE( m->device_id, device_id )
+	&& PCI_ID_COMPARE( m->subvendor_id, subvendor_id )
+	&& PCI_ID_COMPARE( m->subdevice_id, subdevice_id )
+	&& ((device_class & m->device_class_mask) == m->device_class);
+}
+
+
+/**
+ * Find the first entry matching an identity.
+ *
+ * \return
+ * The number of the first matching entry, or \c num_entries if none
+ * matches.
+ */
+static unsigned
+lookup( const struct pci_match_table * table, uint16_t vendor_id,
+	uint16_t device_id, uint16_t subvendor_id, uint16_t subdevice_id,
+	uint32_t device_class )
+{
+    const uint64_t keys[2] = {
+	((uint64_t) vendor_id << 16) | device_id,
+	KEY_VENDOR_ONLY | vendor_id
+    };
+    unsigned best = table->num_entries;
+    unsigned i;
+    unsigned k;
+
+    /* Each list is in increasing order, so a list is only searched up to
+     * the best entry found so far.
+     */
+    for ( k = 0 ; k < 2 ; k++ ) {
+	const struct match_slot * const slot = find_slot( table, keys[k] );
+
+	if ( slot == NULL ) {
+	    continue;
+	}
+
+	for ( i = 0 ; i < slot->count ; i++ ) {
+	    const unsigned e = table->hashed[ slot->first + i ];
+
+	    if ( e >= best ) {
+		break;
+	    }
+
+	    if ( entry_matches( & table->entries[e], vendor_id, device_id,
+				subvendor_id, subdevice_id, device_class ) ) {
+		best = e;
+		break;
+	    }
+	}
+    }
+
+    for ( i = 0 ; i < table->num_residual ; i++ ) {
+	const unsigned e = table->residual[i];
+
+	if ( e >= best ) {
+	    break;
+	}
+
+	if ( entry_matches( & table->entries[e], vendor_id, device_id,
+			    subvendor_id, subdevice_id, device_class ) ) {
+	    best = e;
+	    break;
+	}
+    }
+
+    return best;
+}
+
+
+/**
+ * Find the entry of a compiled table that matches a device.
+ *
+ * If several entries match, the one that came first in the array passed
+ * to \c pci_match_table_compile is returned, as a linear search of the
+ * array would.
+ *
+ * \param table  Compiled table.
+ * \param dev    Device to look up.
+ *
+ * \return
+ * The table's copy of the matching entry, whose \c match_data identifies
+ * it, or \c NULL if no entry matches.
+ *
+ * \sa pci_match_table_annotate
+ */
+const struct pci_id_match *
+pci_match_table_lookup( const struct pci_match_table * table,
+			const struct pci_device * dev )
+{
+    unsigned e;
+
+    if ( table == NULL || dev == NULL ) {
+	return NULL;
+    }
+
+    e = lookup( table, dev->vendor_id, dev->device_id, dev->subvendor_id,
+		dev->subdevice_id, dev->device_class );
+    return (e < table->num_entries) ? & table->entries[e] : NULL;
+}
+
+
+/**
+ * Find the entries of a compiled table that match every device of an
+ * index.
+ *
+ * This is the same as calling \c pci_match_table_lookup for each device,
+ * but reads the identities from the index in a single pass.
+ *
+ * \param table    Compiled table.
+ * \param idx      Device index, from \c pci_system_get_device_index or
+ *                 \c pci_context_get_device_index.
+ * \param results  Array of \c idx->num_devices entries, in which the
+ *                 matching entry, or \c NULL, is stored for each device.
+ *
+ * \return
+ * The number of devices that matched an entry.
+ *
+ * \sa pci_match_table_lookup
+ */
+unsigned
+pci_match_table_annotate( const struct pci_match_table * table,
+			  const struct pci_device_index * idx,
+			  const struct pci_id_match ** results )
+{
+    unsigned matched = 0;
+    unsigned i;
+
+    if ( table == NULL || idx == NULL || results == NULL ) {
+	return 0;
+    }
+
+    for ( i = 0 ; i < idx->num_devices ; i++ ) {
+	const unsigned e = lookup( table, idx->vendor_id[i],
+				   idx->device_id[i], idx->subvendor_id[i],
+				   idx->subdevice_id[i],
+				   idx->device_class[i] );
+
+	if ( e < table->num_entries ) {
+	    results[i] = & table->entries[e];
+	    matched++;
+	}
+	else {
+	    results[i] = NULL;
+	}
+    }
+
+    return matched;
+}
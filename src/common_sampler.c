@@ -0,0 +1,616 @@
+/*
+ * Copyright (c) 2026 The libpciaccess Contributors
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS AND/OR THEIR SUPPLIERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/**
+ * \file common_sampler.c
+ * High-frequency register sampling.
+ *
+ * A sampler owns a thread, optionally pinned to one CPU, that reads a fixed
+ * set of registers at a fixed rate and appends timestamped samples to a ring
+ * buffer.  The ring has a single producer and any number of lock-free
+ * readers.  When the platform supports it, the ring lives in a memfd that can
+ * be passed to other processes, which map it and read it with
+ * \c pci_sample_ring_read.
+ *
+ * The registers of each device are merged into contiguous ranges once, when
+ * the sampler is created, so each tick costs one back-end access per range
+ * and no memory allocation.
+ */
+
+#define _GNU_SOURCE
+
+#ifndef ANDROID
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "pciaccess.h"
+#include "pciaccess_private.h"
+
+#define PCI_SAMPLE_RING_MAGIC    0x50434953  /* "PCIS" */
+#define PCI_SAMPLE_RING_VERSION  1
+
+/**
+ * Registers of one device, and the ranges read for them on each tick.
+ */
+struct sampler_group {
+    struct pci_device * dev;
+    struct pci_cfg_span * spans;
+    unsigned num_spans;
+};
+
+/**
+ * Where to find a register's value after a tick.
+ */
+struct sampler_reg {
+    unsigned group;
+    unsigned span;
+    unsigned offset;    /**< Offset of the register in the span's data. */
+    unsigned width;
+};
+
+struct pci_sampler {
+    struct sampler_group * groups;
+    unsigned num_groups;
+    struct sampler_reg * regs;
+    unsigned num_regs;
+
+    /** Ranges of all groups, followed by their data buffers. */
+    struct pci_cfg_span * spans;
+
+    uint64_t period_ns;
+    int cpu;
+
+    struct pci_sample_ring * ring;
+    size_t ring_size;
+    int fd;
+
+    pthread_t thread;
+    int stop;
+};
+
+
+/**
+ * Size in bytes of a sample ring with the given number of entries.
+ *
+ * \sa pci_sampler_fd
+ */
+size_t
+pci_sample_ring_size( unsigned num_entries )
+{
+    return sizeof( struct pci_sample_ring )
+	+ (size_t) num_entries * sizeof( struct pci_sample );
+}
+
+
+static struct pci_sample *
+ring_samples( const struct pci_sample_ring * ring )
+{
+    return (struct pci_sample *) & ring[1];
+}
+
+
+/**
+ * Read new samples from a sample ring.
+ *
+ * This function is lock-free and may be used by any number of readers, in
+ * any process that maps the ring.  Each reader keeps its own position.  A
+ * reader that falls more than a ring's worth of samples behind skips the
+ * samples that were overwritten; its position then jumps by more than the
+ * number of samples returned.
+ *
+ * \param ring     Sample ring.
+ * \param pos      Reader's position: the number of samples the producer had
+ *                 written when the reader last caught up.  Start at zero.
+ * \param samples  Location to store the samples.
+ * \param max      Maximum number of samples to store.
+ *
+ * \return
+ * Number of samples stored.
+ */
+unsigned
+pci_sample_ring_read( const struct pci_sample_ring * ring, uint64_t * pos,
+		      struct pci_sample * samples, unsigned max )
+{
+    const struct pci_sample * const slots = ring_samples( ring );
+    const uint64_t n = ring->num_entries;
+    uint64_t head;
+    uint64_t start;
+    uint64_t count;
+    uint64_t i;
+
+    if ( (ring->magic != PCI_SAMPLE_RING_MAGIC) || (n == 0) ) {
+	return 0;
+    }
+
+    head = __atomic_load_n( & ring->head, __ATOMIC_ACQUIRE );
+    start = *pos;
+    if ( head - start > n ) {
+	start = head - n;
+    }
+
+    count = head - start;
+    if ( count > max ) {
+	count = max;
+    }
+
+    for ( i = 0 ; i < count ; i++ ) {
+	samples[i] = slots[ (start + i) & (n - 1) ];
+    }
+
+    /* The producer may have lapped the reader during the copy.  The sample
+     * being written when head was re-read overwrites the slot of sample
+     * (head - n), so only samples after that one are known to be intact.
+     */
+    __atomic_thread_fence( __ATOMIC_ACQUIRE );
+    head = __atomic_load_n( & ring->head, __ATOMIC_ACQUIRE );
+    if ( head >= n ) {
+	const uint64_t first_ok = head - n + 1;
+
+	if ( start < first_ok ) {
+	    const uint64_t lost = first_ok - start;
+
+	    if ( lost >= count ) {
+		*pos = first_ok;
+		return 0;
+	    }
+
+	    memmove( samples, samples + lost,
+		     (count - lost) * sizeof( *samples ) );
+	    start += lost;
+	    count -= lost;
+	}
+    }
+
+    *pos = start + count;
+    return count;
+}
+
+
+static void
+sampler_tick( struct pci_sampler * s, uint64_t * head )
+{
+    struct pci_sample * const slots = ring_samples( s->ring );
+    const uint64_t mask = s->ring->num_entries - 1;
+    unsigned g;
+    unsigned i;
+    unsigned j;
+
+    for ( g = 0 ; g < s->num_groups ; g++ ) {
+	struct sampler_group * const grp = & s->groups[g];
+	uint64_t stamp;
+
+	for ( i = 0 ; i < grp->num_spans ; i++ ) {
+	    grp->spans[i].bytes = 0;
+	}
+
+	if ( pci_device_system( grp->dev )->methods->readv != NULL ) {
+	    (void) pci_device_system( grp->dev )->methods->readv( grp->dev, grp->spans,
+					    grp->num_spans );
+	}
+	else {
+	    for ( i = 0 ; i < grp->num_spans ; i++ ) {
+		(void) pci_device_system( grp->dev )->methods->read( grp->dev, grp->spans[i].data,
+					       grp->spans[i].offset,
+					       grp->spans[i].size,
+					       & grp->spans[i].bytes );
+	    }
+	}
+
+	stamp = pci_monotonic_ns();
+
+	for ( i = 0 ; i < s->num_regs ; i++ ) {
+	    const struct sampler_reg * const r = & s->regs[i];
+	    const struct pci_cfg_span * span;
+	    const uint8_t * data;
+	    struct pci_sample * out;
+	    uint32_t value = 0;
+
+	    if ( r->group != g ) {
+		continue;
+	    }
+
+	    span = & grp->spans[ r->span ];
+	    data = (const uint8_t *) span->data + r->offset;
+	    out = & slots[ *head & mask ];
+
+	    out->timestamp = stamp;
+	    out->reg = i;
+
+	    if ( r->offset + r->width <= span->bytes ) {
+		for ( j = 0 ; j < r->width ; j++ ) {
+		    value |= (uint32_t) data[j] << (j * 8);
+		}
+
+		out->value = value;
+		out->flags = 0;
+	    }
+	    else {
+		out->value = ~0U;
+		out->flags = PCI_SAMPLE_FLAG_ERROR;
+	    }
+
+	    (*head)++;
+	    __atomic_store_n( & s->ring->head, *head, __ATOMIC_RELEASE );
+	}
+    }
+}
+
+
+static void *
+sampler_main( void * arg )
+{
+    struct pci_sampler * const s = arg;
+    uint64_t head = 0;
+    uint64_t next;
+
+#if defined(__linux__) && defined(HAVE_PTHREAD_SETAFFINITY_NP)
+    if ( s->cpu >= 0 ) {
+	cpu_set_t set;
+
+	CPU_ZERO( & set );
+	CPU_SET( s->cpu, & set );
+	(void) pthread_setaffinity_np( pthread_self(), sizeof( set ), & set );
+    }
+#endif
+
+    next = pci_monotonic_ns();
+    while ( ! __atomic_load_n( & s->stop, __ATOMIC_RELAXED ) ) {
+	sampler_tick( s, & head );
+
+	if ( s->period_ns != 0 ) {
+	    struct timespec ts;
+	    const uint64_t now = pci_monotonic_ns();
+
+	    /* Skip ticks that were missed rather than trying to catch up.
+	     */
+	    next += s->period_ns;
+	    if ( next < now ) {
+		next = now;
+	    }
+
+	    ts.tv_sec = next / 1000000000;
+	    ts.tv_nsec = next % 1000000000;
+	    while ( clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, & ts,
+				     NULL ) == EINTR ) {
+		/* empty */ ;
+	    }
+	}
+    }
+
+    return NULL;
+}
+
+
+static int
+reg_compare( const void * a, const void * b )
+{
+    const struct pci_sample_reg * const ra = a;
+    const struct pci_sample_reg * const rb = b;
+
+    if ( ra->dev != rb->dev ) {
+	return (ra->dev < rb->dev) ? -1 : 1;
+    }
+
+    return (ra->offset < rb->offset) ? -1 : (ra->offset > rb->offset);
+}
+
+
+/**
+ * Merge the registers into per-device groups of contiguous ranges.
+ */
+static int
+sampler_build( struct pci_sampler * s, const struct pci_sample_reg * regs,
+	       unsigned num_regs )
+{
+    struct pci_sample_reg * sorted;
+    uint8_t * buf;
+    unsigned total = 0;
+    unsigned num_spans = 0;
+    unsigned i;
+    unsigned j;
+
+    sorted = malloc( num_regs * sizeof( *sorted ) );
+    if ( sorted == NULL ) {
+	return ENOMEM;
+    }
+
+    memcpy( sorted, regs, num_regs * sizeof( *sorted ) );
+    qsort( sorted, num_regs, sizeof( *sorted ), reg_compare );
+
+    for ( i = 0 ; i < num_regs ; i++ ) {
+	total += sorted[i].width;
+    }
+
+    s->regs = calloc( num_regs, sizeof( *s->regs ) );
+    s->groups = calloc( num_regs, sizeof( *s->groups ) );
+    s->spans = calloc( 1, num_regs * sizeof( *s->spans ) + total );
+    if ( (s->regs == NULL) || (s->groups == NULL) || (s->spans == NULL) ) {
+	free( sorted );
+	return ENOMEM;
+    }
+
+    s->num_regs = num_regs;
+    buf = (uint8_t *) & s->spans[ num_regs ];
+
+    /* Build the ranges in sorted order.
+     */
+    for ( i = 0 ; i < num_regs ; i++ ) {
+	struct sampler_group * grp;
+	struct pci_cfg_span * span;
+
+	if ( (i == 0) || (sorted[i].dev != sorted[i - 1].dev) ) {
+	    grp = & s->groups[ s->num_groups++ ];
+	    grp->dev = sorted[i].dev;
+	    grp->spans = & s->spans[ num_spans ];
+	    grp->num_spans = 0;
+	}
+	else {
+	    grp = & s->groups[ s->num_groups - 1 ];
+	}
+
+	span = (grp->num_spans != 0) ? & grp->spans[ grp->num_spans - 1 ]
+	    : NULL;
+
+	if ( (span == NULL)
+	     || (sorted[i].offset > span->offset + span->size) ) {
+	    span = & grp->spans[ grp->num_spans++ ];
+	    span->offset = sorted[i].offset;
+	    span->size = 0;
+	    span->data = buf;
+	    num_spans++;
+	}
+
+	if ( sorted[i].offset + sorted[i].width > span->offset + span->size ) {
+	    const pciaddr_t end = sorted[i].offset + sorted[i].width;
+
+	    buf += end - (span->offset + span->size);
+	    span->size = end - span->offset;
+	}
+    }
+
+    /* Map each of the caller's registers to its range.
+     */
+    for ( i = 0 ; i < num_regs ; i++ ) {
+	for ( j = 0 ; s->groups[j].dev != regs[i].dev ; j++ ) {
+	    /* empty */ ;
+	}
+
+	s->regs[i].group = j;
+	s->regs[i].width = regs[i].width;
+
+	for ( j = 0 ; j < s->groups[ s->regs[i].group ].num_spans ; j++ ) {
+	    const struct pci_cfg_span * const span =
+		& s->groups[ s->regs[i].group ].spans[j];
+
+	    if ( (regs[i].offset >= span->offset)
+		 && (regs[i].offset < span->offset + span->size) ) {
+		s->regs[i].span = j;
+		s->regs[i].offset = regs[i].offset - span->offset;
+		break;
+	    }
+	}
+    }
+
+    free( sorted );
+    return 0;
+}
+
+
+static int
+sampler_map_ring( struct pci_sampler * s, unsigned num_entries )
+{
+    void * mem;
+
+    s->ring_size = pci_sample_ring_size( num_entries );
+    s->fd = -1;
+
+#ifdef HAVE_MEMFD_CREATE
+    s->fd = memfd_create( "pciaccess-samples", MFD_CLOEXEC );
+    if ( s->fd != -1 ) {
+	if ( ftruncate( s->fd, s->ring_size ) == -1 ) {
+	    const int err = errno;
+
+	    close( s->fd );
+	    s->fd = -1;
+	    return err;
+	}
+
+	mem = mmap( NULL, s->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		    s->fd, 0 );
+    }
+    else
+#endif
+    {
+	mem = mmap( NULL, s->ring_size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+    }
+
+    if ( mem == MAP_FAILED ) {
+	return errno;
+    }
+
+    s->ring = mem;
+    s->ring->magic = PCI_SAMPLE_RING_MAGIC;
+    s->ring->version = PCI_SAMPLE_RING_VERSION;
+    s->ring->num_entries = num_entries;
+    s->ring->num_regs = s->num_regs;
+    s->ring->head = 0;
+    return 0;
+}
+
+
+static void
+sampler_free( struct pci_sampler * s )
+{
+    if ( s->ring != NULL ) {
+	munmap( s->ring, s->ring_size );
+    }
+
+    if ( s->fd != -1 ) {
+	close( s->fd );
+    }
+
+    free( s->spans );
+    free( s->groups );
+    free( s->regs );
+    free( s );
+}
+
+
+/**
+ * Start sampling registers at a fixed rate.
+ *
+ * A dedicated thread reads every register in \c regs once per period and
+ * appends one \c pci_sample per register to the sampler's ring.  The
+ * sample's \c reg field is the register's index in \c regs.  The registers
+ * are read directly from the devices, bypassing the register shadow.
+ *
+ * The sampler must be stopped before \c pci_system_cleanup is called.
+ *
+ * \param regs         Registers to sample.
+ * \param num_regs     Number of entries in \c regs.
+ * \param period_usec  Sampling period in microseconds.  Zero samples as fast
+ *                     as possible.
+ * \param num_entries  Number of samples the ring holds.  Must be a power of
+ *                     two.
+ * \param cpu          CPU to pin the sampling thread to, or -1.
+ *
+ * \return
+ * The new sampler, or \c NULL with \c errno set on failure.
+ *
+ * \sa pci_sampler_ring, pci_sampler_fd, pci_sampler_stop
+ */
+struct pci_sampler *
+pci_sampler_start( const struct pci_sample_reg * regs, unsigned num_regs,
+		   unsigned period_usec, unsigned num_entries, int cpu )
+{
+    struct pci_sampler * s;
+    unsigned i;
+    int err;
+
+    if ( (regs == NULL) || (num_regs == 0) ) {
+	errno = EINVAL;
+	return NULL;
+    }
+
+    if ( (num_entries == 0) || ((num_entries & (num_entries - 1)) != 0) ) {
+	errno = EINVAL;
+	return NULL;
+    }
+
+    for ( i = 0 ; i < num_regs ; i++ ) {
+	const unsigned w = regs[i].width;
+
+	if ( (regs[i].dev == NULL)
+	     || ((w != 1) && (w != 2) && (w != 4))
+	     || ((regs[i].offset & (w - 1)) != 0) ) {
+	    errno = EINVAL;
+	    return NULL;
+	}
+    }
+
+    s = calloc( 1, sizeof( *s ) );
+    if ( s == NULL ) {
+	errno = ENOMEM;
+	return NULL;
+    }
+
+    s->fd = -1;
+    s->period_ns = (uint64_t) period_usec * 1000;
+    s->cpu = cpu;
+
+    err = sampler_build( s, regs, num_regs );
+    if ( err == 0 ) {
+	err = sampler_map_ring( s, num_entries );
+    }
+
+    if ( err == 0 ) {
+	err = pthread_create( & s->thread, NULL, sampler_main, s );
+    }
+
+    if ( err != 0 ) {
+	sampler_free( s );
+	errno = err;
+	return NULL;
+    }
+
+    return s;
+}
+
+
+/**
+ * Get a sampler's ring buffer.
+ *
+ * \sa pci_sample_ring_read
+ */
+const struct pci_sample_ring *
+pci_sampler_ring( struct pci_sampler * s )
+{
+    return (s != NULL) ? s->ring : NULL;
+}
+
+
+/**
+ * Get a file descriptor for a sampler's ring buffer.
+ *
+ * Another process that receives the descriptor can map
+ * \c pci_sample_ring_size(num_entries) bytes of it read-only and read
+ * samples with \c pci_sample_ring_read.  The descriptor belongs to the
+ * sampler; duplicate it to keep it past \c pci_sampler_stop.
+ *
+ * \return
+ * A file descriptor, or -1 if the platform cannot share the ring.
+ */
+int
+pci_sampler_fd( struct pci_sampler * s )
+{
+    return (s != NULL) ? s->fd : -1;
+}
+
+
+/**
+ * Stop a sampler and release it.
+ *
+ * Mappings of the ring made by other processes stay valid.
+ */
+void
+pci_sampler_stop( struct pci_sampler * s )
+{
+    if ( s == NULL ) {
+	return;
+    }
+
+    __atomic_store_n( & s->stop, 1, __ATOMIC_RELAXED );
+    pthread_join( s->thread, NULL );
+    sampler_free( s );
+}
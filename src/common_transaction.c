@@ -0,0 +1,389 @@
+/*
+ * Copyright (c) 2026 The libpciaccess Contributors
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS AND/OR THEIR SUPPLIERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/**
+ * \file common_transaction.c
+ * Batched read-modify-write of configuration space.
+ *
+ * A transaction collects masked register writes and applies them together
+ * on commit.  Each byte that is only partially written is read once, all
+ * updates to it are merged, and only the bytes that were written to are
+ * written back, in ascending offset order and with as few back-end writes
+ * as possible.  Barriers split a transaction into groups that are committed
+ * one after the other.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "pciaccess.h"
+#include "pciaccess_private.h"
+
+/**
+ * Masked write queued in a transaction.  A \c width of zero marks a barrier.
+ */
+struct cfg_txn_write {
+    unsigned offset;
+    unsigned width;
+    uint32_t mask;
+    uint32_t data;
+};
+
+struct pci_cfg_txn {
+    struct pci_device * dev;
+
+    struct cfg_txn_write * writes;
+    unsigned num_writes;
+    unsigned max_writes;
+
+    /**
+     * First error met while queueing writes.  A transaction with an error
+     * is not committed.
+     */
+    int err;
+};
+
+
+/**
+ * Start a config space transaction on a device.
+ *
+ * \param dev  Device whose config space is to be written.
+ *
+ * \return
+ * A new transaction, or \c NULL with \c errno set on failure.  The
+ * transaction is released by \c pci_device_cfg_commit or
+ * \c pci_device_cfg_abort.
+ *
+ * \sa pci_cfg_txn_write_bits, pci_cfg_txn_barrier
+ */
+struct pci_cfg_txn *
+pci_device_cfg_begin( struct pci_device * dev )
+{
+    struct pci_cfg_txn * txn;
+
+    if ( dev == NULL ) {
+	errno = EFAULT;
+	return NULL;
+    }
+
+    txn = calloc( 1, sizeof( *txn ) );
+    if ( txn == NULL ) {
+	errno = ENOMEM;
+	return NULL;
+    }
+
+    txn->dev = dev;
+    return txn;
+}
+
+
+static int
+txn_append( struct pci_cfg_txn * txn, const struct cfg_txn_write * w )
+{
+    if ( txn->num_writes == txn->max_writes ) {
+	const unsigned max = (txn->max_writes == 0) ? 8 : txn->max_writes * 2;
+	struct cfg_txn_write * const writes =
+	    realloc( txn->writes, max * sizeof( *writes ) );
+
+	if ( writes == NULL ) {
+	    txn->err = ENOMEM;
+	    return ENOMEM;
+	}
+
+	txn->writes = writes;
+	txn->max_writes = max;
+    }
+
+    txn->writes[ txn->num_writes++ ] = *w;
+    return 0;
+}
+
+
+/**
+ * Queue a masked register write in a transaction.
+ *
+ * On commit, the bits of the register selected by \c mask are set to the
+ * corresponding bits of \c data.  Other bits keep the value read from the
+ * device.  Later writes to the same bits in the same group replace earlier
+ * ones.
+ *
+ * \param txn     Transaction.
+ * \param mask    Bits of the register to change.
+ * \param data    New value of the bits.  Bits outside \c mask are ignored.
+ * \param offset  Byte offset of the register in config space.
+ * \param width   Width of the register in bytes.  Must be 1, 2, or 4.
+ *
+ * \return
+ * Zero on success or an \c errno value on failure.  A failure is also
+ * reported by \c pci_device_cfg_commit, which then writes nothing.
+ */
+int
+pci_cfg_txn_write_bits( struct pci_cfg_txn * txn, uint32_t mask,
+			uint32_t data, pciaddr_t offset, unsigned width )
+{
+    struct cfg_txn_write w;
+
+    if ( txn == NULL ) {
+	return EFAULT;
+    }
+
+    if ( ((width != 1) && (width != 2) && (width != 4))
+	 || ((offset & (width - 1)) != 0)
+	 || (offset + width > PCI_CONFIG_SPACE_EXT_SIZE) ) {
+	txn->err = EINVAL;
+	return EINVAL;
+    }
+
+    if ( width < 4 ) {
+	mask &= (1U << (width * 8)) - 1;
+    }
+
+    w.offset = offset;
+    w.width = width;
+    w.mask = mask;
+    w.data = data & mask;
+
+    return txn_append( txn, & w );
+}
+
+
+/**
+ * Order the writes of a transaction.
+ *
+ * Writes queued after the barrier are committed, including the reads they
+ * need, only after all writes queued before it have been written to the
+ * device.
+ *
+ * \param txn  Transaction.
+ *
+ * \return
+ * Zero on success or an \c errno value on failure.
+ */
+int
+pci_cfg_txn_barrier( struct pci_cfg_txn * txn )
+{
+    struct cfg_txn_write w;
+
+    if ( txn == NULL ) {
+	return EFAULT;
+    }
+
+    if ( (txn->num_writes == 0)
+	 || (txn->writes[ txn->num_writes - 1 ].width == 0) ) {
+	return 0;
+    }
+
+    memset( & w, 0, sizeof( w ) );
+    return txn_append( txn, & w );
+}
+
+
+/**
+ * Commit one barrier-delimited group of writes.
+ *
+ * \param dev     Device to write to.
+ * \param writes  Writes of the group.
+ * \param count   Number of entries in \c writes.
+ * \param value   \c PCI_CONFIG_SPACE_EXT_SIZE bytes of scratch space.
+ * \param mask    \c PCI_CONFIG_SPACE_EXT_SIZE bytes of zeroed scratch space.
+ *                It is zeroed again on return.
+ */
+static int
+txn_commit_group( struct pci_device * dev, const struct cfg_txn_write * writes,
+		  unsigned count, uint8_t * value, uint8_t * mask )
+{
+    struct pci_device_cfg_op * ops;
+    uint32_t * dwords;
+    unsigned first = PCI_CONFIG_SPACE_EXT_SIZE;
+    unsigned last = 0;
+    unsigned num_ops;
+    unsigned i;
+    unsigned j;
+    int err = 0;
+
+
+    /* Merge all writes into a byte image of config space.
+     */
+    for ( i = 0 ; i < count ; i++ ) {
+	for ( j = 0 ; j < writes[i].width ; j++ ) {
+	    const unsigned off = writes[i].offset + j;
+	    const uint8_t m = writes[i].mask >> (j * 8);
+	    const uint8_t d = writes[i].data >> (j * 8);
+
+	    if ( m == 0 ) {
+		continue;
+	    }
+
+	    value[off] = (value[off] & ~m) | d;
+	    mask[off] |= m;
+
+	    if ( off < first ) {
+		first = off;
+	    }
+
+	    if ( off > last ) {
+		last = off;
+	    }
+	}
+    }
+
+    if ( first > last ) {
+	return 0;
+    }
+
+    ops = malloc( (last - first + 1) * sizeof( *ops )
+		  + ((last / 4) - (first / 4) + 1) * sizeof( *dwords ) );
+    if ( ops == NULL ) {
+	err = ENOMEM;
+	goto done;
+    }
+
+    dwords = (uint32_t *) & ops[ last - first + 1 ];
+
+
+    /* Read each dword that holds a partially written byte, once.
+     */
+    num_ops = 0;
+    for ( i = first & ~3U ; i <= last ; i += 4 ) {
+	for ( j = i ; j < i + 4 ; j++ ) {
+	    if ( (mask[j] != 0) && (mask[j] != 0xff) ) {
+		break;
+	    }
+	}
+
+	if ( j < i + 4 ) {
+	    ops[ num_ops ].offset = i;
+	    ops[ num_ops ].width = 4;
+	    ops[ num_ops ].value = & dwords[ (i / 4) - (first / 4) ];
+	    num_ops++;
+	}
+    }
+
+    if ( num_ops != 0 ) {
+	err = pci_device_cfg_readv( dev, ops, num_ops );
+	if ( err != 0 ) {
+	    goto done;
+	}
+
+	for ( i = 0 ; i < num_ops ; i++ ) {
+	    const unsigned base = ops[i].offset;
+	    const uint32_t v = *(const uint32_t *) ops[i].value;
+
+	    for ( j = 0 ; j < 4 ; j++ ) {
+		const uint8_t m = mask[ base + j ];
+
+		value[ base + j ] = (value[ base + j ] & m)
+		    | ((v >> (j * 8)) & ~m);
+	    }
+	}
+    }
+
+
+    /* Write back only the bytes that were written to.  Adjacent bytes are
+     * merged into a single back-end write by pci_device_cfg_writev.
+     */
+    num_ops = 0;
+    for ( i = first ; i <= last ; i++ ) {
+	if ( mask[i] != 0 ) {
+	    ops[ num_ops ].offset = i;
+	    ops[ num_ops ].width = 1;
+	    ops[ num_ops ].value = & value[i];
+	    num_ops++;
+	}
+    }
+
+    err = pci_device_cfg_writev( dev, ops, num_ops );
+
+done:
+    free( ops );
+    memset( mask + first, 0, last - first + 1 );
+    return err;
+}
+
+
+/**
+ * Commit a config space transaction and release it.
+ *
+ * Barrier-delimited groups of writes are committed in order.  Committing
+ * stops at the first group that fails.
+ *
+ * \param txn  Transaction to commit.
+ *
+ * \return
+ * Zero on success or an \c errno value on failure.  If queueing a write
+ * failed, that error is returned and nothing is written.
+ */
+int
+pci_device_cfg_commit( struct pci_cfg_txn * txn )
+{
+    uint8_t * value;
+    unsigned start;
+    unsigned i;
+    int err;
+
+    if ( txn == NULL ) {
+	return EFAULT;
+    }
+
+    err = txn->err;
+    if ( (err != 0) || (txn->num_writes == 0) ) {
+	goto done;
+    }
+
+    value = calloc( 2, PCI_CONFIG_SPACE_EXT_SIZE );
+    if ( value == NULL ) {
+	err = ENOMEM;
+	goto done;
+    }
+
+    for ( i = 0, start = 0 ; (i <= txn->num_writes) && (err == 0) ; i++ ) {
+	if ( (i == txn->num_writes) || (txn->writes[i].width == 0) ) {
+	    err = txn_commit_group( txn->dev, & txn->writes[ start ], i - start,
+				    value, value + PCI_CONFIG_SPACE_EXT_SIZE );
+	    start = i + 1;
+	}
+    }
+
+    free( value );
+
+done:
+    pci_device_cfg_abort( txn );
+    return err;
+}
+
+
+/**
+ * Release a config space transaction without writing anything.
+ *
+ * \param txn  Transaction to release.  May be \c NULL.
+ */
+void
+pci_device_cfg_abort( struct pci_cfg_txn * txn )
+{
+    if ( txn != NULL ) {
+	free( txn->writes );
+	free( txn );
+    }
+}
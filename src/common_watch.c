@@ -0,0 +1,580 @@
+/*
+ * Copyright (c) 2026 The libpciaccess Contributors
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS AND/OR THEIR SUPPLIERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/**
+ * \file common_watch.c
+ * Register watches.
+ *
+ * A single polling thread serves all watches.  Deadlines are aligned to
+ * multiples of each watch's period, so watches with the same period come due
+ * on the same tick.  On each tick, the registers of all due watches of a
+ * device are read with one batched \c pci_device_cfg_readv_flags call, and
+ * callbacks are called for the watches whose masked value changed.
+ *
+ * The polling thread reads the devices directly and never touches the
+ * register shadow, which belongs to the application's threads.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "pciaccess.h"
+#include "pciaccess_private.h"
+
+struct pci_watch {
+    struct pci_device * dev;
+    pciaddr_t offset;
+    unsigned width;
+    uint32_t mask;
+    uint64_t period_ns;
+
+    pci_watch_callback callback;
+    void * user;
+
+    uint64_t next_due;
+    uint32_t value;         /**< Last masked value read. */
+    unsigned primed:1;      /**< \c value is valid. */
+    unsigned removed:1;     /**< Released by \c pci_device_unwatch. */
+    unsigned busy:1;        /**< Being polled, or callback is running. */
+    unsigned dropped:1;     /**< Stopped by \c pci_watch_drop_system. */
+    unsigned orphaned:1;    /**< Unlinked by \c pci_watch_cleanup. */
+
+    struct pci_watch * next;
+};
+
+/**
+ * Due watch collected for one tick.
+ */
+struct watch_item {
+    struct pci_watch * watch;
+    uint32_t value;
+    int err;
+};
+
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t watch_cond;
+static struct pci_watch * watches;
+static pthread_t watch_thread;
+static int watch_running;
+static int watch_stopping;
+
+
+static void
+deadline_to_timespec( uint64_t ns, struct timespec * ts )
+{
+    ts->tv_sec = ns / 1000000000;
+    ts->tv_nsec = ns % 1000000000;
+}
+
+
+/**
+ * Read the registers of the due watches of one device.  \c items must all
+ * refer to the same device.
+ */
+static void
+poll_device( struct watch_item * items, unsigned count,
+	     struct pci_device_cfg_op * ops, uint32_t * values )
+{
+    unsigned num_ops = 0;
+    unsigned i;
+    unsigned j;
+    int err;
+
+    /* Watches of the same register share one read.
+     */
+    for ( i = 0 ; i < count ; i++ ) {
+	const struct pci_watch * const w = items[i].watch;
+
+	for ( j = 0 ; j < num_ops ; j++ ) {
+	    if ( (ops[j].offset == w->offset) && (ops[j].width == w->width) ) {
+		break;
+	    }
+	}
+
+	if ( j == num_ops ) {
+	    values[ num_ops ] = ~0U;
+	    ops[ num_ops ].offset = w->offset;
+	    ops[ num_ops ].width = w->width;
+	    ops[ num_ops ].value = & values[ num_ops ];
+	    num_ops++;
+	}
+    }
+
+    err = pci_device_cfg_readv_flags( items[0].watch->dev, ops, num_ops,
+				      PCI_DEV_CFG_FLAG_NO_SHADOW );
+
+    for ( i = 0 ; i < count ; i++ ) {
+	const struct pci_watch * const w = items[i].watch;
+
+	for ( j = 0 ; j < num_ops ; j++ ) {
+	    if ( (ops[j].offset == w->offset) && (ops[j].width == w->width) ) {
+		break;
+	    }
+	}
+
+	/* Narrow registers are stored in the first bytes of each value.
+	 * Read them back through a matching pointer type.
+	 */
+	switch ( w->width ) {
+	case 1:
+	    items[i].value = *(uint8_t *) ops[j].value;
+	    break;
+	case 2:
+	    items[i].value = *(uint16_t *) ops[j].value;
+	    break;
+	default:
+	    items[i].value = *(uint32_t *) ops[j].value;
+	    break;
+	}
+
+	items[i].err = err;
+    }
+}
+
+
+static int
+item_compare( const void * a, const void * b )
+{
+    const struct watch_item * const ia = a;
+    const struct watch_item * const ib = b;
+
+    if ( ia->watch->dev != ib->watch->dev ) {
+	return (ia->watch->dev < ib->watch->dev) ? -1 : 1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Check whether a watch is still polled.
+ */
+static inline int
+watch_active( const struct pci_watch * w )
+{
+    return ! w->removed && ! w->dropped;
+}
+
+
+/**
+ * Free watches that were removed.  Must be called with \c watch_lock held.
+ *
+ * Dropped watches stay allocated, since their handles belong to the caller
+ * until passed to \c pci_device_unwatch.
+ */
+static void
+reap_removed( void )
+{
+    struct pci_watch ** link = & watches;
+
+    while ( *link != NULL ) {
+	struct pci_watch * const w = *link;
+
+	if ( w->removed && ! w->busy ) {
+	    *link = w->next;
+	    free( w );
+	}
+	else {
+	    link = & w->next;
+	}
+    }
+}
+
+
+static void *
+watch_main( void * arg )
+{
+    struct watch_item * items = NULL;
+    struct pci_device_cfg_op * ops = NULL;
+    uint32_t * values = NULL;
+    unsigned max_items = 0;
+
+    (void) arg;
+
+    pthread_mutex_lock( & watch_lock );
+    while ( ! watch_stopping ) {
+	const uint64_t now = pci_monotonic_ns();
+	uint64_t earliest = UINT64_MAX;
+	struct pci_watch * w;
+	unsigned count = 0;
+	unsigned i;
+	unsigned j;
+
+	reap_removed();
+
+	for ( w = watches ; w != NULL ; w = w->next ) {
+	    if ( ! watch_active( w ) ) {
+		continue;
+	    }
+
+	    if ( w->next_due <= now ) {
+		count++;
+	    }
+	    else if ( w->next_due < earliest ) {
+		earliest = w->next_due;
+	    }
+	}
+
+	if ( count == 0 ) {
+	    if ( earliest == UINT64_MAX ) {
+		pthread_cond_wait( & watch_cond, & watch_lock );
+	    }
+	    else {
+		struct timespec ts;
+
+		deadline_to_timespec( earliest, & ts );
+		pthread_cond_timedwait( & watch_cond, & watch_lock, & ts );
+	    }
+
+	    continue;
+	}
+
+	if ( count > max_items ) {
+	    struct watch_item * const new_items =
+		realloc( items, count * (sizeof( *items ) + sizeof( *ops )
+					 + sizeof( *values )) );
+
+	    if ( new_items == NULL ) {
+		struct timespec ts;
+
+		/* Try again on the next tick.
+		 */
+		deadline_to_timespec( now + 1000000, & ts );
+		pthread_cond_timedwait( & watch_cond, & watch_lock, & ts );
+		continue;
+	    }
+
+	    items = new_items;
+	    ops = (struct pci_device_cfg_op *) & items[ count ];
+	    values = (uint32_t *) & ops[ count ];
+	    max_items = count;
+	}
+
+	/* Collect the due watches and schedule their next tick.  Watches are
+	 * only freed by this thread, so the pointers stay valid while the
+	 * lock is dropped.
+	 */
+	count = 0;
+	for ( w = watches ; w != NULL ; w = w->next ) {
+	    if ( (w->next_due <= now) && watch_active( w ) ) {
+		items[ count++ ].watch = w;
+		w->busy = 1;
+		w->next_due = ((now / w->period_ns) + 1) * w->period_ns;
+	    }
+	}
+
+	pthread_mutex_unlock( & watch_lock );
+
+	qsort( items, count, sizeof( *items ), item_compare );
+	for ( i = 0 ; i < count ; i = j ) {
+	    for ( j = i + 1 ; j < count ; j++ ) {
+		if ( items[j].watch->dev != items[i].watch->dev ) {
+		    break;
+		}
+	    }
+
+	    poll_device( & items[i], j - i, ops, values );
+	}
+
+	pthread_mutex_lock( & watch_lock );
+
+	for ( i = 0 ; i < count ; i++ ) {
+	    const uint32_t value = items[i].value & items[i].watch->mask;
+	    uint32_t old;
+
+	    w = items[i].watch;
+	    if ( ! watch_active( w ) || (items[i].err != 0) ) {
+		w->busy = 0;
+		continue;
+	    }
+
+	    old = w->value;
+	    w->value = value;
+	    if ( ! w->primed ) {
+		w->primed = 1;
+	    }
+	    else if ( old != value ) {
+		pthread_mutex_unlock( & watch_lock );
+
+		(*w->callback)( w->dev, w->offset, old, value, w->user );
+
+		pthread_mutex_lock( & watch_lock );
+	    }
+
+	    w->busy = 0;
+	}
+
+	pthread_cond_broadcast( & watch_cond );
+    }
+    pthread_mutex_unlock( & watch_lock );
+
+    free( items );
+    return NULL;
+}
+
+
+/**
+ * Start the polling thread.  Must be called with \c watch_lock held.
+ */
+static int
+start_thread( void )
+{
+    pthread_condattr_t attr;
+    int err;
+
+    if ( watch_running ) {
+	return 0;
+    }
+
+    pthread_condattr_init( & attr );
+    pthread_condattr_setclock( & attr, CLOCK_MONOTONIC );
+    pthread_cond_init( & watch_cond, & attr );
+    pthread_condattr_destroy( & attr );
+
+    err = pthread_create( & watch_thread, NULL, watch_main, NULL );
+    if ( err != 0 ) {
+	pthread_cond_destroy( & watch_cond );
+	return err;
+    }
+
+    watch_running = 1;
+    return 0;
+}
+
+
+/**
+ * Watch a config register for changes.
+ *
+ * The register is polled every \c period_ms milliseconds by a polling
+ * thread shared by all watches.  Registers of the same device that come due
+ * together are read with a single batched access, and a register watched
+ * several times is read once.  \c callback is called, on the polling thread,
+ * whenever the register's value under \c mask differs from the value seen on
+ * the previous poll.  The first poll only records the initial value.
+ *
+ * Polling bypasses the library's register shadow, so the device is read on
+ * every tick.
+ *
+ * \param dev        Device to watch.
+ * \param offset     Byte offset of the register in config space.
+ * \param width      Width of the register in bytes.  Must be 1, 2, or 4.
+ * \param mask       Bits of the register to watch.
+ * \param period_ms  Polling period in milliseconds.  Must not be zero.
+ * \param callback   Function called when the watched bits change.
+ * \param user       Value passed to \c callback.
+ *
+ * \return
+ * A watch handle, or \c NULL with \c errno set on failure.
+ *
+ * \sa pci_device_unwatch
+ */
+struct pci_watch *
+pci_device_watch( struct pci_device * dev, pciaddr_t offset, unsigned width,
+		  uint32_t mask, unsigned period_ms,
+		  pci_watch_callback callback, void * user )
+{
+    struct pci_watch * w;
+    int err;
+
+    if ( (dev == NULL) || (callback == NULL) ) {
+	errno = EFAULT;
+	return NULL;
+    }
+
+    if ( ((width != 1) && (width != 2) && (width != 4))
+	 || ((offset & (width - 1)) != 0) || (period_ms == 0) ) {
+	errno = EINVAL;
+	return NULL;
+    }
+
+    w = calloc( 1, sizeof( *w ) );
+    if ( w == NULL ) {
+	errno = ENOMEM;
+	return NULL;
+    }
+
+    w->dev = dev;
+    w->offset = offset;
+    w->width = width;
+    w->mask = mask;
+    w->period_ns = (uint64_t) period_ms * 1000000;
+    w->callback = callback;
+    w->user = user;
+
+    pthread_mutex_lock( & watch_lock );
+    err = start_thread();
+    if ( err != 0 ) {
+	pthread_mutex_unlock( & watch_lock );
+	free( w );
+	errno = err;
+	return NULL;
+    }
+
+    /* Poll right away to record the initial value.
+     */
+    w->next_due = 0;
+    w->next = watches;
+    watches = w;
+    pthread_cond_broadcast( & watch_cond );
+    pthread_mutex_unlock( & watch_lock );
+
+    return w;
+}
+
+
+/**
+ * Stop watching a register.
+ *
+ * No callback for the watch runs after this function returns, unless it is
+ * called from that callback itself.
+ *
+ * The handle stays valid until it is passed to this function, even after
+ * the device's system is destroyed or \c pci_system_cleanup is called; such
+ * watches are no longer polled, but must still be removed to free them.
+ *
+ * \param w  Watch to remove.
+ *
+ * \return
+ * Zero on success or an \c errno value on failure.
+ */
+int
+pci_device_unwatch( struct pci_watch * w )
+{
+    if ( w == NULL ) {
+	return EFAULT;
+    }
+
+    pthread_mutex_lock( & watch_lock );
+    if ( w->orphaned ) {
+	pthread_mutex_unlock( & watch_lock );
+	free( w );
+	return 0;
+    }
+
+    w->removed = 1;
+
+    if ( ! pthread_equal( pthread_self(), watch_thread ) ) {
+	while ( w->busy ) {
+	    pthread_cond_wait( & watch_cond, & watch_lock );
+	}
+    }
+
+    pthread_cond_broadcast( & watch_cond );
+    pthread_mutex_unlock( & watch_lock );
+
+    return 0;
+}
+
+
+/**
+ * Remove the watches on the devices of a system that is being destroyed.
+ *
+ * Returns once the polling thread no longer reads or reports any of them,
+ * unless called from a watch callback.
+ */
+_pci_hidden void
+pci_watch_drop_system( struct pci_system * sys )
+{
+    struct pci_watch * w;
+    int busy;
+
+    pthread_mutex_lock( & watch_lock );
+    if ( ! watch_running ) {
+	pthread_mutex_unlock( & watch_lock );
+	return;
+    }
+
+    /* Watches removed or dropped earlier may point to devices that are
+     * gone.
+     */
+    for ( w = watches ; w != NULL ; w = w->next ) {
+	if ( watch_active( w ) && pci_device_system( w->dev ) == sys ) {
+	    w->dropped = 1;
+	}
+    }
+
+    /* A callback destroying a system cannot wait for itself.
+     */
+    do {
+	busy = 0;
+	if ( pthread_equal( pthread_self(), watch_thread ) ) {
+	    break;
+	}
+
+	for ( w = watches ; w != NULL ; w = w->next ) {
+	    busy |= w->dropped && w->busy;
+	}
+
+	if ( busy ) {
+	    pthread_cond_wait( & watch_cond, & watch_lock );
+	}
+    } while ( busy );
+
+    pthread_cond_broadcast( & watch_cond );
+    pthread_mutex_unlock( & watch_lock );
+}
+
+
+/**
+ * Stop the polling thread and free the removed watches.  The others are
+ * unlinked, and freed when the caller removes them.
+ */
+_pci_hidden void
+pci_watch_cleanup( void )
+{
+    pthread_mutex_lock( & watch_lock );
+    if ( ! watch_running ) {
+	pthread_mutex_unlock( & watch_lock );
+	return;
+    }
+
+    watch_stopping = 1;
+    pthread_cond_broadcast( & watch_cond );
+    pthread_mutex_unlock( & watch_lock );
+
+    pthread_join( watch_thread, NULL );
+
+    pthread_mutex_lock( & watch_lock );
+    while ( watches != NULL ) {
+	struct pci_watch * const next = watches->next;
+
+	if ( watches->removed ) {
+	    free( watches );
+	}
+	else {
+	    watches->orphaned = 1;
+	    watches->dropped = 1;
+	}
+
+	watches = next;
+    }
+
+    pthread_cond_destroy( & watch_cond );
+    watch_running = 0;
+    watch_stopping = 0;
+    pthread_mutex_unlock( & watch_lock );
+}
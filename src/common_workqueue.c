@@ -0,0 +1,352 @@
+/*
+ * Copyright (c) 2026 The libpciaccess Contributors
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS AND/OR THEIR SUPPLIERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/**
+ * \file common_workqueue.c
+ * Internal pool of worker threads.
+ *
+ * Work items are queued in FIFO order and run by a small set of threads that
+ * is started on first use and stopped when the last system is destroyed,
+ * whether by \c pci_system_cleanup or \c pci_context_destroy.  Routines
+ * that touch many devices use \c pci_parallel_for to spread the work over
+ * the pool.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "pciaccess.h"
+#include "pciaccess_private.h"
+
+/** Upper bound on the number of worker threads. */
+#define MAX_WORKERS  32
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static struct pci_work * queue_head;
+static struct pci_work * queue_tail;
+static int queue_stopping;
+
+static pthread_t workers[ MAX_WORKERS ];
+static unsigned num_workers;
+
+
+static void *
+worker_main( void * arg )
+{
+    (void) arg;
+
+    pthread_mutex_lock( & queue_lock );
+    for (;;) {
+	struct pci_work * work;
+
+	while ( (queue_head == NULL) && ! queue_stopping ) {
+	    pthread_cond_wait( & queue_cond, & queue_lock );
+	}
+
+	/* Drain the queue before honouring a stop request.
+	 */
+	if ( queue_head == NULL ) {
+	    break;
+	}
+
+	work = queue_head;
+	queue_head = work->next;
+	if ( queue_head == NULL ) {
+	    queue_tail = NULL;
+	}
+
+	pthread_mutex_unlock( & queue_lock );
+	work->func( work );
+	pthread_mutex_lock( & queue_lock );
+    }
+    pthread_mutex_unlock( & queue_lock );
+
+    return NULL;
+}
+
+
+/**
+ * Start the worker threads.  Must be called with \c queue_lock held.
+ */
+static void
+start_workers( void )
+{
+    long cpus = sysconf( _SC_NPROCESSORS_ONLN );
+    unsigned wanted;
+
+    if ( cpus < 1 ) {
+	cpus = 1;
+    }
+
+    wanted = (cpus > MAX_WORKERS) ? MAX_WORKERS : (unsigned) cpus;
+
+    while ( num_workers < wanted ) {
+	if ( pthread_create( & workers[ num_workers ], NULL, worker_main,
+			     NULL ) != 0 ) {
+	    break;
+	}
+
+	num_workers++;
+    }
+}
+
+
+/**
+ * Number of threads in the worker pool, starting it if needed.
+ *
+ * \return
+ * The number of worker threads, which may be zero if none could be created.
+ */
+_pci_hidden unsigned
+pci_workqueue_num_threads( void )
+{
+    unsigned n;
+
+    pthread_mutex_lock( & queue_lock );
+    if ( num_workers == 0 ) {
+	start_workers();
+    }
+
+    n = num_workers;
+    pthread_mutex_unlock( & queue_lock );
+
+    return n;
+}
+
+
+/**
+ * Queue a work item to be run by the worker pool.
+ *
+ * \param work  Work item.  It must stay valid until \c pci_work::func has
+ *              been called.
+ *
+ * \return
+ * Zero on success, or \c EAGAIN if no worker thread could be started.
+ */
+_pci_hidden int
+pci_workqueue_submit( struct pci_work * work )
+{
+    pthread_mutex_lock( & queue_lock );
+    if ( num_workers == 0 ) {
+	start_workers();
+	if ( num_workers == 0 ) {
+	    pthread_mutex_unlock( & queue_lock );
+	    return EAGAIN;
+	}
+    }
+
+    work->next = NULL;
+    if ( queue_tail != NULL ) {
+	queue_tail->next = work;
+    }
+    else {
+	queue_head = work;
+    }
+
+    queue_tail = work;
+    pthread_cond_signal( & queue_cond );
+    pthread_mutex_unlock( & queue_lock );
+
+    return 0;
+}
+
+
+/**
+ * Run all queued work and stop the worker threads.
+ */
+_pci_hidden void
+pci_workqueue_cleanup( void )
+{
+    unsigned i;
+
+    pthread_mutex_lock( & queue_lock );
+    queue_stopping = 1;
+    pthread_cond_broadcast( & queue_cond );
+    pthread_mutex_unlock( & queue_lock );
+
+    for ( i = 0 ; i < num_workers ; i++ ) {
+	pthread_join( workers[i], NULL );
+    }
+
+    pthread_mutex_lock( & queue_lock );
+    num_workers = 0;
+    queue_stopping = 0;
+    pthread_mutex_unlock( & queue_lock );
+}
+
+
+/**
+ * Shared state of a \c pci_parallel_for call.
+ *
+ * The job is reference counted, since helpers that are dequeued after all
+ * indices have been handled still look at it.
+ */
+struct parallel_job {
+    void (*func)( void * ctx, unsigned index );
+    void * ctx;
+    unsigned count;
+
+    unsigned next;      /**< Next index to hand out. */
+    unsigned done;      /**< Number of indices finished. */
+    unsigned refs;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+struct parallel_helper {
+    struct pci_work work;
+    struct parallel_job * job;
+};
+
+
+static void
+parallel_job_release( struct parallel_job * job )
+{
+    if ( __atomic_sub_fetch( & job->refs, 1, __ATOMIC_ACQ_REL ) == 0 ) {
+	pthread_mutex_destroy( & job->lock );
+	pthread_cond_destroy( & job->cond );
+	free( job );
+    }
+}
+
+
+static void
+parallel_job_run( struct parallel_job * job )
+{
+    unsigned i;
+
+    while ( (i = __atomic_fetch_add( & job->next, 1, __ATOMIC_RELAXED ))
+	    < job->count ) {
+	job->func( job->ctx, i );
+
+	if ( __atomic_add_fetch( & job->done, 1, __ATOMIC_ACQ_REL )
+	     == job->count ) {
+	    pthread_mutex_lock( & job->lock );
+	    pthread_cond_broadcast( & job->cond );
+	    pthread_mutex_unlock( & job->lock );
+	}
+    }
+}
+
+
+static void
+parallel_helper_func( struct pci_work * work )
+{
+    struct parallel_helper * const helper = (struct parallel_helper *) work;
+
+    parallel_job_run( helper->job );
+    parallel_job_release( helper->job );
+}
+
+
+/**
+ * Call a function for each index in [0, \c count), spread over the worker
+ * pool.
+ *
+ * The calling thread takes part in the work, so all indices are handled even
+ * if the pool is busy or could not be started.  Returns once \c func has
+ * returned for every index.
+ *
+ * \param count        Number of indices.
+ * \param func         Function to call for each index.
+ * \param ctx          Context passed to \c func.
+ * \param max_threads  Upper bound on the number of threads, including the
+ *                     caller, working on the job.  Zero means no limit.
+ *
+ * \return
+ * Zero on success or an \c errno value on failure.
+ */
+_pci_hidden int
+pci_parallel_for( unsigned count, void (*func)( void * ctx, unsigned index ),
+		  void * ctx, unsigned max_threads )
+{
+    struct parallel_job * job;
+    struct parallel_helper * helpers;
+    unsigned num_helpers;
+    unsigned i;
+
+
+    if ( count == 0 ) {
+	return 0;
+    }
+
+    num_helpers = pci_workqueue_num_threads();
+    if ( (max_threads != 0) && (num_helpers >= max_threads) ) {
+	num_helpers = max_threads - 1;
+    }
+
+    if ( num_helpers >= count ) {
+	num_helpers = count - 1;
+    }
+
+    if ( num_helpers == 0 ) {
+	for ( i = 0 ; i < count ; i++ ) {
+	    func( ctx, i );
+	}
+
+	return 0;
+    }
+
+    job = malloc( sizeof( *job ) + num_helpers * sizeof( *helpers ) );
+    if ( job == NULL ) {
+	return ENOMEM;
+    }
+
+    helpers = (struct parallel_helper *) & job[1];
+
+    job->func = func;
+    job->ctx = ctx;
+    job->count = count;
+    job->next = 0;
+    job->done = 0;
+    job->refs = 1;
+    pthread_mutex_init( & job->lock, NULL );
+    pthread_cond_init( & job->cond, NULL );
+
+    for ( i = 0 ; i < num_helpers ; i++ ) {
+	helpers[i].work.func = parallel_helper_func;
+	helpers[i].job = job;
+
+	__atomic_add_fetch( & job->refs, 1, __ATOMIC_RELAXED );
+	if ( pci_workqueue_submit( & helpers[i].work ) != 0 ) {
+	    __atomic_sub_fetch( & job->refs, 1, __ATOMIC_RELAXED );
+	    break;
+	}
+    }
+
+    parallel_job_run( job );
+
+    pthread_mutex_lock( & job->lock );
+    while ( __atomic_load_n( & job->done, __ATOMIC_ACQUIRE ) < count ) {
+	pthread_cond_wait( & job->cond, & job->lock );
+    }
+    pthread_mutex_unlock( & job->lock );
+
+    parallel_job_release( job );
+    return 0;
+}
@@ -0,0 +1,462 @@
+/*
+ * Copyright (c) 2026 The libpciaccess Contributors
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS AND/OR THEIR SUPPLIERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/**
+ * \file linux_broker.c
+ * Config space and BAR access through \c pcibroker.
+ *
+ * When a broker is reachable, the sysfs back-end still enumerates the
+ * devices itself, but sends config accesses and BAR mappings to the broker,
+ * which can reach all of config space.  Reads and writes of several ranges
+ * of a device are batched into as few messages as possible.
+ *
+ * \sa linux_broker.h
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "pciaccess.h"
+#include "pciaccess_private.h"
+#include "linux_broker.h"
+
+/**
+ * Connection to the broker.  Requests from different threads take turns.
+ */
+struct pci_broker {
+    int fd;
+    pthread_mutex_t lock;
+    char buf[ PCI_BROKER_MAX_MSG ];     /**< Current request or reply. */
+};
+
+
+/**
+ * Connect a system to the broker, if one is configured and running.
+ *
+ * The socket is \c PCIACCESS_BROKER if set.  Otherwise processes without
+ * privileges use \c PCI_BROKER_PATH, and others do not use a broker.  An
+ * empty \c PCIACCESS_BROKER disables the broker.  Set-user-ID programs
+ * ignore \c PCIACCESS_BROKER.
+ *
+ * \return
+ * Zero if connected, or an \c errno value if the system accesses the
+ * devices directly.
+ */
+_pci_hidden int
+pci_linux_broker_connect( struct pci_system * sys )
+{
+    const char * path = pci_getenv( "PCIACCESS_BROKER" );
+    struct sockaddr_un addr;
+    struct pci_broker * b;
+    int fd;
+
+    if ( path == NULL ) {
+	if ( geteuid() == 0 ) {
+	    return ENOENT;
+	}
+
+	path = PCI_BROKER_PATH;
+    }
+
+    if ( path[0] == '\0' || strlen( path ) >= sizeof( addr.sun_path ) ) {
+	return ENOENT;
+    }
+
+    fd = socket( AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0 );
+    if ( fd == -1 ) {
+	return errno;
+    }
+
+    memset( & addr, 0, sizeof( addr ) );
+    addr.sun_family = AF_UNIX;
+    strcpy( addr.sun_path, path );
+    if ( connect( fd, (struct sockaddr *) & addr, sizeof( addr ) ) != 0 ) {
+	const int err = errno;
+
+	close( fd );
+	return err;
+    }
+
+    b = malloc( sizeof( *b ) );
+    if ( b == NULL ) {
+	close( fd );
+	return ENOMEM;
+    }
+
+    b->fd = fd;
+    pthread_mutex_init( & b->lock, NULL );
+    sys->broker = b;
+    return 0;
+}
+
+
+/**
+ * Close the connection of a system to the broker, if any.
+ */
+_pci_hidden void
+pci_linux_broker_disconnect( struct pci_system * sys )
+{
+    struct pci_broker * const b = sys->broker;
+
+    if ( b != NULL ) {
+	close( b->fd );
+	pthread_mutex_destroy( & b->lock );
+	free( b );
+	sys->broker = NULL;
+    }
+}
+
+
+/**
+ * Send the request in the connection's buffer and receive the reply in its
+ * place.  Must be called with the connection's lock held.
+ *
+ * \param b        Connection.
+ * \param size     Size of the request.
+ * \param reply    Location to store the size of the reply.
+ * \param fd       Location to store a descriptor passed with the reply, or
+ *                 \c NULL if none is expected.  Set to -1 if there is none.
+ *
+ * \return
+ * Zero on success or an \c errno value on failure.
+ */
+static int
+broker_call( struct pci_broker * b, size_t size, size_t * reply, int * fd )
+{
+    const struct pci_broker_header * const hdr =
+	(const struct pci_broker_header *) b->buf;
+    const unsigned num_ops = hdr->num_ops;
+    union {
+	struct cmsghdr align;
+	char buf[ CMSG_SPACE( sizeof( int ) ) ];
+    } control;
+    struct cmsghdr * cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    ssize_t bytes;
+    int passed = -1;
+
+    if ( fd != NULL ) {
+	*fd = -1;
+    }
+
+    bytes = send( b->fd, b->buf, size, MSG_NOSIGNAL );
+    if ( bytes < 0 ) {
+	return errno;
+    }
+
+    iov.iov_base = b->buf;
+    iov.iov_len = sizeof( b->buf );
+    memset( & msg, 0, sizeof( msg ) );
+    msg.msg_iov = & iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof( control.buf );
+
+    do {
+	bytes = recvmsg( b->fd, & msg, MSG_CMSG_CLOEXEC );
+    } while ( bytes < 0 && errno == EINTR );
+
+    if ( bytes < 0 ) {
+	return errno;
+    }
+
+    for ( cmsg = CMSG_FIRSTHDR( & msg ) ; cmsg != NULL
+	  ; cmsg = CMSG_NXTHDR( & msg, cmsg ) ) {
+	if ( cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS
+	     && cmsg->cmsg_len == CMSG_LEN( sizeof( int ) ) ) {
+	    memcpy( & passed, CMSG_DATA( cmsg ), sizeof( int ) );
+	}
+    }
+
+    if ( passed != -1 ) {
+	if ( fd != NULL ) {
+	    *fd = passed;
+	}
+	else {
+	    close( passed );
+	}
+    }
+
+    if ( (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))
+	 || (size_t) bytes < sizeof( *hdr )
+	 + num_ops * sizeof( struct pci_broker_result )
+	 || hdr->magic != PCI_BROKER_MAGIC
+	 || hdr->version != PCI_BROKER_VERSION
+	 || hdr->num_ops != num_ops
+	 || (size_t) bytes != sizeof( *hdr )
+	 + num_ops * sizeof( struct pci_broker_result ) + hdr->data_size ) {
+	if ( fd != NULL && *fd != -1 ) {
+	    close( *fd );
+	    *fd = -1;
+	}
+
+	return EIO;
+    }
+
+    *reply = bytes;
+    return 0;
+}
+
+
+static void
+fill_op( struct pci_broker_op * op, const struct pci_device * dev,
+	 unsigned type )
+{
+    memset( op, 0, sizeof( *op ) );
+    op->domain = dev->domain;
+    op->bus = dev->bus;
+    op->dev = dev->dev;
+    op->func = dev->func;
+    op->type = type;
+}
+
+
+/**
+ * Read or write ranges of a device's config space through the broker.
+ *
+ * Stops at the first range that fails, like the sysfs back-end.
+ */
+static int
+broker_transfer( struct pci_device * dev, unsigned type,
+		 struct pci_cfg_span * spans, unsigned num_spans )
+{
+    struct pci_broker * const b = pci_device_system( dev )->broker;
+    struct pci_broker_header * const hdr = (struct pci_broker_header *) b->buf;
+    unsigned first = 0;
+    unsigned i;
+    int err = 0;
+
+    for ( i = 0 ; i < num_spans ; i++ ) {
+	spans[i].bytes = 0;
+    }
+
+    pthread_mutex_lock( & b->lock );
+    while ( first < num_spans && err == 0 ) {
+	const struct pci_broker_result * results;
+	struct pci_broker_op * const ops = (struct pci_broker_op *) & hdr[1];
+	size_t data_size = 0;
+	size_t reply;
+	const char * in;
+	char * out;
+	unsigned n;
+
+	/* Take as many ranges as fit in one message.  Config space is at
+	 * most 4096 bytes, so a single range always fits.
+	 */
+	for ( n = 0 ; first + n < num_spans && n < PCI_BROKER_MAX_OPS ; n++ ) {
+	    const pciaddr_t size = spans[ first + n ].size;
+
+	    if ( size > PCI_BROKER_MAX_DATA - data_size ) {
+		break;
+	    }
+
+	    data_size += size;
+	}
+
+	if ( n == 0 ) {
+	    err = EINVAL;
+	    break;
+	}
+
+	hdr->magic = PCI_BROKER_MAGIC;
+	hdr->version = PCI_BROKER_VERSION;
+	hdr->num_ops = n;
+	hdr->data_size = (type == PCI_BROKER_OP_WRITE) ? data_size : 0;
+
+	out = (char *) & ops[n];
+	for ( i = 0 ; i < n ; i++ ) {
+	    const struct pci_cfg_span * const s = & spans[ first + i ];
+
+	    fill_op( & ops[i], dev, type );
+	    ops[i].offset = s->offset;
+	    ops[i].size = s->size;
+
+	    if ( type == PCI_BROKER_OP_WRITE ) {
+		memcpy( out, s->data, s->size );
+		out += s->size;
+	    }
+	}
+
+	err = broker_call( b, out - b->buf, & reply, NULL );
+	if ( err ) {
+	    break;
+	}
+
+	results = (const struct pci_broker_result *) & hdr[1];
+	in = (const char *) & results[n];
+	for ( i = 0 ; i < n && err == 0 ; i++ ) {
+	    struct pci_cfg_span * const s = & spans[ first + i ];
+
+	    if ( results[i].bytes > s->size ) {
+		err = EIO;
+		break;
+	    }
+
+	    if ( type == PCI_BROKER_OP_READ ) {
+		if ( results[i].bytes > (size_t) (b->buf + reply - in) ) {
+		    err = EIO;
+		    break;
+		}
+
+		memcpy( s->data, in, results[i].bytes );
+		in += results[i].bytes;
+	    }
+
+	    s->bytes = results[i].bytes;
+	    err = results[i].err;
+	}
+
+	first += n;
+    }
+    pthread_mutex_unlock( & b->lock );
+
+    return err;
+}
+
+
+_pci_hidden int
+pci_device_linux_broker_read( struct pci_device * dev, void * data,
+			      pciaddr_t offset, pciaddr_t size,
+			      pciaddr_t * bytes_read )
+{
+    struct pci_cfg_span span = { offset, size, data, 0 };
+    int err;
+
+    err = broker_transfer( dev, PCI_BROKER_OP_READ, & span, 1 );
+    if ( bytes_read != NULL ) {
+	*bytes_read = span.bytes;
+    }
+
+    return err;
+}
+
+
+_pci_hidden int
+pci_device_linux_broker_write( struct pci_device * dev, const void * data,
+			       pciaddr_t offset, pciaddr_t size,
+			       pciaddr_t * bytes_written )
+{
+    struct pci_cfg_span span = { offset, size, (void *) data, 0 };
+    int err;
+
+    err = broker_transfer( dev, PCI_BROKER_OP_WRITE, & span, 1 );
+    if ( bytes_written != NULL ) {
+	*bytes_written = span.bytes;
+    }
+
+    return err;
+}
+
+
+_pci_hidden int
+pci_device_linux_broker_readv( struct pci_device * dev,
+			       struct pci_cfg_span * spans,
+			       unsigned num_spans )
+{
+    return broker_transfer( dev, PCI_BROKER_OP_READ, spans, num_spans );
+}
+
+
+_pci_hidden int
+pci_device_linux_broker_writev( struct pci_device * dev,
+				struct pci_cfg_span * spans,
+				unsigned num_spans )
+{
+    return broker_transfer( dev, PCI_BROKER_OP_WRITE, spans, num_spans );
+}
+
+
+/**
+ * Map a memory region of a device with a descriptor from the broker.
+ */
+_pci_hidden int
+pci_device_linux_broker_map_range( struct pci_device * dev,
+				   struct pci_device_mapping * map )
+{
+    struct pci_broker * const b = pci_device_system( dev )->broker;
+    struct pci_broker_header * const hdr = (struct pci_broker_header *) b->buf;
+    struct pci_broker_op * const op = (struct pci_broker_op *) & hdr[1];
+    const int writable = (map->flags & PCI_DEV_MAP_FLAG_WRITABLE) != 0;
+    const off_t offset = map->base - dev->regions[ map->region ].base_addr;
+    size_t reply;
+    int fd;
+    int err;
+
+    pthread_mutex_lock( & b->lock );
+    hdr->magic = PCI_BROKER_MAGIC;
+    hdr->version = PCI_BROKER_VERSION;
+    hdr->num_ops = 1;
+    hdr->data_size = 0;
+    fill_op( op, dev, PCI_BROKER_OP_MAP );
+    op->offset = map->region;
+    op->flags = writable ? PCI_BROKER_MAP_WRITABLE : 0;
+
+    err = broker_call( b, sizeof( *hdr ) + sizeof( *op ), & reply, & fd );
+    if ( err == 0 ) {
+	err = ((const struct pci_broker_result *) & hdr[1])->err;
+    }
+    pthread_mutex_unlock( & b->lock );
+
+    if ( err == 0 && fd == -1 ) {
+	err = EIO;
+    }
+
+    if ( err ) {
+	if ( fd != -1 ) {
+	    close( fd );
+	}
+
+	return err;
+    }
+
+    map->memory = mmap( NULL, map->size,
+			writable ? (PROT_READ | PROT_WRITE) : PROT_READ,
+			MAP_SHARED, fd, offset );
+    err = (map->memory == MAP_FAILED) ? errno : 0;
+    if ( err ) {
+	map->memory = NULL;
+    }
+
+    close( fd );
+    return err;
+}
+
+
+_pci_hidden int
+pci_device_linux_broker_unmap_range( struct pci_device * dev,
+				     struct pci_device_mapping * map )
+{
+    (void) dev;
+
+    return (munmap( map->memory, map->size ) == 0) ? 0 : errno;
+}
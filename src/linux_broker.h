@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2026 The libpciaccess Contributors
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS AND/OR THEIR SUPPLIERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/**
+ * \file linux_broker.h
+ * Protocol between the library and \c pcibroker.
+ *
+ * Without privileges, Linux only exposes the first 64 bytes of each
+ * device's config space, and no BAR.  \c pcibroker runs with privileges and
+ * performs config accesses and opens BARs on behalf of other processes,
+ * within the limits of its policy.
+ *
+ * Clients talk to the broker over a \c SOCK_SEQPACKET Unix socket, so each
+ * message arrives whole.  A request is a \c pci_broker_header, \c num_ops
+ * \c pci_broker_op, then the data of the writes, in order.  The reply is a
+ * \c pci_broker_header, one \c pci_broker_result per operation, then the
+ * data of the reads, in order.  Operations run in order and stop at the
+ * first that fails; the ones after it are reported with \c ECANCELED and
+ * no bytes.  A \c PCI_BROKER_OP_MAP request has a single operation; on
+ * success, the reply carries a descriptor for the BAR in an \c SCM_RIGHTS
+ * message.
+ *
+ * Both sides run on the same host, so fields are in host byte order.
+ */
+
+#ifndef LINUX_BROKER_H
+#define LINUX_BROKER_H
+
+#include <stdint.h>
+
+#define PCI_BROKER_MAGIC        0x42494350U     /**< "PCIB" */
+#define PCI_BROKER_VERSION      1
+
+/** Path of the socket when \c PCIACCESS_BROKER is not set. */
+#define PCI_BROKER_PATH         "/run/pciaccess/broker"
+
+/** Upper bound on the operations in one message. */
+#define PCI_BROKER_MAX_OPS      256
+
+/** Upper bound on the data in one message. */
+#define PCI_BROKER_MAX_DATA     (64 * 1024)
+
+/** Size of the largest valid message. */
+#define PCI_BROKER_MAX_MSG \
+    (sizeof( struct pci_broker_header ) \
+     + PCI_BROKER_MAX_OPS * sizeof( struct pci_broker_op ) \
+     + PCI_BROKER_MAX_DATA)
+
+enum pci_broker_op_type {
+    PCI_BROKER_OP_READ = 1,     /**< Read config space. */
+    PCI_BROKER_OP_WRITE = 2,    /**< Write config space. */
+    PCI_BROKER_OP_MAP = 3       /**< Get a descriptor for a BAR. */
+};
+
+/** Map the BAR for writing, for \c PCI_BROKER_OP_MAP. */
+#define PCI_BROKER_MAP_WRITABLE (1U<<0)
+
+struct pci_broker_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t num_ops;
+    uint32_t data_size;         /**< Bytes of data after the operations. */
+};
+
+struct pci_broker_op {
+    uint16_t domain;
+    uint8_t bus;
+    uint8_t dev;
+    uint8_t func;
+    uint8_t type;               /**< \c pci_broker_op_type */
+    uint16_t flags;
+    uint32_t offset;            /**< Config offset, or BAR number to map. */
+    uint32_t size;              /**< Bytes to access. */
+};
+
+struct pci_broker_result {
+    int32_t err;                /**< Zero or an \c errno value. */
+    uint32_t bytes;             /**< Bytes transferred. */
+};
+
+#endif /* LINUX_BROKER_H */
@@ -41,8 +41,12 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <dirent.h>
+#include <sys/syscall.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
 
 #ifndef ANDROID
 #include "config.h"
@@ -59,37 +63,131 @@
 
 static const struct pci_system_methods linux_sysfs_methods;
 
-#define SYS_BUS_PCI "/sys/bus/pci/devices"
+/**
+ * Methods of systems whose config accesses and mappings go through
+ * \c pcibroker, see \c linux_broker.c.
+ */
+static struct pci_system_methods linux_broker_methods;
+static pthread_once_t broker_methods_once = PTHREAD_ONCE_INIT;
+
+static void broker_methods_init( void );
+
+/**
+ * \name Location of sysfs
+ *
+ * sysfs is normally mounted at "/sys".  The \c PCIACCESS_SYSFS_ROOT
+ * environment variable points the library at another tree with the same
+ * layout instead, e.g. a copy used for testing.  Set-user-ID programs
+ * ignore it.
+ */
+/*@{*/
+/** Longest root accepted, so that device paths fit in 256 bytes. */
+#define SYSFS_ROOT_MAX 128
+
+static char sysfs_root[SYSFS_ROOT_MAX + 1] = "/sys";
+static char sys_bus_pci[SYSFS_ROOT_MAX + sizeof( "/bus/pci/devices" )] =
+    "/sys/bus/pci/devices";
+static pthread_once_t sysfs_root_once = PTHREAD_ONCE_INIT;
+
+#define SYS_BUS_PCI sys_bus_pci
+
+static void
+sysfs_root_init( void )
+{
+    const char * const root = pci_getenv( "PCIACCESS_SYSFS_ROOT" );
+
+    if ( root != NULL && root[0] != '\0'
+	 && strlen( root ) <= SYSFS_ROOT_MAX ) {
+	strcpy( sysfs_root, root );
+	snprintf( sys_bus_pci, sizeof( sys_bus_pci ), "%s/bus/pci/devices",
+		  root );
+    }
+}
+/*@}*/
 
 static int
 pci_device_linux_sysfs_read( struct pci_device * dev, void * data,
 			     pciaddr_t offset, pciaddr_t size,
 			     pciaddr_t * bytes_read );
 
-static int populate_entries(struct pci_system * pci_sys);
+static int config_pread( int fd, void * data, pciaddr_t offset,
+    pciaddr_t size, pciaddr_t * bytes_read );
+
+static int populate_entries(struct pci_system * pci_sys, int lazy,
+    const struct pci_system_filter * filter);
+
+/**
+ * \name Cached config file descriptors
+ *
+ * Each device's config file is kept open after first use, so that config
+ * accesses cost a single \c pread64 or \c pwrite64.  To stay clear of the
+ * process's file descriptor limit, only a quarter of \c RLIMIT_NOFILE
+ * descriptors are kept open; accesses to further devices open and close the
+ * file each time.
+ */
+/*@{*/
+static unsigned config_fd_limit;
+static unsigned config_fd_count;
+static pthread_once_t config_fd_limit_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Set the number of descriptors that may be cached.  This is shared by all
+ * systems in the process, so it is computed once, before the first system
+ * is created.
+ */
+static void
+config_fd_limit_init( void )
+{
+    struct rlimit rl;
+
+    if ( getrlimit( RLIMIT_NOFILE, & rl ) == 0 ) {
+	config_fd_limit = ((rl.rlim_cur == RLIM_INFINITY)
+			   || (rl.rlim_cur / 4 > UINT_MAX))
+	    ? UINT_MAX : rl.rlim_cur / 4;
+    }
+}
+/*@}*/
 
 /**
  * Attempt to access PCI subsystem using Linux's sysfs interface.
+ *
+ * \param flags   \c PCI_SYSTEM_INIT_ flags.
+ * \param filter  Devices to keep, or \c NULL for all of them.
+ * \param sys     Location to store the new system.
  */
 _pci_hidden int
-pci_system_linux_sysfs_create( void )
+pci_system_linux_sysfs_create( unsigned flags,
+			       const struct pci_system_filter * filter,
+			       struct pci_system ** sys )
 {
     int err = 0;
     struct stat st;
+    struct pci_system * p;
 
 
     /* If the directory "/sys/bus/pci/devices" exists, then the PCI subsystem
      * can be accessed using this interface.
      */
+    pthread_once( & sysfs_root_once, sysfs_root_init );
 
     if ( stat( SYS_BUS_PCI, & st ) == 0 ) {
-	pci_sys = calloc( 1, sizeof( struct pci_system ) );
-	if ( pci_sys != NULL ) {
-	    pci_sys->methods = & linux_sysfs_methods;
+	p = calloc( 1, sizeof( struct pci_system ) );
+	if ( p != NULL ) {
+	    p->methods = & linux_sysfs_methods;
+	    p->flags = flags;
+	    if ( pci_linux_broker_connect( p ) == 0 ) {
+		pthread_once( & broker_methods_once, broker_methods_init );
+		p->methods = & linux_broker_methods;
+	    }
 #ifdef HAVE_MTRR
-	    pci_sys->mtrr_fd = open("/proc/mtrr", O_WRONLY);
+	    p->mtrr_fd = open("/proc/mtrr", O_WRONLY);
 #endif
-	    err = populate_entries(pci_sys);
+	    pthread_once( & config_fd_limit_once, config_fd_limit_init );
+
+	    *sys = p;
+	    err = populate_entries(p,
+				   (flags & PCI_SYSTEM_INIT_LAZY) != 0,
+				   filter);
 	}
 	else {
 	    err = ENOMEM;
@@ -104,89 +202,538 @@ pci_system_linux_sysfs_create( void )
 
 
 /**
- * Filter out the names "." and ".." from the scanned sysfs entries.
+ * Layout of the records returned by the \c getdents64 system call.
+ */
+struct linux_dirent64 {
+    uint64_t        d_ino;
+    int64_t         d_off;
+    unsigned short  d_reclen;
+    unsigned char   d_type;
+    char            d_name[];
+};
+
+
+static int
+hex_digit( char c )
+{
+    if ( c >= '0' && c <= '9' )
+	return c - '0';
+    if ( c >= 'a' && c <= 'f' )
+	return c - 'a' + 10;
+    if ( c >= 'A' && c <= 'F' )
+	return c - 'A' + 10;
+    return -1;
+}
+
+
+/**
+ * Parse a sysfs device name of the form "dddd:bb:ss.f".
  *
- * \param d  Directory entry being processed by \c scandir.
+ * \param name  Directory entry name.
+ * \param key   Location to store the packed address.  The domain is in
+ *              bits 31:16, the bus in 15:8, the slot in 7:3 and the function
+ *              in 2:0, so keys sort in the same order as addresses.
  *
  * \return
- * Zero if the entry name matches either "." or "..", non-zero otherwise.
- *
- * \sa scandir, populate_entries
+ * Zero if \c name is a device address, -1 otherwise (".", "..", etc.).
  */
 static int
-scan_sys_pci_filter( const struct dirent * d )
+parse_bdf( const char * name, uint32_t * key )
+{
+    unsigned dom = 0, bus, dev, func;
+    int digits = 0;
+    int h, l;
+
+    for ( ; (h = hex_digit( *name )) >= 0 ; name++ ) {
+	dom = (dom << 4) | h;
+	digits++;
+    }
+
+    if ( digits == 0 || digits > 8 || name[0] != ':' )
+	return -1;
+
+    if ( (h = hex_digit( name[1] )) < 0 || (l = hex_digit( name[2] )) < 0
+	 || name[3] != ':' )
+	return -1;
+    bus = (h << 4) | l;
+
+    if ( (h = hex_digit( name[4] )) < 0 || (l = hex_digit( name[5] )) < 0
+	 || name[6] != '.' )
+	return -1;
+    dev = (h << 4) | l;
+
+    if ( name[7] < '0' || name[7] > '7' || name[8] != '\0' || dev > 31 )
+	return -1;
+    func = name[7] - '0';
+
+    *key = ((dom & 0xffff) << 16) | (bus << 8) | (dev << 3) | func;
+    return 0;
+}
+
+
+/**
+ * Sort packed device addresses with an LSD radix sort, one byte per pass.
+ * Passes where every key has the same byte (typically the domain) are
+ * skipped.
+ *
+ * \return
+ * The sorted array, which is either \c keys or \c tmp.
+ */
+static uint32_t *
+sort_bdf_keys( uint32_t * keys, uint32_t * tmp, size_t n )
 {
-    return !((strcmp( d->d_name, "." ) == 0)
-	     || (strcmp( d->d_name, ".." ) == 0));
+    size_t count[256];
+    unsigned shift;
+    size_t i;
+
+    for ( shift = 0 ; shift < 32 ; shift += 8 ) {
+	size_t sum = 0;
+	uint32_t * swap;
+
+	memset( count, 0, sizeof( count ) );
+	for ( i = 0 ; i < n ; i++ )
+	    count[ (keys[i] >> shift) & 0xff ]++;
+
+	if ( count[ (keys[0] >> shift) & 0xff ] == n )
+	    continue;
+
+	for ( i = 0 ; i < 256 ; i++ ) {
+	    size_t c = count[i];
+
+	    count[i] = sum;
+	    sum += c;
+	}
+
+	for ( i = 0 ; i < n ; i++ )
+	    tmp[ count[ (keys[i] >> shift) & 0xff ]++ ] = keys[i];
+
+	swap = keys;
+	keys = tmp;
+	tmp = swap;
+    }
+
+    return keys;
 }
 
 
-int
-populate_entries( struct pci_system * p )
+/**
+ * Read the device addresses listed in the sysfs PCI directory.
+ *
+ * Entries are read with \c getdents64 into a single buffer and parsed in
+ * place, avoiding the per-entry allocations and locale-aware sorting of
+ * \c scandir.
+ *
+ * \param keys  Location to store the array of packed device addresses, in
+ *              ascending order.  The caller must free it.
+ * \param num   Location to store the number of addresses.
+ *
+ * \sa parse_bdf, populate_entries
+ */
+static int
+scan_sys_pci( uint32_t ** keys, size_t * num )
 {
-    struct dirent ** devices = NULL;
-    int n;
-    int i;
+    char buf[32768];
+    uint32_t * k = NULL;
+    uint32_t * sorted;
+    size_t n = 0;
+    size_t size = 0;
     int err = 0;
+    int fd;
+
+
+    *keys = NULL;
+    *num = 0;
+
+    fd = open( SYS_BUS_PCI, O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+    if ( fd == -1 ) {
+	return errno;
+    }
+
+    for (;;) {
+	long len = syscall( SYS_getdents64, fd, buf, sizeof( buf ) );
+	long pos;
+
+	if ( len <= 0 ) {
+	    if ( len < 0 )
+		err = errno;
+	    break;
+	}
+
+	for ( pos = 0 ; pos < len ; ) {
+	    const struct linux_dirent64 * d =
+		(const struct linux_dirent64 *) (buf + pos);
+	    uint32_t key;
+
+	    pos += d->d_reclen;
+	    if ( parse_bdf( d->d_name, & key ) != 0 )
+		continue;
+
+	    if ( n == size ) {
+		/* Leave room for the radix sort's scratch space.
+		 */
+		size_t new_size = (size != 0) ? size * 2 : 256;
+		uint32_t * new_k = realloc( k, 2 * new_size * sizeof( *k ) );
+
+		if ( new_k == NULL ) {
+		    err = ENOMEM;
+		    goto out;
+		}
+
+		k = new_k;
+		size = new_size;
+	    }
+
+	    k[ n++ ] = key;
+	}
+    }
+
+out:
+    close( fd );
+
+    if ( err || n == 0 ) {
+	free( k );
+	return err;
+    }
+
+    sorted = sort_bdf_keys( k, k + size, n );
+    if ( sorted != k )
+	memcpy( k, sorted, n * sizeof( *k ) );
+
+    *keys = k;
+    *num = n;
+    return 0;
+}
+
+
+/**
+ * Read the identity fields of a device from its config space.
+ *
+ * \param dev      Device.
+ * \param keep_fd  If zero, the config file is closed after the read rather
+ *                 than cached, for devices that are only being classified
+ *                 and may be dropped.
+ *
+ * \sa populate_entries, pci_system_methods::materialize
+ */
+static int
+pci_device_linux_sysfs_read_identity( struct pci_device * dev, int keep_fd )
+{
+    uint8_t config[48];
+    char name[256];
+    pciaddr_t bytes = 0;
+    int err;
+    int fd;
+
+
+    if (keep_fd) {
+	err = pci_device_linux_sysfs_read(dev, config, 0, 48, & bytes);
+    }
+    else {
+	snprintf(name, 255, "%s/%04x:%02x:%02x.%1u/config",
+		 SYS_BUS_PCI, dev->domain, dev->bus, dev->dev, dev->func);
+
+	fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+	    return errno;
+	}
+
+	err = config_pread(fd, config, 0, 48, & bytes);
+	close(fd);
+    }
+
+    if ((bytes == 48) && !err) {
+	dev->vendor_id = (uint16_t)config[0]
+	    + ((uint16_t)config[1] << 8);
+	dev->device_id = (uint16_t)config[2]
+	    + ((uint16_t)config[3] << 8);
+	dev->device_class = (uint32_t)config[9]
+	    + ((uint32_t)config[10] << 8)
+	    + ((uint32_t)config[11] << 16);
+	dev->revision = config[8];
+	dev->subvendor_id = (uint16_t)config[44]
+	    + ((uint16_t)config[45] << 8);
+	dev->subdevice_id = (uint16_t)config[46]
+	    + ((uint16_t)config[47] << 8);
+    }
+
+    return err;
+}
+
+
+/**
+ * Read the identity fields of a device from its \c uevent file.
+ *
+ * The file is readable by unprivileged users and holds lines such as
+ * "PCI_ID=8086:0D57".  It does not have the revision ID, which is filled in
+ * when the device is probed.
+ *
+ * \sa pci_device_linux_sysfs_read_identity
+ */
+static int
+pci_device_linux_sysfs_read_uevent( struct pci_device * dev )
+{
+    char name[256];
+    char buf[1024];
+    char * line;
+    char * save;
+    unsigned have = 0;
+    ssize_t len;
+    int fd;
+
+
+    snprintf( name, 255, "%s/%04x:%02x:%02x.%1u/uevent",
+	      SYS_BUS_PCI,
+	      dev->domain,
+	      dev->bus,
+	      dev->dev,
+	      dev->func );
+
+    fd = open( name, O_RDONLY | O_CLOEXEC );
+    if ( fd == -1 ) {
+	return errno;
+    }
+
+    len = read( fd, buf, sizeof( buf ) - 1 );
+    close( fd );
+    if ( len < 0 ) {
+	return errno;
+    }
+
+    buf[ len ] = '\0';
+
+    for ( line = strtok_r( buf, "\n", & save ) ; line != NULL
+	  ; line = strtok_r( NULL, "\n", & save ) ) {
+	unsigned a, b;
+
+	if ( sscanf( line, "PCI_ID=%x:%x", & a, & b ) == 2 ) {
+	    dev->vendor_id = a;
+	    dev->device_id = b;
+	    have |= 1;
+	}
+	else if ( sscanf( line, "PCI_SUBSYS_ID=%x:%x", & a, & b ) == 2 ) {
+	    dev->subvendor_id = a;
+	    dev->subdevice_id = b;
+	}
+	else if ( sscanf( line, "PCI_CLASS=%x", & a ) == 1 ) {
+	    dev->device_class = a;
+	    have |= 2;
+	}
+    }
+
+    return (have == 3) ? 0 : ENXIO;
+}
+
+
+/**
+ * Fill in the identity fields of a device, using the configured source.
+ *
+ * \sa populate_entries, pci_system_methods::materialize
+ */
+static int
+pci_device_linux_sysfs_fill_identity( struct pci_device * dev )
+{
+    if ( (pci_device_system( dev )->flags & PCI_SYSTEM_INIT_UEVENT)
+	 && (pci_device_linux_sysfs_read_uevent( dev ) == 0) ) {
+	return 0;
+    }
+
+    return pci_device_linux_sysfs_read_identity( dev, 1 );
+}
+
 
+/**
+ * Check that the image mapped for a system describes the devices present.
+ *
+ * The image must list exactly the addresses in \c keys.  A device that was
+ * replaced by another at the same address since the image was written is
+ * caught by comparing the IDs of the first, middle and last records with
+ * the devices' \c uevent files.
+ */
+static int
+image_is_current( struct pci_system * p, const uint32_t * keys, size_t n )
+{
+    const size_t spot[3] = { 0, n / 2, n - 1 };
+    size_t i;
+
+
+    if ( p->image->num_devices != n ) {
+	return 0;
+    }
 
-    n = scandir( SYS_BUS_PCI, & devices, scan_sys_pci_filter, alphasort );
-    if ( n > 0 ) {
-	p->num_devices = n;
+    for ( i = 0 ; i < n ; i++ ) {
+	if ( pci_image_find( p->image, keys[i] >> 16, (keys[i] >> 8) & 0xff,
+			     (keys[i] >> 3) & 0x1f, keys[i] & 0x07 ) == NULL ) {
+	    return 0;
+	}
+    }
+
+    for ( i = 0 ; n > 0 && i < 3 ; i++ ) {
+	const struct pci_image_device * rec;
+	struct pci_device_private tmp;
+
+	memset( & tmp, 0, sizeof( tmp ) );
+	tmp.base.domain = keys[ spot[i] ] >> 16;
+	tmp.base.bus = (keys[ spot[i] ] >> 8) & 0xff;
+	tmp.base.dev = (keys[ spot[i] ] >> 3) & 0x1f;
+	tmp.base.func = keys[ spot[i] ] & 0x07;
+
+	/* Devices whose uevent cannot be read are not checked.
+	 */
+	if ( pci_device_linux_sysfs_read_uevent( & tmp.base ) != 0 ) {
+	    continue;
+	}
+
+	rec = pci_image_find( p->image, tmp.base.domain, tmp.base.bus,
+			      tmp.base.dev, tmp.base.func );
+	if ( rec->vendor_id != tmp.base.vendor_id
+	     || rec->device_id != tmp.base.device_id
+	     || rec->device_class != tmp.base.device_class ) {
+	    return 0;
+	}
+    }
+
+    return 1;
+}
+
+
+/**
+ * Build the device list from the entries of the sysfs PCI directory.
+ *
+ * \param p       PCI system to fill in.
+ * \param lazy    If non-zero, only record each device's address.  Its
+ *                identity is read on first use, see
+ *                \c pci_device_materialize.
+ * \param filter  If not \c NULL, devices to keep.  Slot matches are applied
+ *                to the directory listing.  ID matches are applied using the
+ *                \c uevent file, so that config space is only read for the
+ *                devices that are kept.
+ */
+static int
+populate_entries( struct pci_system * p, int lazy,
+		  const struct pci_system_filter * filter )
+{
+    const int filter_ids = (filter != NULL) && (filter->num_ids != 0);
+    uint32_t * keys;
+    size_t n;
+    size_t i;
+    size_t kept = 0;
+    int err;
+
+
+    err = scan_sys_pci( & keys, & n );
+
+    /* Take the devices from the image published by pciaccessd, but only if
+     * it lists exactly the devices present.
+     */
+    if ( err == 0 && ! (p->flags & PCI_SYSTEM_INIT_NO_IMAGE)
+	 && pci_image_open( p ) == 0
+	 && ! image_is_current( p, keys, n ) ) {
+	pci_image_close( p );
+    }
+
+    if ( err == 0 && filter != NULL && filter->num_slots != 0 ) {
+	for ( i = 0 ; i < n ; i++ ) {
+	    struct pci_device tmp;
+
+	    tmp.domain = keys[i] >> 16;
+	    tmp.bus = (keys[i] >> 8) & 0xff;
+	    tmp.dev = (keys[i] >> 3) & 0x1f;
+	    tmp.func = keys[i] & 0x07;
+	    if ( pci_system_filter_match( filter, & tmp, 0 ) )
+		keys[ kept++ ] = keys[i];
+	}
+
+	n = kept;
+	kept = 0;
+    }
+
+    if ( err == 0 && n > 0 ) {
 	p->devices = calloc( n, sizeof( struct pci_device_private ) );
 
 	if (p->devices != NULL) {
 	    for (i = 0 ; i < n ; i++) {
-		uint8_t config[48];
-		pciaddr_t bytes;
-		unsigned dom, bus, dev, func;
 		struct pci_device_private *device =
-			(struct pci_device_private *) &p->devices[i];
-
-
-		sscanf(devices[i]->d_name, "%04x:%02x:%02x.%1u",
-		       & dom, & bus, & dev, & func);
-
-		device->base.domain = dom;
-		device->base.bus = bus;
-		device->base.dev = dev;
-		device->base.func = func;
-
-
-		err = pci_device_linux_sysfs_read(& device->base, config, 0,
-						  48, & bytes);
-		if ((bytes == 48) && !err) {
-		    device->base.vendor_id = (uint16_t)config[0]
-			+ ((uint16_t)config[1] << 8);
-		    device->base.device_id = (uint16_t)config[2]
-			+ ((uint16_t)config[3] << 8);
-		    device->base.device_class = (uint32_t)config[9]
-			+ ((uint32_t)config[10] << 8)
-			+ ((uint32_t)config[11] << 16);
-		    device->base.revision = config[8];
-		    device->base.subvendor_id = (uint16_t)config[44]
-			+ ((uint16_t)config[45] << 8);
-		    device->base.subdevice_id = (uint16_t)config[46]
-			+ ((uint16_t)config[47] << 8);
+			(struct pci_device_private *) &p->devices[kept];
+
+
+		device->base.domain = keys[i] >> 16;
+		device->base.bus = (keys[i] >> 8) & 0xff;
+		device->base.dev = (keys[i] >> 3) & 0x1f;
+		device->base.func = keys[i] & 0x07;
+		device->sys = p;
+		device->config_fd = -1;
+		device->config_lock_fd = -1;
+
+		if (p->image != NULL) {
+		    pci_image_fill_identity(
+			pci_image_find(p->image, device->base.domain,
+				       device->base.bus, device->base.dev,
+				       device->base.func),
+			& device->base);
+
+		    if (filter_ids
+			&& !pci_system_filter_match(filter, & device->base, 1)) {
+			memset(device, 0, sizeof(*device));
+			continue;
+		    }
+
+		    kept++;
+		    continue;
+		}
+
+		if (filter_ids) {
+		    err = pci_device_linux_sysfs_read_uevent(& device->base);
+		    if (err) {
+			err = pci_device_linux_sysfs_read_identity(& device->base,
+								   0);
+			if (err) {
+			    break;
+			}
+		    }
+
+		    if (!pci_system_filter_match(filter, & device->base, 1)) {
+			memset(device, 0, sizeof(*device));
+			continue;
+		    }
+
+		    kept++;
+		    if (p->flags & PCI_SYSTEM_INIT_UEVENT) {
+			continue;
+		    }
+
+		    err = pci_device_linux_sysfs_read_identity(& device->base, 1);
+		    if (err) {
+			break;
+		    }
+
+		    continue;
+		}
+
+		kept++;
+		if (lazy) {
+		    device->identity_pending = 1;
+		    continue;
 		}
 
+		err = pci_device_linux_sysfs_fill_identity(& device->base);
 		if (err) {
 		    break;
 		}
 	    }
+
+	    p->num_devices = kept;
 	}
 	else {
 	    err = ENOMEM;
 	}
     }
 
-    for (i = 0; i < n; i++)
-	free(devices[i]);
-    free(devices);
+    free(keys);
 
     if (err) {
 	free(p->devices);
 	p->devices = NULL;
+	p->num_devices = 0;
     }
 
     return err;
@@ -205,11 +752,20 @@ pci_device_linux_sysfs_probe( struct pci_device * dev )
     int err;
 
 
+    /* The first probe can be answered by the shared image.
+     */
+    if ( ! __atomic_load_n( & ((struct pci_device_private *) dev)->probed,
+			    __ATOMIC_ACQUIRE )
+	 && pci_image_fill_probe( dev ) == 0 ) {
+	return 0;
+    }
+
     err = pci_device_linux_sysfs_read( dev, config, 0, 256, & bytes );
     if ( bytes >= 64 ) {
 	struct pci_device_private *priv = (struct pci_device_private *) dev;
 
 	dev->irq = config[60];
+	dev->revision = config[8];
 	priv->header_type = config[14];
 
 
@@ -350,26 +906,39 @@ pci_device_linux_sysfs_read_rom( struct pci_device * dev, void * buffer )
 }
 
 
+/**
+ * Get a file descriptor for a device's sysfs config file.
+ *
+ * The device's cached descriptor is returned if it allows the requested
+ * access.  Otherwise, the file is opened, and the new descriptor is cached
+ * if the device has none yet and the cache is not full.
+ *
+ * \param dev         Device whose config file is wanted.
+ * \param write       Non-zero if the descriptor will be used for writing.
+ * \param must_close  Set to non-zero if the caller must close the returned
+ *                    descriptor after use.
+ *
+ * \return
+ * A file descriptor, or -1 with \c errno set on failure.
+ */
 static int
-pci_device_linux_sysfs_read( struct pci_device * dev, void * data,
-			     pciaddr_t offset, pciaddr_t size,
-			     pciaddr_t * bytes_read )
+config_fd_get( struct pci_device * dev, int write, int * must_close )
 {
+    struct pci_device_private * const priv =
+	(struct pci_device_private *) dev;
     char name[256];
-    pciaddr_t temp_size = size;
-    int err = 0;
+    int cached = __atomic_load_n( & priv->config_fd, __ATOMIC_ACQUIRE );
+    int writable = 1;
+    int expected = -1;
     int fd;
-    char *data_bytes = data;
 
-    if ( bytes_read != NULL ) {
-	*bytes_read = 0;
+    *must_close = 0;
+    if ( (cached != -1)
+	 && (! write || __atomic_load_n( & priv->config_fd_writable,
+					 __ATOMIC_ACQUIRE )) ) {
+	return cached;
     }
 
-    /* Each device has a directory under sysfs.  Within that directory there
-     * is a file named "config".  This file used to access the PCI config
-     * space.  It is used here to obtain most of the information about the
-     * device.
-     */
     snprintf( name, 255, "%s/%04x:%02x:%02x.%1u/config",
 	      SYS_BUS_PCI,
 	      dev->domain,
@@ -377,11 +946,88 @@ pci_device_linux_sysfs_read( struct pci_device * dev, void * data,
 	      dev->dev,
 	      dev->func );
 
-    fd = open( name, O_RDONLY );
+    if ( (cached != -1)
+	 || (__atomic_add_fetch( & config_fd_count, 1, __ATOMIC_RELAXED )
+	     > config_fd_limit) ) {
+	if ( cached == -1 ) {
+	    __atomic_sub_fetch( & config_fd_count, 1, __ATOMIC_RELAXED );
+	}
+
+	*must_close = 1;
+	return open( name, (write ? O_WRONLY : O_RDONLY) | O_CLOEXEC );
+    }
+
+    /* Unprivileged users can usually only read the config file.
+     */
+    fd = open( name, O_RDWR | O_CLOEXEC );
     if ( fd == -1 ) {
-	return errno;
+	writable = 0;
+	fd = (write) ? -1 : open( name, O_RDONLY | O_CLOEXEC );
     }
 
+    if ( fd == -1 ) {
+	const int saved_errno = errno;
+
+	__atomic_sub_fetch( & config_fd_count, 1, __ATOMIC_RELAXED );
+	if ( write ) {
+	    *must_close = 1;
+	    fd = open( name, O_WRONLY | O_CLOEXEC );
+	}
+
+	if ( fd == -1 ) {
+	    errno = saved_errno;
+	}
+
+	return fd;
+    }
+
+    if ( ! __atomic_compare_exchange_n( & priv->config_fd, & expected, fd, 0,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ) ) {
+	/* Another thread cached a descriptor first.
+	 */
+	__atomic_sub_fetch( & config_fd_count, 1, __ATOMIC_RELAXED );
+	*must_close = 1;
+	return fd;
+    }
+
+    /* Until this is published, writers see a read-only descriptor and open
+     * their own.
+     */
+    __atomic_store_n( & priv->config_fd_writable, writable, __ATOMIC_RELEASE );
+
+    return fd;
+}
+
+
+static void
+config_fd_put( int fd, int must_close )
+{
+    if ( must_close ) {
+	close( fd );
+    }
+}
+
+
+/**
+ * Read a range of an open sysfs config file.
+ *
+ * \param fd          File descriptor of the device's config file.
+ * \param data        Location to store the data.
+ * \param offset      Initial byte offset to read.
+ * \param size        Total number of bytes to read.
+ * \param bytes_read  Location to store the actual number of bytes read.
+ *                    This pointer may be \c NULL.
+ *
+ * \return
+ * Zero on success or an \c errno value on failure.
+ */
+static int
+config_pread( int fd, void * data, pciaddr_t offset, pciaddr_t size,
+	      pciaddr_t * bytes_read )
+{
+    pciaddr_t temp_size = size;
+    int err = 0;
+    char *data_bytes = data;
 
     while ( temp_size > 0 ) {
 	const ssize_t bytes = pread64( fd, data_bytes, temp_size, offset );
@@ -405,7 +1051,76 @@ pci_device_linux_sysfs_read( struct pci_device * dev, void * data,
 	*bytes_read = size - temp_size;
     }
 
-    close( fd );
+    return err;
+}
+
+
+/**
+ * Write a range of an open sysfs config file.
+ *
+ * \sa config_pread
+ */
+static int
+config_pwrite( int fd, const void * data, pciaddr_t offset, pciaddr_t size,
+	       pciaddr_t * bytes_written )
+{
+    pciaddr_t temp_size = size;
+    int err = 0;
+    const char *data_bytes = data;
+
+    while ( temp_size > 0 ) {
+	const ssize_t bytes = pwrite64( fd, data_bytes, temp_size, offset );
+
+	/* If zero bytes were written, then we assume it's the end of the
+	 * config file.
+	 */
+	if ( bytes == 0 )
+	    break;
+	if ( bytes < 0 ) {
+	    err = errno;
+	    break;
+	}
+
+	temp_size -= bytes;
+	offset += bytes;
+	data_bytes += bytes;
+    }
+
+    if ( bytes_written != NULL ) {
+	*bytes_written = size - temp_size;
+    }
+
+    return err;
+}
+
+
+static int
+pci_device_linux_sysfs_read( struct pci_device * dev, void * data,
+			     pciaddr_t offset, pciaddr_t size,
+			     pciaddr_t * bytes_read )
+{
+    int err = 0;
+    int fd;
+    int must_close;
+
+    if ( bytes_read != NULL ) {
+	*bytes_read = 0;
+    }
+
+    /* Each device has a directory under sysfs.  Within that directory there
+     * is a file named "config".  This file used to access the PCI config
+     * space.  It is used here to obtain most of the information about the
+     * device.
+     */
+    fd = config_fd_get( dev, 0, & must_close );
+    if ( fd == -1 ) {
+	return errno;
+    }
+
+
+    err = config_pread( fd, data, offset, size, bytes_read );
+
+    config_fd_put( fd, must_close );
     return err;
 }
 
@@ -415,11 +1130,9 @@ pci_device_linux_sysfs_write( struct pci_device * dev, const void * data,
 			     pciaddr_t offset, pciaddr_t size,
 			     pciaddr_t * bytes_written )
 {
-    char name[256];
-    pciaddr_t temp_size = size;
     int err = 0;
     int fd;
-    const char *data_bytes = data;
+    int must_close;
 
     if ( bytes_written != NULL ) {
 	*bytes_written = 0;
@@ -430,42 +1143,73 @@ pci_device_linux_sysfs_write( struct pci_device * dev, const void * data,
      * space.  It is used here to obtain most of the information about the
      * device.
      */
-    snprintf( name, 255, "%s/%04x:%02x:%02x.%1u/config",
-	      SYS_BUS_PCI,
-	      dev->domain,
-	      dev->bus,
-	      dev->dev,
-	      dev->func );
+    fd = config_fd_get( dev, 1, & must_close );
+    if ( fd == -1 ) {
+	return errno;
+    }
 
-    fd = open( name, O_WRONLY );
+
+    err = config_pwrite( fd, data, offset, size, bytes_written );
+
+    config_fd_put( fd, must_close );
+    return err;
+}
+
+
+/**
+ * Read several ranges of config space through one descriptor for the
+ * device's sysfs config file.
+ */
+static int
+pci_device_linux_sysfs_readv( struct pci_device * dev,
+			      struct pci_cfg_span * spans,
+			      unsigned num_spans )
+{
+    unsigned i;
+    int err = 0;
+    int fd;
+    int must_close;
+
+    fd = config_fd_get( dev, 0, & must_close );
     if ( fd == -1 ) {
 	return errno;
     }
 
+    for ( i = 0 ; (i < num_spans) && (err == 0) ; i++ ) {
+	err = config_pread( fd, spans[i].data, spans[i].offset,
+			    spans[i].size, & spans[i].bytes );
+    }
 
-    while ( temp_size > 0 ) {
-	const ssize_t bytes = pwrite64( fd, data_bytes, temp_size, offset );
+    config_fd_put( fd, must_close );
+    return err;
+}
 
-	/* If zero bytes were written, then we assume it's the end of the
-	 * config file.
-	 */
-	if ( bytes == 0 )
-	    break;
-	if ( bytes < 0 ) {
-	    err = errno;
-	    break;
-	}
 
-	temp_size -= bytes;
-	offset += bytes;
-	data_bytes += bytes;
+/**
+ * Write several ranges of config space through one descriptor for the
+ * device's sysfs config file.
+ */
+static int
+pci_device_linux_sysfs_writev( struct pci_device * dev,
+			       struct pci_cfg_span * spans,
+			       unsigned num_spans )
+{
+    unsigned i;
+    int err = 0;
+    int fd;
+    int must_close;
+
+    fd = config_fd_get( dev, 1, & must_close );
+    if ( fd == -1 ) {
+	return errno;
     }
 
-    if ( bytes_written != NULL ) {
-	*bytes_written = size - temp_size;
+    for ( i = 0 ; (i < num_spans) && (err == 0) ; i++ ) {
+	err = config_pwrite( fd, spans[i].data, spans[i].offset,
+			     spans[i].size, & spans[i].bytes );
     }
 
-    close( fd );
+    config_fd_put( fd, must_close );
     return err;
 }
 
@@ -573,8 +1317,9 @@ pci_device_linux_sysfs_map_range(struct pci_device *dev,
         sentry.type = MTRR_TYPE_WRCOMB;
     }
 
-    if (pci_sys->mtrr_fd != -1 && sentry.type != MTRR_TYPE_UNCACHABLE) {
-	if (ioctl(pci_sys->mtrr_fd, MTRRIOC_ADD_ENTRY, &sentry) < 0) {
+    if (pci_device_system(dev)->mtrr_fd != -1
+	&& sentry.type != MTRR_TYPE_UNCACHABLE) {
+	if (ioctl(pci_device_system(dev)->mtrr_fd, MTRRIOC_ADD_ENTRY, &sentry) < 0) {
 	    /* FIXME: Should we report an error in this case?
 	     */
 	    fprintf(stderr, "error setting MTRR "
@@ -648,8 +1393,9 @@ pci_device_linux_sysfs_unmap_range(struct pci_device *dev,
         sentry.type = MTRR_TYPE_WRCOMB;
     }
 
-    if (pci_sys->mtrr_fd != -1 && sentry.type != MTRR_TYPE_UNCACHABLE) {
-	if (ioctl(pci_sys->mtrr_fd, MTRRIOC_DEL_ENTRY, &sentry) < 0) {
+    if (pci_device_system(dev)->mtrr_fd != -1
+	&& sentry.type != MTRR_TYPE_UNCACHABLE) {
+	if (ioctl(pci_device_system(dev)->mtrr_fd, MTRRIOC_DEL_ENTRY, &sentry) < 0) {
 	    /* FIXME: Should we report an error in this case?
 	     */
 	    fprintf(stderr, "error setting MTRR "
@@ -761,8 +1507,8 @@ pci_device_linux_sysfs_open_legacy_io(struct pci_io_handle *ret,
 
     /* First check if there's a legacy io method for the device */
     while (dev) {
-	snprintf(name, PATH_MAX, "/sys/class/pci_bus/%04x:%02x/legacy_io",
-		 dev->domain, dev->bus);
+	snprintf(name, PATH_MAX, "%s/class/pci_bus/%04x:%02x/legacy_io",
+		 sysfs_root, dev->domain, dev->bus);
 
 	ret->fd = open(name, O_RDWR);
 	if (ret->fd >= 0)
@@ -859,8 +1605,8 @@ pci_device_linux_sysfs_map_legacy(struct pci_device *dev, pciaddr_t base,
 
     /* First check if there's a legacy memory method for the device */
     while (dev) {
-	snprintf(name, PATH_MAX, "/sys/class/pci_bus/%04x:%02x/legacy_mem",
-		 dev->domain, dev->bus);
+	snprintf(name, PATH_MAX, "%s/class/pci_bus/%04x:%02x/legacy_mem",
+		 sysfs_root, dev->domain, dev->bus);
 
 	fd = open(name, flags);
 	if (fd >= 0)
@@ -892,18 +1638,126 @@ pci_device_linux_sysfs_unmap_legacy(struct pci_device *dev, void *addr, pciaddr_
 }
 
 
+/**
+ * Lock a range of a device's config space against other processes.
+ *
+ * An open file description lock is taken on the corresponding range of the
+ * sysfs config file.  Unlike a classic POSIX record lock, it is not dropped
+ * when some other descriptor for the file is closed by this process.
+ */
+static int
+pci_device_linux_sysfs_lock_config( struct pci_device * dev,
+				    pciaddr_t offset, pciaddr_t size,
+				    int * contended )
+{
+#ifdef F_OFD_SETLK
+    struct pci_device_private * const priv =
+	(struct pci_device_private *) dev;
+    struct flock fl;
+    int must_close;
+    int fd;
+
+    fd = config_fd_get( dev, 1, & must_close );
+    if ( fd == -1 ) {
+	return errno;
+    }
+
+    memset( & fl, 0, sizeof( fl ) );
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = offset;
+    fl.l_len = size;
+
+    if ( fcntl( fd, F_OFD_SETLK, & fl ) == -1 ) {
+	if ( (errno != EAGAIN) && (errno != EACCES) ) {
+	    const int err = errno;
+
+	    config_fd_put( fd, must_close );
+	    return err;
+	}
+
+	*contended = 1;
+	while ( fcntl( fd, F_OFD_SETLKW, & fl ) == -1 ) {
+	    if ( errno != EINTR ) {
+		const int err = errno;
+
+		config_fd_put( fd, must_close );
+		return err;
+	    }
+	}
+    }
+
+    priv->config_lock_fd = fd;
+    priv->config_lock_close = must_close;
+    return 0;
+#else
+    (void) dev;
+    (void) offset;
+    (void) size;
+    (void) contended;
+    return ENOSYS;
+#endif
+}
+
+static void
+pci_device_linux_sysfs_unlock_config( struct pci_device * dev,
+				      pciaddr_t offset, pciaddr_t size )
+{
+#ifdef F_OFD_SETLK
+    struct pci_device_private * const priv =
+	(struct pci_device_private *) dev;
+    struct flock fl;
+
+    /* Closing the descriptor drops the lock.
+     */
+    if ( priv->config_lock_close ) {
+	close( priv->config_lock_fd );
+    }
+    else {
+	memset( & fl, 0, sizeof( fl ) );
+	fl.l_type = F_UNLCK;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = offset;
+	fl.l_len = size;
+	(void) fcntl( priv->config_lock_fd, F_OFD_SETLK, & fl );
+    }
+
+    priv->config_lock_fd = -1;
+    priv->config_lock_close = 0;
+#else
+    (void) dev;
+    (void) offset;
+    (void) size;
+#endif
+}
+
+static void
+pci_device_linux_sysfs_destroy_device( struct pci_device * dev )
+{
+    struct pci_device_private * const priv =
+	(struct pci_device_private *) dev;
+
+    if ( priv->config_fd != -1 ) {
+	close( priv->config_fd );
+	priv->config_fd = -1;
+	__atomic_sub_fetch( & config_fd_count, 1, __ATOMIC_RELAXED );
+    }
+}
+
 static void
-pci_system_linux_destroy(void)
+pci_system_linux_destroy(struct pci_system *sys)
 {
 #ifdef HAVE_MTRR
-	if (pci_sys->mtrr_fd != -1)
-		close(pci_sys->mtrr_fd);
+	if (sys->mtrr_fd != -1)
+		close(sys->mtrr_fd);
 #endif
+	pci_image_close(sys);
+	pci_linux_broker_disconnect(sys);
 }
 
 static const struct pci_system_methods linux_sysfs_methods = {
-    .destroy = pci_system_linux_destroy,
-    .destroy_device = NULL,
+    .destroy_system = pci_system_linux_destroy,
+    .destroy_device = pci_device_linux_sysfs_destroy_device,
     .read_rom = pci_device_linux_sysfs_read_rom,
     .probe = pci_device_linux_sysfs_probe,
     .map_range = pci_device_linux_sysfs_map_range,
@@ -911,6 +1765,11 @@ static const struct pci_system_methods linux_sysfs_methods = {
 
     .read = pci_device_linux_sysfs_read,
     .write = pci_device_linux_sysfs_write,
+    .readv = pci_device_linux_sysfs_readv,
+    .writev = pci_device_linux_sysfs_writev,
+    .lock_config = pci_device_linux_sysfs_lock_config,
+    .unlock_config = pci_device_linux_sysfs_unlock_config,
+    .materialize = pci_device_linux_sysfs_fill_identity,
 
     .fill_capabilities = pci_fill_capabilities_generic,
     .enable = pci_device_linux_sysfs_enable,
@@ -930,3 +1789,16 @@ static const struct pci_system_methods linux_sysfs_methods = {
     .map_legacy = pci_device_linux_sysfs_map_legacy,
     .unmap_legacy = pci_device_linux_sysfs_unmap_legacy,
 };
+
+
+static void
+broker_methods_init( void )
+{
+    linux_broker_methods = linux_sysfs_methods;
+    linux_broker_methods.read = pci_device_linux_broker_read;
+    linux_broker_methods.write = pci_device_linux_broker_write;
+    linux_broker_methods.readv = pci_device_linux_broker_readv;
+    linux_broker_methods.writev = pci_device_linux_broker_writev;
+    linux_broker_methods.map_range = pci_device_linux_broker_map_range;
+    linux_broker_methods.unmap_range = pci_device_linux_broker_unmap_range;
+}
@@ -37,14 +37,150 @@
 # define _pci_hidden
 #endif /* GNUC >= 4 */
 
+#include <pthread.h>
+
 struct pci_device_mapping;
+struct pci_device_private;
+
+/**
+ * \name Configuration space sizes
+ */
+/*@{*/
+#define PCI_CONFIG_SPACE_SIZE       256   /**< Conventional PCI header. */
+#define PCI_CONFIG_SPACE_EXT_SIZE   4096  /**< PCI Express extended space. */
+/*@}*/
+
+/**
+ * Largest standard capability ID tracked in
+ * \c pci_device_private::cap_offsets.
+ */
+#define PCI_CAP_ID_MAX  0x15
+
+/**
+ * Entry in the extended capability index of a PCI Express device.
+ */
+struct pci_ext_cap {
+    uint16_t id;             /**< Extended capability ID. */
+    uint16_t offset;         /**< Offset in configuration space. */
+    uint16_t dvsec_vendor;   /**< DVSEC vendor ID, if \c id is DVSEC. */
+    uint16_t dvsec_id;       /**< DVSEC ID, if \c id is DVSEC. */
+};
+
+/**
+ * How the configuration register shadow treats a byte of config space.
+ *
+ * \sa pci_device_cfg_reg_class
+ */
+enum pci_cfg_reg_class {
+    /** Changes on its own (e.g., status).  Always read from the device. */
+    PCI_CFG_REG_VOLATILE = 0,
+
+    /**
+     * Never changes after enumeration (e.g., IDs).  Served from the shadow
+     * once read; a write drops it from the shadow.
+     */
+    PCI_CFG_REG_STATIC,
+
+    /**
+     * Only changes when written (e.g., command).  Served from the shadow
+     * once read; a write through the library drops it from the shadow, so
+     * that the value the device actually kept is read back.
+     */
+    PCI_CFG_REG_WRITE_TRACKED
+};
 
 int pci_fill_capabilities_generic( struct pci_device * dev );
+int pci_device_config_snapshot( struct pci_device_private * priv );
+enum pci_cfg_reg_class pci_device_cfg_reg_class(
+    const struct pci_device_private * priv, unsigned offset );
+int pci_device_config_cache_read( struct pci_device_private * priv,
+    void * data, pciaddr_t offset, pciaddr_t size );
+void pci_device_config_cache_fill( struct pci_device_private * priv,
+    const void * data, pciaddr_t offset, pciaddr_t size );
+void pci_device_config_cache_write( struct pci_device_private * priv,
+    const void * data, pciaddr_t offset, pciaddr_t size );
+int pci_device_config_readahead( struct pci_device_private * priv,
+    void * data, pciaddr_t offset, pciaddr_t size );
+void pci_device_config_readahead_invalidate(
+    struct pci_device_private * priv );
+uint64_t pci_monotonic_ns( void );
+
+/**
+ * Internal flag for \c pci_device_cfg_readv_flags: neither read nor update
+ * the register shadow.  Used by library threads that must not touch the
+ * per-device state owned by the application's threads.
+ */
+#define PCI_DEV_CFG_FLAG_NO_SHADOW  (1U<<31)
+
+/**
+ * Size and alignment of a config space read-ahead line.
+ */
+#define PCI_CFG_LINE_SIZE  64
+
+/**
+ * Config space read-ahead line.
+ *
+ * \sa pci_system_set_cfg_readahead
+ */
+struct pci_cfg_line {
+    uint64_t stamp;     /**< CLOCK_MONOTONIC time of the read, in ns. */
+    unsigned offset;    /**< Offset of the line in config space. */
+    unsigned size;      /**< Bytes of \c data read from the device. */
+    uint8_t data[PCI_CFG_LINE_SIZE];
+};
+int pci_device_index_capabilities( struct pci_device_private * priv );
 int pci_device_generic_unmap_range(struct pci_device *dev,
     struct pci_device_mapping *map);
 
+/**
+ * Contiguous range of config space handled by one back-end access.
+ *
+ * \sa pci_system_methods::readv, pci_system_methods::writev
+ */
+struct pci_cfg_span {
+    pciaddr_t offset;   /**< Offset of the range in config space. */
+    pciaddr_t size;     /**< Size of the range in bytes. */
+    void * data;        /**< Data read or to be written. */
+    pciaddr_t bytes;    /**< Bytes actually transferred. */
+};
+
+/**
+ * Item of work for the internal worker pool.
+ *
+ * Embed this as the first member of a larger structure carrying the work's
+ * arguments.
+ *
+ * \sa pci_workqueue_submit
+ */
+struct pci_work {
+    void (*func)( struct pci_work * work );
+    struct pci_work * next;
+};
+
+unsigned pci_workqueue_num_threads( void );
+int pci_workqueue_submit( struct pci_work * work );
+void pci_workqueue_cleanup( void );
+int pci_parallel_for( unsigned count,
+    void (*func)( void * ctx, unsigned index ), void * ctx,
+    unsigned max_threads );
+void pci_cfg_async_cleanup( void );
+void pci_watch_cleanup( void );
+
+struct pci_system;
+
+void pci_cfg_async_drop_system( struct pci_system * sys );
+void pci_watch_drop_system( struct pci_system * sys );
+
 struct pci_system_methods {
     void (*destroy)( void );
+
+    /**
+     * Release the platform resources of a system.  Used instead of
+     * \c destroy when present, which allows a back-end to support more than
+     * one system, see \c pci_context_create.
+     */
+    void (*destroy_system)( struct pci_system * sys );
+
     void (*destroy_device)( struct pci_device * dev );
     int (*read_rom)( struct pci_device * dev, void * buffer );
     int (*probe)( struct pci_device * dev );
@@ -58,6 +194,26 @@ struct pci_system_methods {
     int (*write)(struct pci_device * dev, const void * data, pciaddr_t offset,
 		pciaddr_t size, pciaddr_t * bytes_written );
 
+    int (*readv)(struct pci_device * dev, struct pci_cfg_span * spans,
+		 unsigned num_spans );
+    int (*writev)(struct pci_device * dev, struct pci_cfg_span * spans,
+		  unsigned num_spans );
+
+    /**
+     * Take and release a lock on a range of config space that is shared
+     * with other processes.  \c lock_config sets \c *contended if it had to
+     * wait.  Calls for a device are serialized by the caller.
+     */
+    int (*lock_config)(struct pci_device * dev, pciaddr_t offset,
+		       pciaddr_t size, int * contended );
+    void (*unlock_config)(struct pci_device * dev, pciaddr_t offset,
+			  pciaddr_t size );
+
+    /**
+     * Fill in the identity fields of a device that was enumerated lazily.
+     */
+    int (*materialize)( struct pci_device * dev );
+
     int (*fill_capabilities)( struct pci_device * dev );
     void (*enable)( struct pci_device *dev );
     int (*boot_vga)( struct pci_device *dev );
@@ -95,19 +251,155 @@ struct pci_io_handle {
     pciaddr_t base;
     pciaddr_t size;
     int fd;
+
+    /** System the handle was opened on. */
+    struct pci_system *sys;
+
+    /** Links in the list of open handles, see \c pci_io_cleanup. */
+    struct pci_io_handle *prev;
+    struct pci_io_handle *next;
 };
 
 struct pci_device_private {
     struct pci_device  base;
     const char * device_string;
 
+    /**
+     * System, i.e., the context, the device belongs to.
+     *
+     * \sa pci_device_system
+     */
+    struct pci_system * sys;
+
+    /**
+     * Lock of the device's mutable state, see \c pci_device_lock.
+     */
+    pthread_mutex_t lock;
+
+    /**
+     * Lock serializing probes of the device, and the reading of its identity
+     * fields when it was enumerated lazily.  Back-ends may read config space
+     * while probing, so this is distinct from \c lock.
+     */
+    pthread_mutex_t probe_lock;
+
+    /**
+     * Non-zero while the identity fields of \c base have not been read yet.
+     * Accessed atomically.
+     *
+     * \sa PCI_SYSTEM_INIT_LAZY
+     */
+    unsigned identity_pending;
+
+    /**
+     * Set once \c pci_device_probe has succeeded for the device.  Accessed
+     * atomically.
+     *
+     * \sa pci_system_probe_all
+     */
+    unsigned probed;
+
     uint8_t header_type;
 
+    /**
+     * \name Configuration space snapshot
+     *
+     * Copy of the device's configuration space taken with a single backend
+     * read by \c pci_device_config_snapshot.  The buffer is always
+     * \c PCI_CONFIG_SPACE_EXT_SIZE bytes, but only the first \c config_size
+     * bytes hold data read from the device.
+     *
+     * The same buffer doubles as the configuration register shadow.  A set
+     * bit in \c config_valid means the corresponding byte of \c config is
+     * known to match the device and may be returned without a back-end
+     * read.  \c config_valid lives in the same allocation as \c config.
+     */
+    /*@{*/
+    uint8_t * config;
+    uint8_t * config_valid;
+    unsigned config_size;
+
+    /**
+     * Sequence count of \c config: odd while its contents are being changed,
+     * incremented again once they have been.
+     *
+     * \sa pci_device_cfg_generation
+     */
+    uint64_t config_generation;
+    /*@}*/
+
+    /**
+     * Snapshot from the previous \c pci_system_config_diff call, followed by
+     * the comparison mask, in one allocation.
+     */
+    uint8_t * config_prev;
+    unsigned config_prev_size;
+
+    /**
+     * Most recent read-ahead line, or \c NULL.
+     */
+    struct pci_cfg_line * cfg_line;
+
+    /**
+     * Back-end file descriptor kept open for config space access, or -1,
+     * and whether it was opened for writing.  Only used by back-ends that
+     * access config space through a file.  Both are accessed atomically;
+     * \c config_fd_writable is only published after \c config_fd is set.
+     */
+    int config_fd;
+    unsigned config_fd_writable;
+
+    /**
+     * Descriptor holding the back-end's config space lock, and whether it
+     * must be closed on unlock.
+     *
+     * \sa pci_system_methods::lock_config
+     */
+    int config_lock_fd;
+    unsigned config_lock_close:1;
+
+    /**
+     * Statistics of atomic read-modify-write accesses.
+     *
+     * \sa pci_device_get_cfg_lock_stats
+     */
+    struct pci_cfg_lock_stats lock_stats;
+
+    /**
+     * \name Asynchronous config space access
+     *
+     * Requests queued for the device, in submission order.  The head is the
+     * request being run.  \c async_pending also counts requests that have
+     * completed but were not yet reaped.
+     */
+    /*@{*/
+    struct pci_cfg_request * async_head;
+    struct pci_cfg_request * async_tail;
+    unsigned async_pending;
+    /*@}*/
+
     /**
      * \name PCI Capabilities
      */
     /*@{*/
     const struct pci_agp_info * agp;   /**< AGP capability information. */
+
+    /**
+     * Offset of the first instance of each standard capability, indexed by
+     * capability ID.  Zero means the capability is not present.  Only valid
+     * once \c caps_indexed is set.  The flags are set atomically, once the
+     * index they guard is complete.
+     */
+    uint8_t cap_offsets[PCI_CAP_ID_MAX + 1];
+    unsigned caps_indexed;
+
+    /**
+     * Extended capabilities, in list order.  Only valid once
+     * \c ext_caps_indexed is set.
+     */
+    struct pci_ext_cap * ext_caps;
+    unsigned num_ext_caps;
+    unsigned ext_caps_indexed;
     /*@}*/
 
     /**
@@ -132,9 +424,95 @@ struct pci_device_private {
     struct pci_device_mapping *mappings;
     unsigned num_mappings;
     /*@}*/
+
+    /**
+     * Record of the device in the system's shared image, or \c NULL if the
+     * device was enumerated directly.
+     *
+     * \sa pci_system_write_image
+     */
+    const struct pci_image_device * image;
 };
 
 
+/**
+ * \name Shared device table image
+ *
+ * Read-only snapshot of the device table, written by \c pciaccessd with
+ * \c pci_system_write_image and mapped by clients at initialization.  The
+ * file is replaced as a whole on each update, so a mapping never changes.
+ * All offsets are from the start of the image.
+ */
+/*@{*/
+#define PCI_IMAGE_MAGIC          0x49494350U     /**< "PCII" */
+#define PCI_IMAGE_VERSION        1
+
+#define PCI_IMAGE_REGION_IO         (1U<<0)
+#define PCI_IMAGE_REGION_64         (1U<<1)
+#define PCI_IMAGE_REGION_PREFETCH   (1U<<2)
+
+/** The record has the results of \c pci_device_probe. */
+#define PCI_IMAGE_DEVICE_PROBED     (1U<<0)
+/** The name fields are valid, even if zero. */
+#define PCI_IMAGE_DEVICE_NAMES      (1U<<1)
+/** The device is below a bridge, described by the \c parent_ fields. */
+#define PCI_IMAGE_DEVICE_PARENT     (1U<<2)
+
+struct pci_image_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t generation;        /**< Incremented by each update. */
+    uint64_t size;              /**< Size of the whole image. */
+    uint32_t num_devices;
+    uint32_t device_size;       /**< Size of a device record. */
+    uint32_t strings;           /**< Offset of the string table. */
+    uint32_t strings_size;
+};
+
+struct pci_image_region {
+    uint64_t base_addr;
+    uint64_t size;
+    uint32_t flags;             /**< \c PCI_IMAGE_REGION_ flags. */
+    uint32_t reserved;
+};
+
+/**
+ * Device record.  Records follow the header, sorted by address.
+ */
+struct pci_image_device {
+    uint16_t domain;
+    uint8_t bus;
+    uint8_t dev;
+    uint8_t func;
+    uint8_t revision;
+    uint8_t header_type;
+    uint8_t reserved;
+
+    uint16_t vendor_id;
+    uint16_t device_id;
+    uint16_t subvendor_id;
+    uint16_t subdevice_id;
+    uint32_t device_class;
+    uint32_t flags;             /**< \c PCI_IMAGE_DEVICE_ flags. */
+
+    uint16_t parent_domain;
+    uint8_t parent_bus;
+    uint8_t parent_dev;
+    uint8_t parent_func;
+    uint8_t reserved2[3];
+
+    int32_t irq;
+    uint32_t vendor_name;       /**< String offset, or zero if unknown. */
+    uint32_t device_name;       /**< String offset, or zero if unknown. */
+    uint32_t reserved3;
+
+    struct pci_image_region regions[6];
+    uint64_t rom_base;
+    uint64_t rom_size;
+};
+/*@}*/
+
+
 /**
  * Base type for tracking PCI subsystem information.
  */
@@ -154,6 +532,37 @@ struct pci_system {
      */
     struct pci_device_private * devices;
 
+    /**
+     * How long, in microseconds, a config space read-ahead line may be used
+     * to answer reads.  Zero disables read-ahead.
+     */
+    unsigned cfg_readahead_usec;
+
+    /**
+     * \c PCI_SYSTEM_INIT_ flags the system was created with.
+     */
+    unsigned flags;
+
+    /**
+     * Shared device table image the devices were read from, if any, and
+     * the size of its mapping.
+     */
+    const struct pci_image_header * image;
+    size_t image_size;
+
+    /**
+     * Connection to \c pcibroker, if config accesses go through it.
+     */
+    struct pci_broker * broker;
+
+    /**
+     * Identities of the devices, one array per field, or \c NULL until it
+     * is built.
+     *
+     * \sa pci_system_index_get
+     */
+    struct pci_device_index * index;
+
 #ifdef HAVE_MTRR
     int mtrr_fd;
 #endif
@@ -163,13 +572,93 @@ struct pci_system {
     struct pci_device *vga_default_dev;
 };
 
+/**
+ * Devices to keep when initializing with \c pci_system_init_filtered or
+ * \c pci_system_init_filtered_slots.  An empty list places no constraint.
+ */
+struct pci_system_filter {
+    const struct pci_id_match * ids;
+    unsigned num_ids;
+    const struct pci_slot_match * slots;
+    unsigned num_slots;
+};
+
+/**
+ * An independent view of the PCI subsystem.
+ *
+ * \sa pci_context_create, pci_context_default
+ */
+struct pci_context {
+    struct pci_system * sys;
+};
+
+/**
+ * The system used by the API functions that do not take a context.
+ */
 extern struct pci_system * pci_sys;
 
-extern int pci_system_linux_sysfs_create( void );
+/**
+ * Get the system a device belongs to.
+ */
+static inline struct pci_system *
+pci_device_system( const struct pci_device * dev )
+{
+    return ((const struct pci_device_private *) dev)->sys;
+}
+
+extern int pci_system_create( unsigned flags,
+    const struct pci_system_filter * filter, int is_default,
+    struct pci_system ** sys );
+extern void pci_system_destroy( struct pci_system * sys );
+extern int pci_system_linux_sysfs_create( unsigned flags,
+    const struct pci_system_filter * filter, struct pci_system ** sys );
+extern int pci_linux_broker_connect( struct pci_system * sys );
+extern void pci_linux_broker_disconnect( struct pci_system * sys );
+extern int pci_device_linux_broker_read( struct pci_device * dev, void * data,
+    pciaddr_t offset, pciaddr_t size, pciaddr_t * bytes_read );
+extern int pci_device_linux_broker_write( struct pci_device * dev,
+    const void * data, pciaddr_t offset, pciaddr_t size,
+    pciaddr_t * bytes_written );
+extern int pci_device_linux_broker_readv( struct pci_device * dev,
+    struct pci_cfg_span * spans, unsigned num_spans );
+extern int pci_device_linux_broker_writev( struct pci_device * dev,
+    struct pci_cfg_span * spans, unsigned num_spans );
+extern int pci_device_linux_broker_map_range( struct pci_device * dev,
+    struct pci_device_mapping * map );
+extern int pci_device_linux_broker_unmap_range( struct pci_device * dev,
+    struct pci_device_mapping * map );
 extern int pci_system_freebsd_create( void );
 extern int pci_system_netbsd_create( void );
 extern int pci_system_openbsd_create( void );
 extern void pci_system_openbsd_init_dev_mem( int );
 extern int pci_system_solx_devfs_create( void );
 extern int pci_system_x86_create( void );
-extern void pci_io_cleanup( void );
+extern void pci_io_cleanup( struct pci_system * sys );
+extern int pci_image_open( struct pci_system * sys );
+extern void pci_image_close( struct pci_system * sys );
+extern const struct pci_image_device * pci_image_find(
+    const struct pci_image_header * image, uint32_t domain, uint32_t bus,
+    uint32_t dev, uint32_t func );
+extern void pci_image_fill_identity( const struct pci_image_device * rec,
+    struct pci_device * dev );
+extern int pci_image_fill_probe( struct pci_device * dev );
+extern int pci_image_get_name( const struct pci_device * dev, int vendor,
+    const char ** name );
+extern struct pci_device * pci_image_get_parent( struct pci_device * dev,
+    int * known );
+extern int pci_slot_match_device( const struct pci_slot_match * match,
+    const struct pci_device * dev );
+extern int pci_id_match_device( const struct pci_id_match * match,
+    const struct pci_device * dev );
+extern int pci_device_materialize( struct pci_device_private * priv );
+extern int pci_device_probe_once( struct pci_device_private * priv );
+extern const char * pci_getenv( const char * name );
+extern const struct pci_device_index * pci_system_index_get(
+    struct pci_system * sys );
+extern void pci_system_index_destroy( struct pci_system * sys );
+extern unsigned pci_device_index_match( const struct pci_device_index * idx,
+    const struct pci_id_match * match, unsigned start, unsigned end );
+extern void pci_device_lock( struct pci_device_private * priv );
+extern void pci_device_unlock( struct pci_device_private * priv );
+extern int pci_system_filter_match( const struct pci_system_filter * filter,
+    const struct pci_device * dev, int check_ids );